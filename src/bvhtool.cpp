@@ -0,0 +1,319 @@
+#ifdef COMPILER_CLANG
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+#else
+#define _CRT_SECURE_NO_DEPRECATE
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+
+#include "./slim/platforms/win32_base.h"
+#include "./slim/scene/bvh_builder.h"
+#include "./slim/scene/mesh_tracer.h"
+#include "./slim/serialization/mesh.h"
+
+// Or using the single-header file:
+// #include "../slim.h"
+
+#define BVH_STATS_MAX_LEAF_SIZE 32 // Leaves of this size or larger share the last bucket of the leaf size histogram
+#define BVH_STATS_MAX_DEPTH 256
+
+// Relative costs of the operations of a traversal, for estimating its cost (the absolute scale is arbitrary):
+#define TRAVERSAL_COST_PER_BOX_TEST 1.0f
+#define TRAVERSAL_COST_PER_TRIANGLE_BLOCK_TEST 2.0f
+
+#define AUTOTUNE_DEFAULT_RAY_COUNT 1000000
+#define AUTOTUNE_STACK_SIZE (255 * Max(1, BVH_WIDTH - 1) + 2) // Traversing a wide BVH can push up to BVH_WIDTH - 1 nodes per level
+#define AUTOTUNE_LEAF_SIZE_COUNT 5
+const u16 AUTOTUNE_LEAF_SIZES[AUTOTUNE_LEAF_SIZE_COUNT] = {1, 2, 4, 8, 16};
+
+struct BVHStats {
+    u32 leaf_sizes[BVH_STATS_MAX_LEAF_SIZE + 1];
+    u32 leaf_depths[BVH_STATS_MAX_DEPTH];
+    u32 leaf_count, internal_count, overlapping_siblings_count;
+    f32 sah_cost, average_leaf_size, average_leaf_depth;
+    f32 sibling_overlap_ratio;
+
+    // Expected per ray that hits the root, by the surface area heuristic:
+    f32 box_tests, triangle_block_tests, triangle_tests, traversal_cost;
+};
+
+// Surface area probabilities are relative to the root's surface area:
+BVHStats getStats(const BVH &bvh) {
+    BVHStats stats{};
+    stats.sah_cost = getSAHCost(bvh);
+    f32 root_area = bvh.nodes[0].aabb.area();
+    if (root_area <= 0) root_area = 1;
+
+    f32 overlap_area = 0, parent_area = 0;
+    stats.box_tests = 1;
+    for (u32 i = 0; i < bvh.node_count; i++) {
+        const BVHNode &node = bvh.nodes[i];
+        f32 probability = node.aabb.area() / root_area;
+        if (node.leaf_count) {
+            stats.leaf_sizes[Min(node.leaf_count, BVH_STATS_MAX_LEAF_SIZE)]++;
+            stats.leaf_depths[node.depth]++;
+            stats.leaf_count++;
+            stats.average_leaf_size += (f32)node.leaf_count;
+            stats.average_leaf_depth += (f32)node.depth;
+            stats.triangle_block_tests += probability * (f32)((node.leaf_count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE);
+            stats.triangle_tests += probability * (f32)node.leaf_count;
+        } else {
+            const AABB &left  = bvh.nodes[node.first_index    ].aabb;
+            const AABB &right = bvh.nodes[node.first_index + 1].aabb;
+            AABB overlap{maximum(left.min, right.min), minimum(left.max, right.max)};
+            if (overlap.min.x < overlap.max.x && overlap.min.y < overlap.max.y && overlap.min.z < overlap.max.z) {
+                overlap_area += overlap.area();
+                stats.overlapping_siblings_count++;
+            }
+            parent_area += node.aabb.area();
+            stats.internal_count++;
+            stats.box_tests += 2 * probability;
+        }
+    }
+    if (stats.leaf_count) {
+        stats.average_leaf_size /= (f32)stats.leaf_count;
+        stats.average_leaf_depth /= (f32)stats.leaf_count;
+    }
+    stats.sibling_overlap_ratio = parent_area > 0 ? overlap_area / parent_area : 0;
+    stats.traversal_cost = stats.box_tests * TRAVERSAL_COST_PER_BOX_TEST +
+                           stats.triangle_block_tests * TRAVERSAL_COST_PER_TRIANGLE_BLOCK_TEST;
+
+    return stats;
+}
+
+void printStats(const Mesh &mesh) {
+    BVHStats stats = getStats(mesh.bvh);
+    printf("Triangles: %lu, BVH nodes: %lu (%lu internal, %lu leaves), height: %lu\n",
+           (unsigned long)mesh.triangle_count, (unsigned long)mesh.bvh.node_count,
+           (unsigned long)stats.internal_count, (unsigned long)stats.leaf_count, (unsigned long)mesh.bvh.height);
+    printf("SAH cost: %.2f\n", stats.sah_cost);
+    printf("Sibling overlap: %.2f%% of the parents' surface area (%lu of %lu internal nodes have overlapping children)\n",
+           100.0f * stats.sibling_overlap_ratio,
+           (unsigned long)stats.overlapping_siblings_count, (unsigned long)stats.internal_count);
+    printf("Expected per ray: %.1f box tests, %.1f triangle block tests (%.1f triangles), estimated traversal cost: %.1f\n",
+           stats.box_tests, stats.triangle_block_tests, stats.triangle_tests, stats.traversal_cost);
+
+    printf("Leaf sizes (average %.2f):\n", stats.average_leaf_size);
+    for (u32 size = 1; size <= BVH_STATS_MAX_LEAF_SIZE; size++)
+        if (stats.leaf_sizes[size])
+            printf("  %s%2lu: %lu\n", size == BVH_STATS_MAX_LEAF_SIZE ? ">=" : "  ",
+                   (unsigned long)size, (unsigned long)stats.leaf_sizes[size]);
+
+    printf("Leaf depths (average %.2f):\n", stats.average_leaf_depth);
+    for (u32 depth = 0; depth < BVH_STATS_MAX_DEPTH; depth++)
+        if (stats.leaf_depths[depth])
+            printf("  %3lu: %lu\n", (unsigned long)depth, (unsigned long)stats.leaf_depths[depth]);
+}
+
+// Rays from a sphere around the mesh (of twice its bounding radius) towards random points within its bounds:
+void generateRays(const Mesh &mesh, Ray *rays, u32 ray_count) {
+    vec3 center{(mesh.aabb.min + mesh.aabb.max) * 0.5f};
+    f32 radius = (mesh.aabb.max - center).length() * 2.0f;
+    vec3 extents{mesh.aabb.max - mesh.aabb.min};
+    srand(1);
+    for (u32 i = 0; i < ray_count; i++) {
+        vec3 direction{(f32)rand() / RAND_MAX - 0.5f, (f32)rand() / RAND_MAX - 0.5f, (f32)rand() / RAND_MAX - 0.5f};
+        if (direction.nonZero()) direction = direction.normalized(); else direction.z = 1;
+        vec3 origin{direction.scaleAdd(radius, center)};
+        vec3 target{
+            mesh.aabb.min.x + extents.x * (f32)rand() / RAND_MAX,
+            mesh.aabb.min.y + extents.y * (f32)rand() / RAND_MAX,
+            mesh.aabb.min.z + extents.z * (f32)rand() / RAND_MAX
+        };
+        rays[i].reset(origin, (target - origin).normalized());
+    }
+}
+
+f64 measureRaysPerSecond(const Mesh &mesh, const Ray *rays, u32 ray_count, u32 *stack) {
+    MeshTracer tracer{stack};
+    Ray ray;
+    RayHit hit;
+    auto start = std::chrono::steady_clock::now();
+    for (u32 i = 0; i < ray_count; i++) {
+        ray = rays[i];
+        hit.distance = INFINITY;
+        tracer.trace(mesh, ray, hit, false);
+    }
+    f64 seconds = std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+
+    return seconds > 0 ? (f64)ray_count / seconds : 0;
+}
+
+// Spatial splits store every extra reference to a triangle as a triangle of its own (see BVHBuilder::buildMesh),
+// so meshes built with them (by obj2mesh -bvh_spatial_splits, or by a previous autotune) hold duplicate triangles.
+// Removes every triangle whose vertex indices repeat an earlier one's, keeping the order of the rest,
+// and returns how many were removed:
+u32 removeDuplicateTriangles(Mesh &mesh) {
+    struct TriangleKey {
+        u32 ids[9];
+        u32 triangle_id;
+        bool operator<(const TriangleKey &other) const {
+            for (u32 i = 0; i < 9; i++) if (ids[i] != other.ids[i]) return ids[i] < other.ids[i];
+            return triangle_id < other.triangle_id;
+        }
+    };
+    TriangleKey *keys = (TriangleKey*)malloc(sizeof(TriangleKey) * mesh.triangle_count);
+    bool *is_duplicate = (bool*)calloc(mesh.triangle_count, sizeof(bool));
+    for (u32 t = 0; t < mesh.triangle_count; t++) {
+        TriangleKey &key = keys[t];
+        for (u32 i = 0; i < 3; i++) {
+            key.ids[i    ] = mesh.vertex_position_indices[t].ids[i];
+            key.ids[i + 3] = mesh.normals_count ? mesh.vertex_normal_indices[t].ids[i] : 0;
+            key.ids[i + 6] = mesh.uvs_count ? mesh.vertex_uvs_indices[t].ids[i] : 0;
+        }
+        key.triangle_id = t;
+    }
+    std::sort(keys, keys + mesh.triangle_count);
+    for (u32 t = 1; t < mesh.triangle_count; t++)
+        if (!memcmp(keys[t].ids, keys[t - 1].ids, sizeof(keys[t].ids)))
+            is_duplicate[keys[t].triangle_id] = true;
+
+    u32 triangle_count = 0;
+    for (u32 t = 0; t < mesh.triangle_count; t++) {
+        if (is_duplicate[t]) continue;
+
+        mesh.vertex_position_indices[triangle_count] = mesh.vertex_position_indices[t];
+        if (mesh.normals_count) mesh.vertex_normal_indices[triangle_count] = mesh.vertex_normal_indices[t];
+        if (mesh.uvs_count) mesh.vertex_uvs_indices[triangle_count] = mesh.vertex_uvs_indices[t];
+        triangle_count++;
+    }
+    free(keys);
+    free(is_duplicate);
+
+    u32 removed_count = mesh.triangle_count - triangle_count;
+    mesh.triangle_count = triangle_count;
+    return removed_count;
+}
+
+// Rebuilds the BVH of a copy of the given mesh (which must not hold duplicate triangles, see removeDuplicateTriangles)
+// with the given leaf size and build strategy, allocating the copy from the start of the given memory:
+void rebuild(const Mesh &source, Mesh &mesh, u16 max_leaf_size, BVHBuildStrategy strategy, ThreadPool *thread_pool,
+             u8 *memory, u64 memory_capacity) {
+    mesh = Mesh{};
+    mesh.vertex_count = source.vertex_count;
+    mesh.normals_count = source.normals_count;
+    mesh.uvs_count = source.uvs_count;
+    mesh.edge_count = source.edge_count;
+    mesh.triangle_count = strategy == BVHBuildStrategy_SpatialSplits ?
+                          BVHBuilder::getMaxTriangleReferenceCount(source.triangle_count) : source.triangle_count;
+    mesh.bvh.node_count = mesh.triangle_count * 2;
+    mesh.aabb = source.aabb;
+
+    memory::MonotonicAllocator memory_allocator;
+    memory_allocator.address = memory;
+    memory_allocator.capacity = memory_capacity;
+    allocateMemory(mesh, &memory_allocator);
+    BVHBuilder builder{mesh.triangle_count * 2, strategy, &memory_allocator};
+    mesh.triangle_count = source.triangle_count;
+
+    for (u32 i = 0; i < mesh.vertex_count; i++) mesh.vertex_positions[i] = source.vertex_positions[i];
+    memcpy(mesh.vertex_position_indices, source.vertex_position_indices, sizeof(TriangleVertexIndices) * mesh.triangle_count);
+    memcpy(mesh.edge_vertex_indices, source.edge_vertex_indices, sizeof(EdgeVertexIndices) * mesh.edge_count);
+    if (mesh.normals_count) {
+        for (u32 i = 0; i < mesh.normals_count; i++) mesh.vertex_normals[i] = source.vertex_normals[i];
+        memcpy(mesh.vertex_normal_indices, source.vertex_normal_indices, sizeof(TriangleVertexIndices) * mesh.triangle_count);
+    }
+    if (mesh.uvs_count) {
+        for (u32 i = 0; i < mesh.uvs_count; i++) mesh.vertex_uvs[i] = source.vertex_uvs[i];
+        memcpy(mesh.vertex_uvs_indices, source.vertex_uvs_indices, sizeof(TriangleVertexIndices) * mesh.triangle_count);
+    }
+
+    builder.buildMesh(mesh, thread_pool, max_leaf_size);
+}
+
+// Rebuilds the mesh with every combination of leaf size and build strategy, measuring how many rays per second
+// each variant traces (on a single thread), then saves the fastest variant:
+int autotune(const Mesh &source, char *output_file_path, u32 ray_count) {
+    BVHBuildStrategy strategies[2] = {BVHBuildStrategy_BinnedSAH, BVHBuildStrategy_SpatialSplits};
+    const char *strategy_names[2] = {"binned SAH", "spatial splits"};
+
+    Mesh largest_variant;
+    largest_variant.vertex_count = source.vertex_count;
+    largest_variant.normals_count = source.normals_count;
+    largest_variant.uvs_count = source.uvs_count;
+    largest_variant.edge_count = source.edge_count;
+    largest_variant.triangle_count = BVHBuilder::getMaxTriangleReferenceCount(source.triangle_count);
+    largest_variant.bvh.node_count = largest_variant.triangle_count * 2;
+    u64 variant_capacity = getSizeInBytes(largest_variant) +
+                           BVHBuilder::getSizeInBytes(largest_variant.triangle_count * 2, BVHBuildStrategy_SpatialSplits);
+    memory::MonotonicAllocator memory_allocator{sizeof(Ray) * ray_count + sizeof(u32) * AUTOTUNE_STACK_SIZE + variant_capacity};
+    Ray *rays = (Ray*)memory_allocator.allocate(sizeof(Ray) * ray_count);
+    u32 *stack = (u32*)memory_allocator.allocate(sizeof(u32) * AUTOTUNE_STACK_SIZE);
+    u8 *variant_memory = (u8*)memory_allocator.allocate(variant_capacity);
+    generateRays(source, rays, ray_count);
+
+    ThreadPool thread_pool;
+    Mesh mesh;
+    f64 rays_per_second, best_rays_per_second = 0;
+    u16 best_leaf_size = 0;
+    u8 best_strategy = 0;
+    for (u8 s = 0; s < 2; s++) {
+        for (u16 leaf_size : AUTOTUNE_LEAF_SIZES) {
+            rebuild(source, mesh, leaf_size, strategies[s], &thread_pool, variant_memory, variant_capacity);
+            rays_per_second = measureRaysPerSecond(mesh, rays, ray_count, stack);
+            printf("%-14s leaf size %2lu: SAH cost %8.2f, %7.2f Mrays/s\n", strategy_names[s], (unsigned long)leaf_size,
+                   getSAHCost(mesh.bvh), rays_per_second / 1000000.0);
+            if (rays_per_second > best_rays_per_second) {
+                best_rays_per_second = rays_per_second;
+                best_leaf_size = leaf_size;
+                best_strategy = s;
+            }
+        }
+    }
+
+    printf("Best: %s with leaf size %lu (%.2f Mrays/s), saving to %s\n", strategy_names[best_strategy],
+           (unsigned long)best_leaf_size, best_rays_per_second / 1000000.0, output_file_path);
+    rebuild(source, mesh, best_leaf_size, strategies[best_strategy], &thread_pool, variant_memory, variant_capacity);
+
+    return save(mesh, output_file_path) ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || !strcmp(argv[1], (char*)"--help")) {
+        printf((char*)("A '.mesh' file path needs to be provided, for reporting on the quality of its BVH: "
+                       "SAH cost, sibling overlap, the expected cost of traversing it and histograms of its leaf sizes "
+                       "and depths. An optional flag '-autotune <.mesh file>' rebuilds the BVH with different leaf sizes "
+                       "and build strategies, measuring the rays per second of each, and saves the fastest variant, "
+                       "an optional flag 'rays:<int>' sets the number of rays to measure each variant with"));
+        return argc < 2;
+    }
+
+    char *autotune_file_path = nullptr;
+    u32 ray_count = AUTOTUNE_DEFAULT_RAY_COUNT;
+    for (u32 i = 2; i < (u32)argc; i++) {
+        char *arg = argv[i];
+        if (strcmp(arg, (char *) "-autotune") == 0 && i + 1 < (u32)argc)
+            autotune_file_path = argv[++i];
+        else if (strncmp(arg, (char *) "rays:", 5) == 0)
+            ray_count = Max(1, (u32)atoi(arg + 5));
+    }
+
+    Mesh mesh;
+    Mesh header;
+    if (!loadHeader(header, argv[1])) {
+        printf("Could not open %s\n", argv[1]);
+        return 1;
+    }
+    memory::MonotonicAllocator memory_allocator{getSizeInBytes(header)};
+    if (!load(mesh, argv[1], &memory_allocator)) {
+        printf("Could not load %s\n", argv[1]);
+        return 1;
+    }
+    printStats(mesh);
+    if (!autotune_file_path) return 0;
+
+    // Rebuilding the references of spatial splits would split them again, bloating the mesh:
+    u32 duplicate_count = removeDuplicateTriangles(mesh);
+    if (duplicate_count)
+        printf("Removed %lu duplicate triangles (extra references of spatial splits) before autotuning\n",
+               (unsigned long)duplicate_count);
+
+    return autotune(mesh, autotune_file_path, ray_count);
+}
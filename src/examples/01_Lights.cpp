@@ -12,14 +12,16 @@
 struct ExampleApp : SlimApp {
     bool use_gpu = USE_GPU_BY_DEFAULT;
     bool antialias = false;
+    bool checkerboard = false;
     bool skybox_swapped = false;
 
     // HUD:
     HUDLine FPS {"FPS : "};
     HUDLine GPU {"GPU : ", "Off", "On", &use_gpu};
     HUDLine AA  {"AA  : ", "Off", "On", &antialias};
+    HUDLine CB  {"CB  : ", "Off", "On", &checkerboard};
     HUDLine Mode{"Mode: ", "Beauty"};
-    HUD hud{{4}, &FPS};
+    HUD hud{{5}, &FPS};
 
     // Viewport:
     Camera camera{{-25 * DEG_TO_RAD, 0, 0}, {0, 25, -45}}, *cameras{&camera};
@@ -82,6 +84,10 @@ struct ExampleApp : SlimApp {
                 antialias = !antialias;
                 canvas.antialias = antialias ? SSAA : NoAA;
             }
+            if (key == 'H') {
+                checkerboard = !checkerboard;
+                renderer.checkerboard = checkerboard;
+            }
             if (key == 'M') {
                 skybox_swapped = !skybox_swapped;
                 char inc = skybox_swapped ? 3 : -3;
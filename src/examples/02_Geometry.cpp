@@ -14,6 +14,7 @@
 struct ExampleApp : SlimApp {
     bool use_gpu = USE_GPU_BY_DEFAULT;
     bool antialias = false;
+    bool checkerboard = false;
     bool skybox_swapped = false;
     bool draw_BVH = false;
     bool cutout = false;
@@ -22,10 +23,11 @@ struct ExampleApp : SlimApp {
     HUDLine FPS {"FPS : "};
     HUDLine GPU {"GPU : ", "Off","On", &use_gpu};
     HUDLine AA  {"AA  : ", "Off","On", &antialias};
+    HUDLine CB  {"CB  : ", "Off","On", &checkerboard};
     HUDLine BVH {"BVH : ", "Off","On", &draw_BVH};
     HUDLine Cut {"Cut : ", "Off","On", &cutout};
     HUDLine Mode{"Mode: ", "Beauty"};
-    HUD hud{{6}, &FPS};
+    HUD hud{{7}, &FPS};
 
     // Viewport:
     Camera camera{{-25 * DEG_TO_RAD, 0, 0}, {-4, 15, -17}}, *cameras{&camera};
@@ -90,8 +92,10 @@ struct ExampleApp : SlimApp {
             if (!(controls::is_pressed::alt &&
                   &geo == selection.geometry) &&
                 geo.type != GeometryType_Quad &&
-                geo.type != GeometryType_Mesh)
+                geo.type != GeometryType_Mesh) {
                 geo.transform.orientation *= rot;
+                geo.flags |= GEOMETRY_IS_DIRTY;
+            }
         }
     }
 
@@ -117,6 +121,10 @@ struct ExampleApp : SlimApp {
                 antialias = !antialias;
                 canvas.antialias = antialias ? SSAA : NoAA;
             }
+            if (key == 'H') {
+                checkerboard = !checkerboard;
+                renderer.checkerboard = checkerboard;
+            }
             if (key == 'M') {
                 skybox_swapped = !skybox_swapped;
                 char inc = skybox_swapped ? 3 : -3;
@@ -14,6 +14,7 @@
 struct ExampleApp : SlimApp {
     bool use_gpu = USE_GPU_BY_DEFAULT;
     bool antialias = false;
+    bool checkerboard = false;
     bool skybox_swapped = false;
     bool draw_BVH = false;
     bool cutout = false;
@@ -22,11 +23,12 @@ struct ExampleApp : SlimApp {
     HUDLine FPS {"FPS : "};
     HUDLine GPU {"GPU : ", "Off","On", &use_gpu};
     HUDLine AA  {"AA  : ", "Off","On", &antialias};
+    HUDLine CB  {"CB  : ", "Off","On", &checkerboard};
     HUDLine BVH {"BVH : ", "Off","On", &draw_BVH};
     HUDLine Mode{"Mode: ", "Beauty"};
     HUDLine Shader{ "Shader : "};
     HUDLine Bounces{"Bounces: "};
-    HUD hud{{7}, &FPS};
+    HUD hud{{8}, &FPS};
 
     enum MaterialID { Floor, Mirror, Glass, MaterialCount };
 
@@ -111,8 +113,10 @@ struct ExampleApp : SlimApp {
         for (u32 i = 0; i < scene.counts.geometries; i++) {
             Geometry &geo = geometries[i];
             if (!(controls::is_pressed::alt && &geo == selection.geometry) &&
-                geo.type != GeometryType_Quad && geo.type != GeometryType_Mesh)
+                geo.type != GeometryType_Quad && geo.type != GeometryType_Mesh) {
                 geo.transform.orientation = (geo.transform.orientation * rot).normalized();
+                geo.flags |= GEOMETRY_IS_DIRTY;
+            }
         }
     }
 
@@ -133,6 +137,10 @@ struct ExampleApp : SlimApp {
                 antialias = !antialias;
                 canvas.antialias = antialias ? SSAA : NoAA;
             }
+            if (key == 'H') {
+                checkerboard = !checkerboard;
+                renderer.checkerboard = checkerboard;
+            }
             if (key == 'M') {
                 skybox_swapped = !skybox_swapped;
                 char inc = skybox_swapped ? 3 : -3;
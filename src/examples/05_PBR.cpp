@@ -15,10 +15,30 @@
 #define GRID_SIZE_F ((float)GRID_SIZE)
 #define OBJECT_COUNT (GRID_SIZE * GRID_SIZE)
 
+// Diffuse lighting comes from the spherical harmonics of the irradiance cube maps (see loadIrradianceSH()),
+// so the scene only loads the color and radiance cube maps of the skyboxes:
+enum SkyboxTextureID {
+    Cathedral_Color,
+    Cathedral_Radiance,
+
+    Bolonga_Color,
+    Bolonga_Radiance,
+
+    SkyboxTextureCount
+};
+Texture skybox_textures[SkyboxTextureCount];
+String skybox_texture_files[SkyboxTextureCount]{
+    texture_files[Cathedral_SkyboxColor],
+    texture_files[Cathedral_SkyboxRadiance],
+
+    texture_files[Bolonga_SkyboxColor],
+    texture_files[Bolonga_SkyboxRadiance]
+};
 
 struct ExampleApp : SlimApp {
     bool use_gpu = USE_GPU_BY_DEFAULT;
     bool antialias = false;
+    bool checkerboard = false;
     bool skybox_swapped = false;
     bool draw_BVH = false;
     bool cutout = false;
@@ -27,8 +47,9 @@ struct ExampleApp : SlimApp {
     HUDLine FPS {"FPS : "};
     HUDLine GPU {"GPU : ", "Off","On", &use_gpu};
     HUDLine AA  {"AA  : ", "Off","On", &antialias};
+    HUDLine CB  {"CB  : ", "Off","On", &checkerboard};
     HUDLine BVH {"BVH : ", "Off","On", &draw_BVH};
-    HUD hud{{4}, &FPS};
+    HUD hud{{5}, &FPS};
 
     // Viewport:
     Camera camera{{}, {-2.0f, -1.0f, -20.0f}};
@@ -46,9 +67,10 @@ struct ExampleApp : SlimApp {
     Material materials[GRID_SIZE][GRID_SIZE];
     Geometry geometries[GRID_SIZE][GRID_SIZE];
     Scene scene{{OBJECT_COUNT, 1, 4,
-                          OBJECT_COUNT, TextureCount},
+                          OBJECT_COUNT, SkyboxTextureCount},
                 &geometries[0][0], &camera, lights,
-                &materials[0][0], textures, texture_files};
+                &materials[0][0], skybox_textures, skybox_texture_files};
+    IrradianceSH cathedral_irradiance_sh, bolonga_irradiance_sh;
 
     ExampleApp() {
         Color plastic{0.04f};
@@ -69,14 +91,21 @@ struct ExampleApp : SlimApp {
             }
         }
         uploadMaterials(scene);
+
+        String irradiance_files[2]{texture_files[Cathedral_SkyboxIrradiance], texture_files[Bolonga_SkyboxIrradiance]};
+        memory::MonotonicAllocator memory_allocator{getTotalMemoryForTextures(irradiance_files, 2)};
+        loadIrradianceSH(cathedral_irradiance_sh, irradiance_files[0].char_ptr, &memory_allocator);
+        loadIrradianceSH(bolonga_irradiance_sh,   irradiance_files[1].char_ptr, &memory_allocator);
+        os::freeMemory(memory_allocator.address);
+        renderer.settings.irradiance_sh = cathedral_irradiance_sh;
+        renderer.settings.use_irradiance_sh = true;
     }
 
     SceneTracer scene_tracer{scene.counts.geometries, scene.mesh_stack_size};
     Selection selection{scene, scene_tracer, projection};
     RayTracingRenderer renderer{scene, scene_tracer, projection, 1,
-                                Cathedral_SkyboxColor,
-                                Cathedral_SkyboxRadiance,
-                                Cathedral_SkyboxIrradiance};
+                                Cathedral_Color,
+                                Cathedral_Radiance};
 
     void OnUpdate(f32 delta_time) override {
         projection.reset(camera, canvas.dimensions, canvas.antialias == SSAA);
@@ -106,12 +135,16 @@ struct ExampleApp : SlimApp {
                 antialias = !antialias;
                 canvas.antialias = antialias ? SSAA : NoAA;
             }
+            if (key == 'H') {
+                checkerboard = !checkerboard;
+                renderer.checkerboard = checkerboard;
+            }
             if (key == 'M') {
                 skybox_swapped = !skybox_swapped;
-                char inc = skybox_swapped ? 3 : -3;
+                char inc = skybox_swapped ? 2 : -2;
                 renderer.settings.skybox_color_texture_id += inc;
                 renderer.settings.skybox_radiance_texture_id += inc;
-                renderer.settings.skybox_irradiance_texture_id += inc;
+                renderer.settings.irradiance_sh = skybox_swapped ? bolonga_irradiance_sh : cathedral_irradiance_sh;
             }
         }
 
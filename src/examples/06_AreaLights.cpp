@@ -14,6 +14,7 @@
 struct ExampleApp : SlimApp {
     bool use_gpu = USE_GPU_BY_DEFAULT;
     bool antialias = false;
+    bool checkerboard = false;
     bool skybox_swapped = false;
     bool draw_BVH = false;
     bool cutout = false;
@@ -22,11 +23,12 @@ struct ExampleApp : SlimApp {
     HUDLine FPS {"FPS : "};
     HUDLine GPU {"GPU : ", "Off","On", &use_gpu};
     HUDLine AA  {"AA  : ", "Off","On", &antialias};
+    HUDLine CB  {"CB  : ", "Off","On", &checkerboard};
     HUDLine BVH {"BVH : ", "Off","On", &draw_BVH};
     HUDLine Cut {"Cut : ", "Off","On", &cutout};
     HUDLine Mode{"Mode: ", "Beauty"};
     HUDLine Shader{ "Shader: "};
-    HUD hud{{7}, &FPS};
+    HUD hud{{8}, &FPS};
 
     enum MaterialID { Floor, Rough, Mirror, Emissive1, Emissive2, MaterialCount };
 
@@ -127,6 +129,10 @@ struct ExampleApp : SlimApp {
                 antialias = !antialias;
                 canvas.antialias = antialias ? SSAA : NoAA;
             }
+            if (key == 'H') {
+                checkerboard = !checkerboard;
+                renderer.checkerboard = checkerboard;
+            }
             if (key == 'M') {
                 skybox_swapped = !skybox_swapped;
                 char inc = skybox_swapped ? 3 : -3;
@@ -14,6 +14,14 @@
 struct ExampleApp : SlimApp {
     bool use_gpu = USE_GPU_BY_DEFAULT;
     bool antialias = false;
+    bool checkerboard = false;
+    bool use_threads = true;
+    bool use_packets = true;
+    bool sort_secondary_rays = false;
+    bool use_wavefront = false;
+    bool accumulate = false;
+    bool adaptive_sampling = false;
+    bool dynamic_resolution = false;
     bool skybox_swapped = false;
     bool draw_BVH = false;
     bool cutout = false;
@@ -22,13 +30,26 @@ struct ExampleApp : SlimApp {
     HUDLine FPS {"FPS : "};
     HUDLine GPU {"GPU : ","Off","On",&use_gpu};
     HUDLine AA  {"AA  : ","Off","On",&antialias};
+    HUDLine CB  {"CB  : ","Off","On",&checkerboard};
+    HUDLine MT  {"MT  : ","Off","On",&use_threads};
+    HUDLine RP  {"RP  : ","Off","On",&use_packets};
+    HUDLine SR  {"SR  : ","Off","On",&sort_secondary_rays};
+    HUDLine WF  {"WF  : ","Off","On",&use_wavefront};
+    HUDLine Acc {"Acc : ","Off","On",&accumulate};
+    HUDLine AS  {"AS  : ","Off","On",&adaptive_sampling};
+    HUDLine DRS {"DRS : ","Off","On",&dynamic_resolution};
     HUDLine BVH {"BVH : ","Off","On",&draw_BVH};
     HUDLine Cut {"Cut : ","Off","On",&cutout};
     HUDLine Mode{"Mode: ","Beauty"};
     HUDLine Shader{   "Shader   : "};
     HUDLine Roughness{"Roughness: "};
     HUDLine Bounces{  "Bounces  : "};
-    HUD hud{{9}, &FPS};
+    HUDLine Moved{    "Moved    : "};
+    HUDLine Coherence{"Coherence: "};
+    HUDLine Frames{   "Frames   : "};
+    HUDLine Samples{  "Samples  : "};
+    HUDLine Scale{    "Scale    : "};
+    HUD hud{{22}, &FPS};
 
     // Viewport:
     Camera camera{{-25 * DEG_TO_RAD, 0, 0}, {0, 7, -11}}, *cameras{&camera};
@@ -120,6 +141,9 @@ struct ExampleApp : SlimApp {
 
         Bounces.value = (i32)renderer.settings.max_depth;
 
+        // Accumulating frames needs the scene to hold still:
+        if (accumulate) return;
+
         quat rot = quat::RotationAroundY(delta_time * 0.25f);
         for (u32 i = 1; i < scene.counts.geometries; i++) {
             Geometry &geo{geometries[i]};
@@ -130,14 +154,22 @@ struct ExampleApp : SlimApp {
 
             if (&geo != &dragon) {
                 rot.amount = -rot.amount;
-                if (!(controls::is_pressed::alt && selection.geometry == &geo))
+                if (!(controls::is_pressed::alt && selection.geometry == &geo)) {
                     geo.transform.orientation *= rot;
+                    geo.flags |= GEOMETRY_IS_DIRTY;
+                }
             }
         }
     }
 
     void OnRender() override {
+        if (dynamic_resolution) renderer.updateResolutionScale((f32)render_timer.average_milliseconds_per_frame);
         renderer.render(viewport, true, use_gpu);
+        Moved.value = (i32)renderer.updated_geometry_count;
+        Coherence.value = renderer.secondary_ray_coherence_gain;
+        Frames.value = (i32)renderer.accumulated_frame_count;
+        Samples.value = renderer.samples_per_pixel;
+        Scale.value = dynamic_resolution ? (i32)renderer.resolution_scale : 1;
         if (draw_BVH) drawSceneBVH();
         if (controls::is_pressed::alt) drawSelection(selection, viewport, scene);
         if (hud.enabled) drawHUD(hud, canvas);
@@ -195,6 +227,38 @@ struct ExampleApp : SlimApp {
                 antialias = !antialias;
                 canvas.antialias = antialias ? SSAA : NoAA;
             }
+            if (key == 'H') {
+                checkerboard = !checkerboard;
+                renderer.checkerboard = checkerboard;
+            }
+            if (key == 'T') {
+                use_threads = !use_threads;
+                renderer.use_threads = use_threads;
+            }
+            if (key == 'P') {
+                use_packets = !use_packets;
+                renderer.use_packets = use_packets;
+            }
+            if (key == 'O') {
+                sort_secondary_rays = !sort_secondary_rays;
+                renderer.sort_secondary_rays = sort_secondary_rays;
+            }
+            if (key == 'K') {
+                use_wavefront = !use_wavefront;
+                renderer.use_wavefront = use_wavefront;
+            }
+            if (key == 'L') {
+                accumulate = !accumulate;
+                renderer.accumulate = accumulate;
+            }
+            if (key == 'U') {
+                adaptive_sampling = !adaptive_sampling;
+                renderer.adaptive_sampling = adaptive_sampling;
+            }
+            if (key == 'N') {
+                dynamic_resolution = !dynamic_resolution;
+                renderer.dynamic_resolution = dynamic_resolution;
+            }
             if (key == 'M') {
                 skybox_swapped = !skybox_swapped;
                 char inc = skybox_swapped ? 3 : -3;
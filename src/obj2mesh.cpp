@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <chrono>
 #include <unordered_set>
 
 #include "./slim/platforms/win32_base.h"
@@ -25,7 +26,8 @@ enum VertexAttributes {
     VertexAttributes_PositionsUVsAndNormals
 };
 
-int obj2mesh(char* obj_file_path, char* mesh_file_path, bool invert_winding_order = false, f32 scale = 1, float rotY = 0) {
+int obj2mesh(char* obj_file_path, char* mesh_file_path, bool invert_winding_order = false, f32 scale = 1, float rotY = 0,
+             BVHBuildStrategy bvh_build_strategy = BVHBuildStrategy_BinnedSAH) {
     const u8 v1_id = 0;
     const u8 v2_id = invert_winding_order ? 2 : 1;
     const u8 v3_id = invert_winding_order ? 1 : 2;
@@ -123,14 +125,20 @@ int obj2mesh(char* obj_file_path, char* mesh_file_path, bool invert_winding_orde
     }
     fclose(obj_file);
 
+    // Spatial splits can reference triangles more than once, storing the extra references as triangles of their own:
+    u32 triangle_count = mesh.triangle_count;
+    if (bvh_build_strategy == BVHBuildStrategy_SpatialSplits)
+        mesh.triangle_count = BVHBuilder::getMaxTriangleReferenceCount(triangle_count);
+
     mesh.bvh.node_count = mesh.triangle_count * 2;
     mesh.bvh.height = (u8)mesh.triangle_count;
 
     u64 memory_capacity = getSizeInBytes(mesh);
-    memory_capacity += BVHBuilder::getSizeInBytes(mesh.triangle_count * 2);
+    memory_capacity += BVHBuilder::getSizeInBytes(mesh.triangle_count * 2, bvh_build_strategy);
     memory::MonotonicAllocator memory_allocator{memory_capacity};
     allocateMemory(mesh, &memory_allocator);
-    BVHBuilder builder{mesh.triangle_count * 2, &memory_allocator};
+    BVHBuilder builder{mesh.triangle_count * 2, bvh_build_strategy, &memory_allocator};
+    mesh.triangle_count = triangle_count;
 
     vec3 *vertex_position = mesh.vertex_positions;
     vec3 *vertex_normal = mesh.vertex_normals;
@@ -230,7 +238,23 @@ int obj2mesh(char* obj_file_path, char* mesh_file_path, bool invert_winding_orde
             mesh.vertex_positions[i] -= centroid;
     }
 
-    builder.buildMesh(mesh);
+    ThreadPool thread_pool;
+    auto build_start = std::chrono::steady_clock::now();
+    builder.buildMesh(mesh, &thread_pool);
+    f64 build_milliseconds = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - build_start).count();
+    bool single_threaded = bvh_build_strategy == BVHBuildStrategy_FullSort ||
+                           bvh_build_strategy == BVHBuildStrategy_SpatialSplits;
+    const char *strategy_name = bvh_build_strategy == BVHBuildStrategy_FullSort ? "full-sort SAH" : (
+                                bvh_build_strategy == BVHBuildStrategy_SpatialSplits ? "spatial splits" : "binned SAH");
+    printf("BVH (%s) built in %.1f ms on %lu threads: %lu nodes, SAH cost %.2f\n",
+           strategy_name, build_milliseconds,
+           (unsigned long)(single_threaded ? 1 : thread_pool.thread_count),
+           (unsigned long)mesh.bvh.node_count, getSAHCost(mesh.bvh));
+    if (mesh.triangle_count > triangle_count)
+        printf("Spatial splits added %lu triangle references (%.1f%%)\n",
+               (unsigned long)(mesh.triangle_count - triangle_count),
+               100.0f * (f32)(mesh.triangle_count - triangle_count) / (f32)triangle_count);
+
     save(mesh, mesh_file_path);
 
     return 0;
@@ -242,24 +266,32 @@ int main(int argc, char *argv[]) {
                        "An '.obj' file (input) then a '.mesh' file (output), "
                        "an optional flag '-invert_winding_order' for inverting winding order"
                        "an optional flag 'scale:<float>' for scaling the mesh,"
-                       "an optional flag 'rotY:<float> for rotating the mesh around Y"
+                       "an optional flag 'rotY:<float> for rotating the mesh around Y,"
+                       "an optional flag '-bvh_full_sort' for building the BVH with the (slower) full-sort SAH builder, "
+                       "an optional flag '-bvh_spatial_splits' for building the BVH with (slower) spatial splits of triangles"
                        ));
         return 0;
     } else if (argc == 3 || // 2 arguments
                argc == 4 || // 3 arguments
                argc == 5 || // 4 arguments
-               argc == 6    // 5 arguments
+               argc == 6 || // 5 arguments
+               argc == 7    // 6 arguments
             ) {
         char *obj_file_path = argv[1];
         char *mesh_file_path = argv[2];
         if (argc == 3) return obj2mesh(obj_file_path, mesh_file_path);
 
         bool invert_winding_order = false;
+        BVHBuildStrategy bvh_build_strategy = BVHBuildStrategy_BinnedSAH;
         float scale{1}, rotY{0};
         for (u32 i = 3; i < (u32)argc; i++) {
             char *arg = argv[i];
             if (strcmp(arg, (char *) "-invert_winding_order") == 0)
                 invert_winding_order = true;
+            else if (strcmp(arg, (char *) "-bvh_full_sort") == 0)
+                bvh_build_strategy = BVHBuildStrategy_FullSort;
+            else if (strcmp(arg, (char *) "-bvh_spatial_splits") == 0)
+                bvh_build_strategy = BVHBuildStrategy_SpatialSplits;
             else {
                 char *scale_arg_prefix = (char *) "scale:";
                 bool is_scale_arg = true;
@@ -282,7 +314,7 @@ int main(int argc, char *argv[]) {
                 }
             }
         }
-        return obj2mesh(obj_file_path, mesh_file_path, invert_winding_order, scale, rotY);
+        return obj2mesh(obj_file_path, mesh_file_path, invert_winding_order, scale, rotY, bvh_build_strategy);
     }
 
     printf((char*)("Exactly 2 file paths need to be provided: "
@@ -11,6 +11,7 @@
     #include <new>
 #elif defined(_MSC_VER)
     #define COMPILER_MSVC 1
+    #include <intrin.h>
 #endif
 
 #ifdef __CUDACC__
@@ -81,6 +82,18 @@
     #define unlikely(x) x
 #endif
 
+// Hints the CPU to start loading the cache line at the given address, ahead of it being read:
+#if defined(__CUDACC__)
+    #define prefetch(address)
+#elif defined(COMPILER_CLANG_OR_GCC)
+    #define prefetch(address) __builtin_prefetch((const void*)(address))
+#elif defined(COMPILER_MSVC) && (defined(_M_X64) || defined(_M_IX86))
+    #include <xmmintrin.h>
+    #define prefetch(address) _mm_prefetch((const char*)(address), _MM_HINT_T0)
+#else
+    #define prefetch(address)
+#endif
+
 #ifdef COMPILER_CLANG
     #define ENABLE_FP_CONTRACT \
         _Pragma("clang diagnostic push") \
@@ -151,12 +164,16 @@ typedef double f64;
 #define GEOMETRY_IS_VISIBLE ((u8)1)
 #define GEOMETRY_IS_SHADOWING ((u8)2)
 #define GEOMETRY_IS_TRANSPARENT ((u8)4)
+#define GEOMETRY_IS_DIRTY ((u8)8) // Transformed since the scene last updated its bounds
 
 #define TRACE_OFFSET 0.0001f
 
 #define MAX_HIT_DEPTH 4
 #define MAX_DISTANCE INFINITY
-#define MAX_TRIANGLES_PER_MESH_BVH_NODE 2
+#ifndef TRIANGLE_BLOCK_SIZE
+#define TRIANGLE_BLOCK_SIZE 8 // 4 for SSE, 8 for AVX2
+#endif
+#define MAX_TRIANGLES_PER_MESH_BVH_NODE TRIANGLE_BLOCK_SIZE
 #define MAX_OBJS_PER_SCENE_BVH_NODE 2
 #define MAX_PRIMITIVES_PER_LEAF ( \
             MAX_TRIANGLES_PER_MESH_BVH_NODE > MAX_OBJS_PER_SCENE_BVH_NODE ? \
@@ -171,6 +188,8 @@ typedef double f64;
 #define Gigabytes(value) (Megabytes(value)*1024LL)
 #define Terabytes(value) (Gigabytes(value)*1024LL)
 
+#define CACHE_LINE_SIZE 64
+
 #define MEMORY_SIZE Gigabytes(1)
 #define MEMORY_BASE Terabytes(2)
 
@@ -274,6 +293,43 @@ INLINE_XPU void swap(T *a, T *b) {
     *b = t;
 }
 
+// Index of the lowest set bit of a non-zero mask (for iterating over just the set bits of a mask):
+INLINE_XPU u32 lowestSetBit(u32 mask) {
+#if defined(__CUDACC__)
+    return (u32)(__ffs((int)mask) - 1);
+#elif defined(COMPILER_CLANG_OR_GCC)
+    return (u32)__builtin_ctz((unsigned int)mask);
+#elif defined(COMPILER_MSVC)
+    unsigned long index;
+    _BitScanForward(&index, (unsigned long)mask);
+    return (u32)index;
+#else
+    u32 index = 0;
+    while (!(mask & 1)) { mask >>= 1; index++; }
+    return index;
+#endif
+}
+
+// Scrambles the (lower 32) bits of a value with a PCG hash, for deriving well distributed random numbers from anything:
+INLINE_XPU u32 hashBits(u32 value) {
+    unsigned int state = (unsigned int)value * 747796405u + 2891336453u;
+    unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (u32)((word >> 22u) ^ word);
+}
+
+// A random number in [0, 1) from hashed bits (the upper 24 of the lower 32, which a float holds exactly):
+INLINE_XPU f32 getRandomValue(u32 hashed_bits) {
+    return (f32)((unsigned int)hashed_bits >> 8) * (1.0f / 16777216.0f);
+}
+
+// FNV-1a, over 8 bytes at a time (for telling whether data changed between frames):
+u64 hashBytes(const void *data, u64 size, u64 hash = 14695981039346656037ull) {
+    const u8 *bytes = (const u8*)data;
+    for (; size >= 8; size -= 8, bytes += 8) hash = (hash ^ *(const u64*)bytes) * 1099511628211ull;
+    for (; size; size--, bytes++) hash = (hash ^ *bytes) * 1099511628211ull;
+    return hash;
+}
+
 INLINE_XPU bool isOnCheckerboard(f32 u, f32 v, u8 steps = 4) {
     return (u8)(v * (f32)steps) % 2 == (u8)(u * (f32)steps) % 2;
 }
@@ -872,6 +928,10 @@ struct Color {
         return color;
     }
 
+    INLINE_XPU f32 luminance() const {
+        return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    }
+
     INLINE_XPU ByteColor toByteColor(f32 opacity = 1.0f) const {
         return ByteColor{r, g, b, opacity};
     }
@@ -1353,6 +1413,7 @@ namespace controls {
 
 namespace os {
     void* getMemory(u64 size, u64 base = 0);
+    void freeMemory(void *address);
     void setWindowTitle(char* str);
     void setWindowCapture(bool on);
     void setCursorVisibility(bool on);
@@ -1361,6 +1422,16 @@ namespace os {
     void* openFileForWriting(const char* file_path);
     bool readFromFile(void *out, unsigned long, void *handle);
     bool writeToFile(void *out, unsigned long, void *handle);
+
+    typedef void (*ThreadProc)(void *data);
+    u32 getCoreCount();
+    void* createThread(ThreadProc proc, void *data);
+    void joinThread(void *thread);
+    void* createSemaphore(u32 max_count);
+    void signalSemaphore(void *semaphore, u32 count = 1);
+    void waitForSemaphore(void *semaphore);
+    void closeSemaphore(void *semaphore);
+    u64 atomicCompareExchange(volatile u64 *target, u64 exchange, u64 comparand);
 }
 
 namespace timers {
@@ -1531,6 +1602,16 @@ namespace memory {
             address += size;
             return current_address;
         }
+
+        // Allocates at the next multiple of the given alignment, so needs up to alignment - 1 bytes more capacity:
+        void* allocate(u64 size, u64 alignment) {
+            u64 misalignment = (u64)address % alignment;
+            if (misalignment) {
+                address += alignment - misalignment;
+                occupied += alignment - misalignment;
+            }
+            return allocate(size);
+        }
     };
 }
 
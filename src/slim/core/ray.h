@@ -214,6 +214,79 @@ struct Ray {
         return true;
     }
 
+    // The occlusion versions of the tests above: Whether the ray hits the primitive no farther than the given distance,
+    // computing nothing about the hit (transparent primitives still need their UVs, for the cutouts):
+    INLINE_XPU bool occludedByDefaultQuad(f32 max_distance, bool is_transparent = false) const {
+        if (direction.y == 0 || origin.y == 0 || (origin.y < 0) == (direction.y < 0))
+            return false;
+
+        f32 t = fabsf(origin.y * direction_reciprocal.y);
+        if (t > max_distance)
+            return false;
+
+        vec3 position{at(t)};
+        if (position.x < -1 ||
+            position.x > +1 ||
+            position.z < -1 ||
+            position.z > +1)
+            return false;
+
+        if (!is_transparent)
+            return true;
+
+        UV uv;
+        uv.x = position.x;
+        uv.y = position.z;
+        uv.shiftToNormalized();
+        return !uv.onCheckerboard();
+    }
+
+    INLINE_XPU bool occludedByDefaultBox(f32 max_distance, bool is_transparent = false) const {
+        if (is_transparent) {
+            RayHit hit;
+            hit.distance = max_distance;
+            return hitsDefaultBox(hit, true);
+        }
+
+        vec3 signed_rcp{faces};
+        signed_rcp *= direction_reciprocal;
+        f32 near_hit_t = (scaled_origin - signed_rcp).maximum();
+        f32 far_hit_t = (scaled_origin + signed_rcp).minimum();
+
+        // From inside the box (the near hit being behind the ray) the hit is on the way out:
+        return far_hit_t >= 0 && far_hit_t >= near_hit_t && (near_hit_t >= 0 ? near_hit_t : far_hit_t) <= max_distance;
+    }
+
+    INLINE_XPU bool occludedByDefaultSphere(f32 max_distance, bool is_transparent = false) const {
+        if (is_transparent) {
+            RayHit hit;
+            hit.distance = max_distance;
+            return hitsDefaultSphere(hit, true);
+        }
+
+        f32 t_to_closest = -(origin.dot(direction));
+        if (t_to_closest <= 0) // Ray is aiming away from the sphere
+            return false;
+
+        f32 direction_squared_length = direction.squaredLength();
+        f32 squared_distance_to_center = origin.squaredLength() * direction_squared_length - t_to_closest*t_to_closest;
+        if (squared_distance_to_center > 1.0f) // Ray missed the sphere
+            return false;
+
+        f32 delta = sqrtf( direction_squared_length - squared_distance_to_center);
+        direction_squared_length = 1.0f / direction_squared_length;
+        f32 t = (t_to_closest - delta) * direction_squared_length;
+        if (t > max_distance)
+            return false;
+
+        if (t > 0)
+            return true;
+
+        // From inside the sphere the hit is on the way out:
+        t = (t_to_closest + delta) * direction_squared_length;
+        return t > 0 && t <= max_distance;
+    }
+
     INLINE_XPU bool hitsDefaultTetrahedron(RayHit &hit, bool is_transparent = false) const {
         mat3 tangent_matrix;
         vec3 tangent_pos;
@@ -311,6 +384,69 @@ struct Ray {
     }
 };
 
+#ifndef RAY_PACKET_SIZE
+#define RAY_PACKET_SIZE 8 // 4 for SSE, 8 for AVX2, 16 for AVX-512
+#endif
+
+// A packet of coherent rays (all pointing into the same octant) in SoA layout, for testing them against a box at once.
+// The lanes are plain arrays looped over in full, so the compiler can map each loop onto the target's vector width.
+struct RayPacket {
+    f32 scaled_origin_x[RAY_PACKET_SIZE], scaled_origin_y[RAY_PACKET_SIZE], scaled_origin_z[RAY_PACKET_SIZE];
+    f32 direction_reciprocal_x[RAY_PACKET_SIZE], direction_reciprocal_y[RAY_PACKET_SIZE], direction_reciprocal_z[RAY_PACKET_SIZE];
+    f32 closest_distance[RAY_PACKET_SIZE];
+    f32 near_distance[RAY_PACKET_SIZE];
+    f32 far_distance[RAY_PACKET_SIZE];
+    OctantShifts octant_shifts;
+    u32 count = 0;
+
+    // Returns false when the rays point into different octants, in which case they need to be traced individually:
+    INLINE_XPU bool load(const Ray *rays, const RayHit *hits, u32 ray_count) {
+        octant_shifts = rays[0].octant_shifts;
+        for (u32 i = 1; i < ray_count; i++)
+            if (rays[i].octant_shifts.x != octant_shifts.x ||
+                rays[i].octant_shifts.y != octant_shifts.y ||
+                rays[i].octant_shifts.z != octant_shifts.z)
+                return false;
+
+        count = ray_count;
+        for (u32 i = 0; i < RAY_PACKET_SIZE; i++) {
+            const Ray &ray = rays[i < ray_count ? i : 0];
+            scaled_origin_x[i] = ray.scaled_origin.x;
+            scaled_origin_y[i] = ray.scaled_origin.y;
+            scaled_origin_z[i] = ray.scaled_origin.z;
+            direction_reciprocal_x[i] = ray.direction_reciprocal.x;
+            direction_reciprocal_y[i] = ray.direction_reciprocal.y;
+            direction_reciprocal_z[i] = ray.direction_reciprocal.z;
+            closest_distance[i] = i < ray_count ? hits[i].distance : 0.0f; // Unused lanes never hit anything
+        }
+
+        return true;
+    }
+
+    // The same slab test as Ray::hitsAABB, for every lane (the box's near/far corners are selected once for the packet).
+    // Flags the lanes that hit the box closer than their closest hit so far and returns how many did:
+    INLINE_XPU u32 hitsAABB(const AABB &aabb, bool *lane_hits) {
+        f32 min_x = *(&aabb.min.x + octant_shifts.x), max_x = *(&aabb.max.x - octant_shifts.x);
+        f32 min_y = *(&aabb.min.y + octant_shifts.y), max_y = *(&aabb.max.y - octant_shifts.y);
+        f32 min_z = *(&aabb.min.z + octant_shifts.z), max_z = *(&aabb.max.z - octant_shifts.z);
+        u32 hit_count = 0;
+        for (u32 i = 0; i < RAY_PACKET_SIZE; i++) {
+            f32 near_x = fast_mul_add(min_x, direction_reciprocal_x[i], scaled_origin_x[i]);
+            f32 near_y = fast_mul_add(min_y, direction_reciprocal_y[i], scaled_origin_y[i]);
+            f32 near_z = fast_mul_add(min_z, direction_reciprocal_z[i], scaled_origin_z[i]);
+            f32 far_x = fast_mul_add(max_x, direction_reciprocal_x[i], scaled_origin_x[i]);
+            f32 far_y = fast_mul_add(max_y, direction_reciprocal_y[i], scaled_origin_y[i]);
+            f32 far_z = fast_mul_add(max_z, direction_reciprocal_z[i], scaled_origin_z[i]);
+            near_distance[i] = Max(0, Max(near_x, Max(near_y, near_z)));
+            far_distance[i] = Min(far_x, Min(far_y, far_z));
+            lane_hits[i] = near_distance[i] <= far_distance[i] && near_distance[i] < closest_distance[i];
+            hit_count += lane_hits[i];
+        }
+
+        return hit_count;
+    }
+};
+
 struct SphereTracer {
     f32 b, c, t_near, t_far, t_max;
 
@@ -2,6 +2,10 @@
 
 #include "./base.h"
 
+#ifndef IRRADIANCE_SH_PROJECTION_SAMPLES
+#define IRRADIANCE_SH_PROJECTION_SAMPLES 4096 // Directions a cube map gets sampled in, for projecting it onto SH
+#endif
+
 struct TexelQuadComponent {
     u8 TL, TR, BL, BR;
 };
@@ -169,4 +173,56 @@ struct Texture : ImageInfo {
 //        return mips[mip].sample(u, v);
 //    }
 
+};
+
+// Irradiance as 9 spherical harmonics coefficients (the first 3 bands) per color channel: Irradiance varies slowly over
+// directions, so these hold nearly all of an irradiance cube map and evaluate in a few multiply-adds (no face selection,
+// filtering or texel fetches). Negative lobes can ring below 0 in dark directions, so evaluation is clamped there:
+struct IrradianceSH {
+    Color coefficients[9];
+
+    INLINE_XPU static void getBasis(f32 X, f32 Y, f32 Z, f32 *basis) {
+        basis[0] = 0.282095f;
+        basis[1] = 0.488603f * Y;
+        basis[2] = 0.488603f * Z;
+        basis[3] = 0.488603f * X;
+        basis[4] = 1.092548f * X * Y;
+        basis[5] = 1.092548f * Y * Z;
+        basis[6] = 0.315392f * (3.0f * Z * Z - 1.0f);
+        basis[7] = 1.092548f * X * Z;
+        basis[8] = 0.546274f * (X * X - Y * Y);
+    }
+
+    // The irradiance in the given (normalized) direction:
+    INLINE_XPU Color evaluate(f32 X, f32 Y, f32 Z) const {
+        f32 basis[9];
+        getBasis(X, Y, Z, basis);
+
+        Color irradiance = Black;
+        for (u8 i = 0; i < 9; i++)
+            irradiance = coefficients[i].scaleAdd(basis[i], irradiance);
+
+        return {Max(irradiance.r, 0.0f), Max(irradiance.g, 0.0f), Max(irradiance.b, 0.0f)};
+    }
+
+    // Projects an irradiance cube map onto the coefficients, by sampling it in directions spread evenly over the sphere
+    // (along a Fibonacci spiral, so that each sample stands for an equal solid angle):
+    void project(const Texture &cube_map, u32 sample_count = IRRADIANCE_SH_PROJECTION_SAMPLES) {
+        for (Color &coefficient : coefficients) coefficient = Black;
+
+        f32 basis[9], X, Y, Z, r, angle;
+        f32 sample_solid_angle = 2.0f * TAU / (f32)sample_count;
+        for (u32 s = 0; s < sample_count; s++) {
+            Y = 1.0f - 2.0f * ((f32)s + 0.5f) / (f32)sample_count;
+            r = sqrtf(Max(0.0f, 1.0f - Y * Y));
+            angle = (f32)s * 2.39996323f; // The golden angle
+            X = r * cosf(angle);
+            Z = r * sinf(angle);
+
+            Color irradiance{cube_map.sampleCube(X, Y, Z).color};
+            getBasis(X, Y, Z, basis);
+            for (u8 i = 0; i < 9; i++)
+                coefficients[i] = irradiance.scaleAdd(basis[i] * sample_solid_angle, coefficients[i]);
+        }
+    }
 };
\ No newline at end of file
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "./base.h"
+
+#define THREAD_POOL_MAX_THREADS 64
+
+typedef void (*ThreadPoolTask)(void *data, u32 task_index, u32 thread_index);
+
+// A range of task indices owned by a thread, packed into a single word so that the owner (popping from the front)
+// and thieves (stealing from the back) can both claim a task with one compare-exchange.
+// Padded to a cache line to avoid false-sharing between threads.
+struct ThreadPoolQueue {
+    volatile u64 range = 0;
+    u8 padding[56];
+
+    INLINE static u64 pack(u32 first, u32 end) { return ((u64)end << 32) | (u64)first; }
+
+    bool pop(u32 &task_index) {
+        u64 current, first, end;
+        do {
+            current = range;
+            first = current & 0xFFFFFFFF;
+            end = current >> 32;
+            if (first >= end) return false;
+        } while (os::atomicCompareExchange(&range, pack((u32)first + 1, (u32)end), current) != current);
+
+        task_index = (u32)first;
+        return true;
+    }
+
+    bool steal(u32 &task_index) {
+        u64 current, first, end;
+        do {
+            current = range;
+            first = current & 0xFFFFFFFF;
+            end = current >> 32;
+            if (first >= end) return false;
+        } while (os::atomicCompareExchange(&range, pack((u32)first, (u32)end - 1), current) != current);
+
+        task_index = (u32)end - 1;
+        return true;
+    }
+};
+
+struct ThreadPool;
+
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+    u32 index;
+};
+
+struct ThreadPool {
+    ThreadPoolQueue queues[THREAD_POOL_MAX_THREADS];
+    ThreadPoolWorker workers[THREAD_POOL_MAX_THREADS];
+    void *threads[THREAD_POOL_MAX_THREADS] = {};
+    ThreadPoolTask task = nullptr;
+    void *task_data = nullptr;
+    void *work_started = nullptr;
+    void *work_finished = nullptr;
+    void *run_lock = nullptr;
+    u32 thread_count = 1;
+    volatile bool stopping = false;
+
+    // The calling thread always participates as thread 0, so only (thread_count - 1) threads are spawned.
+    // A thread count of 0 means one thread per core.
+    explicit ThreadPool(u32 max_thread_count = 0) {
+        thread_count = getThreadCount(max_thread_count);
+        run_lock = os::createSemaphore(1);
+        os::signalSemaphore(run_lock);
+        if (thread_count == 1) return;
+
+        work_started = os::createSemaphore(thread_count);
+        work_finished = os::createSemaphore(thread_count);
+        for (u32 i = 1; i < thread_count; i++) {
+            workers[i] = {this, i};
+            threads[i] = os::createThread(workerLoop, workers + i);
+            if (!threads[i]) {
+                thread_count = i;
+                break;
+            }
+        }
+    }
+
+    // The workers point back at the pool, so it can not be copied:
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool& operator=(const ThreadPool &) = delete;
+
+    // Wakes the idle workers up to have them exit, and waits for them to do so before releasing their handles:
+    ~ThreadPool() {
+        os::closeSemaphore(run_lock);
+        if (!work_started) return;
+
+        stopping = true;
+        os::signalSemaphore(work_started, thread_count - 1);
+        for (u32 i = 1; i < thread_count; i++) os::joinThread(threads[i]);
+        os::closeSemaphore(work_started);
+        os::closeSemaphore(work_finished);
+    }
+
+    static u32 getThreadCount(u32 max_thread_count = 0) {
+        u32 count = max_thread_count ? max_thread_count : os::getCoreCount();
+        return Min(Max(count, 1), THREAD_POOL_MAX_THREADS);
+    }
+
+    // Runs task(data, task_index, thread_index) for every task index in [0, task_count) and returns once all are done.
+    // Tasks are dealt out to the threads in contiguous ranges (keeping neighbouring tasks on the same thread),
+    // and threads that run out of work steal from the back of the other threads' ranges.
+    // Concurrent calls run one after the other, so anything a call needs has to be passed through its task data.
+    // A task must not call run() on its own pool (it would wait forever for the call it is part of to finish).
+    void run(u32 task_count, ThreadPoolTask new_task, void *new_task_data) {
+        os::waitForSemaphore(run_lock);
+        task = new_task;
+        task_data = new_task_data;
+
+        for (u32 i = 0; i < thread_count; i++)
+            queues[i].range = ThreadPoolQueue::pack(
+                (u32)(((u64)task_count * i) / thread_count),
+                (u32)(((u64)task_count * (i + 1)) / thread_count)
+            );
+
+        if (thread_count > 1) os::signalSemaphore(work_started, thread_count - 1);
+        work(0);
+        for (u32 i = 1; i < thread_count; i++) os::waitForSemaphore(work_finished);
+        os::signalSemaphore(run_lock);
+    }
+
+    void work(u32 thread_index) {
+        u32 task_index;
+        while (queues[thread_index].pop(task_index) || steal(thread_index, task_index))
+            task(task_data, task_index, thread_index);
+    }
+
+    bool steal(u32 thief_index, u32 &task_index) {
+        for (u32 i = 1; i < thread_count; i++)
+            if (queues[(thief_index + i) % thread_count].steal(task_index))
+                return true;
+
+        return false;
+    }
+
+    static void workerLoop(void *data) {
+        ThreadPoolWorker &worker = *(ThreadPoolWorker*)data;
+        ThreadPool &pool = *worker.pool;
+        while (true) {
+            os::waitForSemaphore(pool.work_started);
+            if (pool.stopping) return;
+
+            pool.work(worker.index);
+            os::signalSemaphore(pool.work_finished);
+        }
+    }
+};
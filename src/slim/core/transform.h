@@ -60,6 +60,6 @@ struct Geometry {
     Transform transform{};
     GeometryType type{GeometryType_None};
     u32 material_id = 0, id = 0;
-    u8 flags = GEOMETRY_IS_VISIBLE | GEOMETRY_IS_SHADOWING;
+    u8 flags = GEOMETRY_IS_VISIBLE | GEOMETRY_IS_SHADOWING | GEOMETRY_IS_DIRTY;
     ColorID color{White};
 };
\ No newline at end of file
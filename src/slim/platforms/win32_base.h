@@ -129,9 +129,52 @@ u64 timers::getTicks() {
 void* os::getMemory(u64 size, u64 base) {
     return VirtualAlloc((LPVOID)base, (SIZE_T)size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
 }
+void os::freeMemory(void *address) { VirtualFree((LPVOID)address, 0, MEM_RELEASE); }
 
 void os::closeFile(void *handle) { return win32_closeFile(handle); }
 void* os::openFileForReading(const char* path) { return win32_openFileForReading(path); }
 void* os::openFileForWriting(const char* path) { return win32_openFileForWriting(path); }
 bool os::readFromFile(LPVOID out, DWORD size, HANDLE handle) { return win32_readFromFile(out, size, handle); }
-bool os::writeToFile(LPVOID out, DWORD size, HANDLE handle) { return win32_writeToFile(out, size, handle); }
\ No newline at end of file
+bool os::writeToFile(LPVOID out, DWORD size, HANDLE handle) { return win32_writeToFile(out, size, handle); }
+
+struct Win32ThreadStart {
+    os::ThreadProc proc;
+    void *data;
+};
+
+DWORD WINAPI win32_threadStart(LPVOID param) {
+    Win32ThreadStart start = *(Win32ThreadStart*)param;
+    HeapFree(GetProcessHeap(), 0, param);
+    start.proc(start.data);
+    return 0;
+}
+
+u32 os::getCoreCount() {
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    return (u32)system_info.dwNumberOfProcessors;
+}
+
+void* os::createThread(os::ThreadProc proc, void *data) {
+    Win32ThreadStart *start = (Win32ThreadStart*)HeapAlloc(GetProcessHeap(), 0, sizeof(Win32ThreadStart));
+    if (!start) return nullptr;
+    start->proc = proc;
+    start->data = data;
+    HANDLE handle = CreateThread(nullptr, 0, win32_threadStart, start, 0, nullptr);
+    if (!handle) HeapFree(GetProcessHeap(), 0, start);
+    return handle;
+}
+
+void os::joinThread(void *thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+void* os::createSemaphore(u32 max_count) { return CreateSemaphoreA(nullptr, 0, (LONG)max_count, nullptr); }
+void os::signalSemaphore(void *semaphore, u32 count) { ReleaseSemaphore(semaphore, (LONG)count, nullptr); }
+void os::waitForSemaphore(void *semaphore) { WaitForSingleObject(semaphore, INFINITE); }
+void os::closeSemaphore(void *semaphore) { CloseHandle(semaphore); }
+
+u64 os::atomicCompareExchange(volatile u64 *target, u64 exchange, u64 comparand) {
+    return (u64)InterlockedCompareExchange64((volatile LONG64*)target, (LONG64)exchange, (LONG64)comparand);
+}
\ No newline at end of file
@@ -7,6 +7,7 @@
 //#define RAY_TRACER_DEFAULT_SETTINGS_RENDER_MODE RenderMode_Beauty
 
 
+// Settings that rendered images depend on need hashing in RayTracingRenderer::hashSettings(), to reset accumulation:
 struct RayTracerSettings {
     u8 max_depth;
     char skybox_color_texture_id;
@@ -14,8 +15,176 @@ struct RayTracerSettings {
     char skybox_irradiance_texture_id;
     RenderMode render_mode;
     ColorID mip_level_colors[9];
+
+    // Diffuse image based lighting can come from the spherical harmonics of the irradiance (see IrradianceSH)
+    // instead of from sampling the irradiance cube map (which then need not be loaded at all):
+    bool use_irradiance_sh;
+    IrradianceSH irradiance_sh;
+
+    // Light sampling: Scenes with a light BVH (see Scene::updateLightBVH()) get shaded from this many of their point lights,
+    // picked at random by importance, rather than from all of them (0 shades from all). The seed varies the picks per frame:
+    u8 light_samples;
+    u32 light_sampling_seed;
 };
 
+// The stages of shading a bounce of a pixel's path, shared by shadeBounce() and the wavefront renderer:
+
+// Shades a ray that missed all geometry, with the skybox (if any):
+INLINE_XPU void shadeMiss(const RayTracerSettings &settings, const Scene &scene, const Ray &ray, Color &color) {
+    if (settings.skybox_color_texture_id >= 0)
+        color = scene.textures[settings.skybox_color_texture_id].sampleCube(
+            ray.direction.x,
+            ray.direction.y,
+            ray.direction.z
+        ).color;
+}
+
+// Whether surfaces get shaded from a sample of the point lights (see RayTracerSettings), rather than from all of them:
+INLINE_XPU bool isSamplingLights(const RayTracerSettings &settings, const Scene &scene) {
+    return settings.light_samples && scene.light_bvh.node_count && scene.point_light_count > settings.light_samples;
+}
+
+// Shades a prepared surface from the point / directional lights, either all of them or a sample of them:
+INLINE_XPU void shadeFromLights(const RayTracerSettings &settings, const Scene &scene, SceneTracer &scene_tracer,
+                                SurfaceShader &surface, Color &color) {
+    if (isSamplingLights(settings, scene))
+        surface.shadeFromSampledLights(scene, scene_tracer, settings.light_samples, settings.light_sampling_seed, color);
+    else
+        surface.shadeFromLights(scene, scene_tracer, color);
+}
+
+// Shades a prepared surface with area lights and Image Based Lighting (after point / directional lights):
+INLINE_XPU void shadeFromAreaLightsAndSkybox(const RayTracerSettings &settings, const Scene &scene, SceneTracer &scene_tracer,
+                                             SurfaceShader &surface, Color &color) {
+    // Area Lights:
+    if (scene.flags & SCENE_HAD_EMISSIVE_QUADS)
+        surface.shadeFromEmissiveQuads(scene, scene_tracer, color);
+
+    // Image Based Lighting:
+    if ((settings.use_irradiance_sh || settings.skybox_irradiance_texture_id >= 0) &&
+        settings.skybox_radiance_texture_id >= 0) {
+        surface.L = surface.N;
+        surface.NdotL = 1.0f;
+        Color D{settings.use_irradiance_sh ?
+            settings.irradiance_sh.evaluate(surface.N.x,surface.N.y,surface.N.z) :
+            scene.textures[settings.skybox_irradiance_texture_id].sampleCube(surface.N.x,surface.N.y,surface.N.z).color};
+        Color S{scene.textures[settings.skybox_radiance_texture_id  ].sampleCube(surface.R.x,surface.R.y,surface.R.z).color};
+        surface.radianceFraction();
+        color = D.mulAdd(surface.Fd, surface.Fs.mulAdd(S, color));
+    }
+}
+
+// Continues the path off of reflective or refractive surfaces (while it has depth left), resetting the ray
+// to the reflected or refracted ray and returning the fraction of light that it carries back:
+INLINE_XPU bool continuePath(SceneTracer &scene_tracer, SurfaceShader &surface, Ray &ray, const RayHit &hit,
+                             u32 &depth_left, Color &next_throughput) {
+    if ((surface.material->isReflective() ||
+         surface.material->isRefractive()) &&
+        --depth_left) {
+        ray.depth++;
+        scene_tracer.aux_ray.depth++;
+
+//      surface.H = (surface.R + surface.V).normalized();
+//      surface.F = schlickFresnel(clampedValue(surface.H.dot(surface.R)), surface.material->reflectivity);
+        surface.F = schlickFresnel(clampedValue(surface.N.dot(surface.R)), surface.material->reflectivity);
+        next_throughput = surface.refracted ? (1.0f - surface.F) : surface.F;
+        ray.reset(hit.position, surface.RF);
+        return true;
+    }
+
+    depth_left = 0;
+    return false;
+}
+
+// Adds the glow of a point light, if the ray passes by it:
+INLINE_XPU void shadeLightGlow(const Light &light, SceneTracer &scene_tracer, Ray &ray, RayHit &hit, Color &color) {
+    if (scene_tracer.hitLight(light, ray, hit))
+        color = light.color.scaleAdd(pow(scene_tracer.light_tracer.integrateDensity(), 8.0f) * 4, color);
+}
+
+// Adds the glow of point lights that the ray passes by. With a light BVH, only the lights whose glow spheres are
+// in nodes that the ray enters (before its hit) get tested:
+INLINE_XPU void shadeLightGlows(const Scene &scene, SceneTracer &scene_tracer, Ray &ray, RayHit &hit, Color &color) {
+    if (!scene.lights)
+        return;
+
+    if (!scene.light_bvh.node_count) {
+        for (u32 i = 0; i < scene.counts.lights; i++)
+            shadeLightGlow(scene.lights[i], scene_tracer, ray, hit, color);
+        return;
+    }
+
+    u32 stack[SCENE_LIGHT_BVH_STACK_SIZE], node_id = 0, top = 0;
+    f32 near_distance, far_distance;
+    while (true) {
+        const BVHNode &node = scene.light_bvh.nodes[node_id];
+        if (ray.hitsAABB(node.aabb, near_distance, far_distance) && near_distance < hit.distance) {
+            if (!node.leaf_count) {
+                stack[top++] = node.first_index + 1;
+                node_id = node.first_index;
+                continue;
+            }
+
+            for (u32 i = 0; i < node.leaf_count; i++)
+                shadeLightGlow(scene.lights[scene.light_bvh_leaf_light_indices[node.first_index + i]], scene_tracer, ray, hit, color);
+        }
+
+        if (!top)
+            return;
+
+        node_id = stack[--top];
+    }
+}
+
+// Shades where the ray of a pixel's path hit (or what it missed), adding what that contributes to the pixel's color
+// (weighted by the throughput of the path so far). The ray's geometry is expected to have been traced already.
+// Returns whether the path continues, with the ray reset to the reflected or refracted ray for tracing next:
+INLINE_XPU bool shadeBounce(
+    const RayTracerSettings &settings,
+    const CameraRayProjection &projection,
+    Scene &scene,
+    SceneTracer &scene_tracer,
+    SurfaceShader &surface,
+    Ray &ray,
+    RayHit &hit,
+
+    Color &color,
+    f32 &depth,
+    Color &throughput,
+    u32 &depth_left
+) {
+    Color next_throughput, current_color = Black;
+
+    if (surface.geometry) { // Hit:
+        surface.material = scene.materials + surface.geometry->material_id;
+        if (surface.material->isEmissive() && surface.geometry->type == GeometryType_Quad && !hit.from_behind) {
+            depth_left = 0;
+            current_color = surface.material->emission;
+        } else {
+            surface.prepareForShading(ray, hit, scene.materials, scene.textures);
+            if (depth_left == settings.max_depth) depth = projection.getDepthAt(hit.position);
+
+            // Point / Directional lights:
+            if (scene.lights)
+                shadeFromLights(settings, scene, scene_tracer, surface, current_color);
+
+            shadeFromAreaLightsAndSkybox(settings, scene, scene_tracer, surface, current_color);
+            continuePath(scene_tracer, surface, ray, hit, depth_left, next_throughput);
+        }
+    } else { // Miss:
+        depth_left = 0;
+        shadeMiss(settings, scene, ray, current_color);
+    }
+
+    shadeLightGlows(scene, scene_tracer, ray, hit, current_color);
+
+    color = current_color.mulAdd(throughput, color);
+    if (!depth_left) return false;
+
+    throughput *= next_throughput;
+    return true;
+}
+
 INLINE_XPU void renderPixelBeauty(
     const RayTracerSettings &settings,
     const CameraRayProjection &projection,
@@ -28,80 +197,27 @@ INLINE_XPU void renderPixelBeauty(
     const vec3 &direction,
 
     Color &color,
-    f32 &depth
+    f32 &depth,
+
+    bool primary_ray_traced = false
 ) {
     color = Black;
     depth = INFINITY;
 
-    ray.reset(projection.camera_position, direction.normalized());
+    if (!primary_ray_traced) ray.reset(projection.camera_position, direction.normalized());
 
-    Color current_color, next_throughput, throughput = 1.0f;
+    Color throughput = 1.0f;
     u32 depth_left = settings.max_depth;
     ray.depth = scene_tracer.aux_ray.depth = 1;
 
     while (depth_left) {
-        current_color = Black;
-
-        surface.geometry = scene_tracer.trace(ray, hit, scene);
-        if (surface.geometry) { // Hit:
-            surface.material = scene.materials + surface.geometry->material_id;
-            if (surface.material->isEmissive() && surface.geometry->type == GeometryType_Quad && !hit.from_behind) {
-                depth_left = 0;
-                current_color = surface.material->emission;
-            } else {
-                surface.prepareForShading(ray, hit, scene.materials, scene.textures);
-                if (depth_left == settings.max_depth) depth = projection.getDepthAt(hit.position);
-
-                // Point / Directional lights:
-                if (scene.lights)
-                    for (u32 i = 0; i < scene.counts.lights; i++)
-                        surface.shadeFromLight(scene.lights[i], scene, scene_tracer, current_color);
-
-                // Area Lights:
-                if (scene.flags & SCENE_HAD_EMISSIVE_QUADS)
-                    surface.shadeFromEmissiveQuads(scene, current_color);
-
-                // Image Based Lighting:
-                if (settings.skybox_irradiance_texture_id >= 0 &&
-                    settings.skybox_radiance_texture_id >= 0) {
-                    surface.L = surface.N;
-                    surface.NdotL = 1.0f;
-                    Color D{scene.textures[settings.skybox_irradiance_texture_id].sampleCube(surface.N.x,surface.N.y,surface.N.z).color};
-                    Color S{scene.textures[settings.skybox_radiance_texture_id  ].sampleCube(surface.R.x,surface.R.y,surface.R.z).color};
-                    surface.radianceFraction();
-                    current_color = D.mulAdd(surface.Fd, surface.Fs.mulAdd(S, current_color));
-                }
-
-                if ((surface.material->isReflective() ||
-                     surface.material->isRefractive()) &&
-                    --depth_left) {
-                    ray.depth++;
-                    scene_tracer.aux_ray.depth++;
-
-//                          surface.H = (surface.R + surface.V).normalized();
-//                          surface.F = schlickFresnel(clampedValue(surface.H.dot(surface.R)), surface.material->reflectivity);
-                    surface.F = schlickFresnel(clampedValue(surface.N.dot(surface.R)), surface.material->reflectivity);
-                    next_throughput = surface.refracted ? (1.0f - surface.F) : surface.F;
-                    ray.reset(hit.position, surface.RF);
-                } else depth_left = 0;
-            }
-        } else { // Miss:
-            depth_left = 0;
-            if (settings.skybox_color_texture_id >= 0)
-                current_color = scene.textures[settings.skybox_color_texture_id].sampleCube(
-                    ray.direction.x,
-                    ray.direction.y,
-                    ray.direction.z
-                ).color;
-        }
+        if (primary_ray_traced) // The primary ray was traced as part of a packet:
+            primary_ray_traced = false;
+        else
+            surface.geometry = scene_tracer.trace(ray, hit, scene);
 
-        if (scene.lights)
-            for (u32 i = 0; i < scene.counts.lights; i++)
-                if (scene_tracer.hitLight(scene.lights[i], ray, hit))
-                    current_color = scene.lights[i].color.scaleAdd(pow(scene_tracer.light_tracer.integrateDensity(), 8.0f) * 4, current_color);
-
-        color = current_color.mulAdd(throughput, color);
-        throughput *= next_throughput;
+        if (!shadeBounce(settings, projection, scene, scene_tracer, surface, ray, hit, color, depth, throughput, depth_left))
+            break;
     }
 
     color.applyToneMapping();
@@ -119,14 +235,17 @@ INLINE_XPU void renderPixelDebugMode(
     const vec3 &direction,
 
     Color &color,
-    f32 &depth
+    f32 &depth,
+
+    bool primary_ray_traced = false
 ) {
     color = Black;
     depth = INFINITY;
 
-    ray.reset(projection.camera_position, direction.normalized());
-
-    surface.geometry = scene_tracer.trace(ray, hit, scene);
+    if (!primary_ray_traced) {
+        ray.reset(projection.camera_position, direction.normalized());
+        surface.geometry = scene_tracer.trace(ray, hit, scene);
+    }
     if (surface.geometry) {
         surface.prepareForShading(ray, hit, scene.materials, scene.textures);
         depth = projection.getDepthAt(hit.position);
@@ -153,10 +272,12 @@ INLINE_XPU void renderPixel(
     const vec3 &direction,
 
     Color &color,
-    f32 &depth
+    f32 &depth,
+
+    bool primary_ray_traced = false
 ) {
     if (settings.render_mode == RenderMode_Beauty)
-        renderPixelBeauty(settings, projection, scene, scene_tracer, surface, ray, hit, direction, color, depth);
+        renderPixelBeauty(settings, projection, scene, scene_tracer, surface, ray, hit, direction, color, depth, primary_ray_traced);
     else
-        renderPixelDebugMode(settings, projection, scene, scene_tracer, surface, ray, hit, direction, color, depth);
+        renderPixelDebugMode(settings, projection, scene, scene_tracer, surface, ray, hit, direction, color, depth, primary_ray_traced);
 }
\ No newline at end of file
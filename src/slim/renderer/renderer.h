@@ -3,6 +3,9 @@
 #include "../viewport/viewport.h"
 #include "ray_tracer.h"
 #include "surface_shader.h"
+#include "../core/thread_pool.h"
+#include "../scene/packet_tracer.h"
+#include "wavefront.h"
 
 #ifdef __CUDACC__
 #include "./renderer_GPU.h"
@@ -14,25 +17,196 @@ void uploadCameras(const Scene &scene) {}
 void uploadGeometries(const Scene &scene) {}
 void uploadMaterials(const Scene &scene) {}
 void uploadSceneBVH(const Scene &scene) {}
+void uploadEmissiveQuads(const Scene &scene) {}
+void uploadLightBVH(const Scene &scene) {}
 #endif
 
 #define RAY_TRACER_DEFAULT_SETTINGS_SKYBOX_TEXTURE_ID 1
 #define RAY_TRACER_DEFAULT_SETTINGS_MAX_DEPTH 3
 #define RAY_TRACER_DEFAULT_SETTINGS_RENDER_MODE RenderMode_Beauty
+#define RAY_TRACER_TILE_SIZE 32
+#define RAY_TRACER_TILE_PIXEL_COUNT (RAY_TRACER_TILE_SIZE * RAY_TRACER_TILE_SIZE)
+#define RAY_TRACER_ACCUMULATION_MAX_CHANGE 0.001f // Accumulation counts as converged once a frame changes the image less
+#ifndef RAY_TRACER_DYNAMIC_RESOLUTION_TARGET_MILLISECONDS
+#define RAY_TRACER_DYNAMIC_RESOLUTION_TARGET_MILLISECONDS 33.0f // Frame time to scale the resolution for by default
+#endif
+#ifndef RAY_TRACER_DYNAMIC_RESOLUTION_MAX_SCALE
+#define RAY_TRACER_DYNAMIC_RESOLUTION_MAX_SCALE 4 // Pixels per traced pixel along each axis at most (dividing the tile size)
+#endif
+#ifndef RAY_TRACER_CHECKERBOARD_MAX_REPROJECTION_ERROR
+#define RAY_TRACER_CHECKERBOARD_MAX_REPROJECTION_ERROR 0.75f // How far off a pixel (in pixels) a reprojected sample may be
+#endif
+#ifndef RAY_TRACER_CHECKERBOARD_MAX_DEPTH_RATIO
+#define RAY_TRACER_CHECKERBOARD_MAX_DEPTH_RATIO 1.05f // How much farther than its neighbours a reprojected sample may be
+#endif
+#ifndef RAY_TRACER_ADAPTIVE_SAMPLING_MAX_SAMPLES
+#define RAY_TRACER_ADAPTIVE_SAMPLING_MAX_SAMPLES 8 // Samples per pixel at most
+#endif
+#ifndef RAY_TRACER_ADAPTIVE_SAMPLING_MIN_SAMPLES
+#define RAY_TRACER_ADAPTIVE_SAMPLING_MIN_SAMPLES 3 // Samples per pixel before their variance is trusted
+#endif
+#ifndef RAY_TRACER_ADAPTIVE_SAMPLING_TARGET_ERROR
+#define RAY_TRACER_ADAPTIVE_SAMPLING_TARGET_ERROR 0.02f // Standard error of a pixel's mean, relative to its luminance
+#endif
+#ifndef RAY_TRACER_ADAPTIVE_SAMPLING_MIN_CONTRAST
+#define RAY_TRACER_ADAPTIVE_SAMPLING_MIN_CONTRAST 0.05f // Luminance difference between neighbours that needs samples
+#endif
+#ifndef RAY_TRACER_ADAPTIVE_SAMPLING_MIN_DEPTH_RATIO
+#define RAY_TRACER_ADAPTIVE_SAMPLING_MIN_DEPTH_RATIO 1.1f // Depth ratio between neighbours that needs samples
+#endif
 
+// A pixel's path through the scene, for tracing the secondary rays of a whole tile in sorted waves:
+struct RayTracerPath {
+    Ray ray;
+    RayHit hit;
+    Color color, throughput;
+    f32 depth;
+    u32 depth_left, sort_key;
+};
 
-struct RayTracingRenderer {
-    Scene &scene;
-    SceneTracer &scene_tracer;
-    CameraRayProjection &projection;
+// Secondary rays get sorted by the cell of the scene's bounds their origin is in (8 cells per axis along a Morton curve),
+// then by the octant of their direction, and then by the material of the surface they leave from.
+// Rays with equal keys tend to traverse the same nodes and shade alike, so tracing them one after another reuses caches:
+INLINE u32 getSecondaryRaySortKey(const Ray &ray, u32 material_id, const AABB &bounds) {
+    vec3 cell{(ray.origin - bounds.min) * (8.0f / maximum(bounds.max - bounds.min, vec3{EPS}))};
+    u64 cell_x = (u64)clampedValue(cell.x, 0.0f, 7.0f);
+    u64 cell_y = (u64)clampedValue(cell.y, 0.0f, 7.0f);
+    u64 cell_z = (u64)clampedValue(cell.z, 0.0f, 7.0f);
+    u32 morton_cell = (u32)(expandBitsForMortonCode(cell_x) << 2 | expandBitsForMortonCode(cell_y) << 1 | expandBitsForMortonCode(cell_z));
+    u32 octant = (ray.direction.x < 0) | (ray.direction.y < 0) << 1 | (ray.direction.z < 0) << 2;
+    return morton_cell << 11 | octant << 8 | (material_id & 255);
+}
 
-    RayTracerSettings settings;
+// The index'th value of the Halton sequence of the given base (a low-discrepancy sequence in [0, 1)):
+INLINE f32 getHaltonValue(u32 index, u32 base) {
+    f32 value = 0.0f;
+    f32 fraction = 1.0f;
+    while (index) {
+        fraction /= (f32)base;
+        value += fraction * (f32)(index % base);
+        index /= base;
+    }
+    return value;
+}
+
+
+struct RayTracingWorker {
+    SceneTracer scene_tracer;
+    PacketTracer packet_tracer;
     SurfaceShader surface;
     Ray ray;
     RayHit hit;
     Color color;
     f32 depth;
 
+    Ray rays[RAY_PACKET_SIZE];
+    RayHit hits[RAY_PACKET_SIZE];
+    Geometry *geometries[RAY_PACKET_SIZE];
+
+    // The paths of a tile when sorting secondary rays, and the queue of their next rays:
+    RayTracerPath *paths;
+    RayQueue path_queue;
+
+    Wavefront wavefront;
+
+    // How many secondary rays got sorted, and how many of them had a different sort key than the ray before them
+    // in pixel order and in the sorted order:
+    u32 sorted_ray_count, unsorted_key_changes, sorted_key_changes;
+
+    // How much accumulating the last frame changed the averaged colors of the worker's tiles, and how bright they are:
+    f32 accumulation_change, accumulated_brightness;
+
+    u32 sample_count; // How many samples got rendered
+    u32 reprojected_pixel_count, interpolated_pixel_count; // How many pixels got reconstructed each way (checkerboarding)
+
+    static u64 getSizeInBytes(u32 stack_size, u32 mesh_stack_size) {
+        return sizeof(RayTracingWorker) + SceneTracer::getSizeInBytes(stack_size, mesh_stack_size) +
+            PacketTracer::getSizeInBytes(stack_size, mesh_stack_size) +
+            sizeof(RayTracerPath) * RAY_TRACER_TILE_PIXEL_COUNT + RayQueue::getSizeInBytes(RAY_TRACER_TILE_PIXEL_COUNT) +
+            Wavefront::getSizeInBytes(RAY_TRACER_TILE_PIXEL_COUNT);
+    }
+
+    RayTracingWorker(u32 stack_size, u32 mesh_stack_size, memory::MonotonicAllocator *memory_allocator) :
+        scene_tracer{stack_size, mesh_stack_size, memory_allocator},
+        packet_tracer{scene_tracer, stack_size, mesh_stack_size, memory_allocator},
+        path_queue{RAY_TRACER_TILE_PIXEL_COUNT, memory_allocator},
+        wavefront{RAY_TRACER_TILE_PIXEL_COUNT, memory_allocator} {
+        paths = (RayTracerPath*)memory_allocator->allocate(sizeof(RayTracerPath) * RAY_TRACER_TILE_PIXEL_COUNT);
+        sorted_ray_count = unsorted_key_changes = sorted_key_changes = sample_count = 0;
+        reprojected_pixel_count = interpolated_pixel_count = 0;
+        accumulation_change = accumulated_brightness = 0;
+    }
+};
+
+struct RayTracingRenderer {
+    Scene &scene;
+    SceneTracer &scene_tracer;
+    CameraRayProjection &projection;
+
+    RayTracerSettings settings;
+    ThreadPool thread_pool;
+    RayTracingWorker *workers;
+    const Canvas *tiles_canvas = nullptr;
+    u32 tile_columns = 0;
+    u32 tile_rows = 0;
+    u32 updated_geometry_count = 0; // How many geometries were marked as dirty in the last rendered frame
+    bool use_threads = true;
+    bool use_packets = true;
+    bool refit_scene_bvh = true;
+    bool sort_secondary_rays = false; // Trace the reflected and refracted rays of each tile in sorted waves
+    bool use_wavefront = false; // Render each tile in stages over all its paths (see Wavefront), instead of pixel by pixel
+
+    // Secondary rays traced in sorted waves in the last rendered frame, and how much fewer changes of sort key
+    // (origin cell, direction octant or material) there were between consecutive rays than in pixel order:
+    u32 sorted_secondary_ray_count = 0;
+    f32 secondary_ray_coherence_gain = 1.0f;
+
+    // Progressive accumulation: While the camera, scene and settings stay the same, each frame is rendered with
+    // the pixels' sample positions jittered, and averaged with the frames rendered before it (on the CPU).
+    // Anything changing resets the average automatically (as can resetAccumulation()):
+    bool accumulate = false;
+    u32 accumulated_frame_count = 0;
+    f32 accumulation_change = INFINITY; // How much the last frame changed the average, relative to its brightness
+    Color *accumulated_colors = nullptr;
+    u64 accumulated_state_hash = 0;
+    vec3 unjittered_projection_start;
+
+    // Adaptive sampling: After a sample at the center of every pixel, pixels that differ from their neighbours in
+    // luminance or depth (edges, silhouettes, material boundaries) get more samples (at jittered positions),
+    // until the standard error of their mean luminance meets the target or they have the maximum number of samples:
+    bool adaptive_sampling = false;
+    u8 adaptive_sampling_max_samples = RAY_TRACER_ADAPTIVE_SAMPLING_MAX_SAMPLES;
+    f32 adaptive_sampling_target_error = RAY_TRACER_ADAPTIVE_SAMPLING_TARGET_ERROR;
+    f32 samples_per_pixel = 1.0f; // Samples rendered per pixel in the last frame (on the CPU)
+    bool *pixel_needs_samples = nullptr;
+
+    // Checkerboard rendering: Each frame traces every other pixel (alternating between frames, like the colors of
+    // a checkerboard) and reconstructs the rest by reprojecting the previous frame, using its depths and camera.
+    // Pixels that the previous frame did not see (disocclusions) get interpolated from their traced neighbours.
+    // Applies on the CPU to canvases without SSAA, when not accumulating or sampling adaptively:
+    bool checkerboard = false;
+    f32 reprojected_pixel_ratio = 0; // Of the pixels reconstructed in the last frame, how many got reprojected
+    Color *history_colors[2] = {nullptr, nullptr}; // The last 2 frames (the previous one is reprojected from)
+    f32 *history_depths[2] = {nullptr, nullptr};
+    CameraRayProjection history_projection;
+    Dimensions history_dimensions;
+    u8 history_index = 0;
+    bool history_is_valid = false;
+
+    // Dynamic resolution: While the view moves, frames get traced at a lower resolution (every resolution_scale'th
+    // pixel of every resolution_scale'th row) and upscaled, picking the highest resolution that meets a target frame time.
+    // Once the view holds still, frames refine back to full resolution (see updateResolutionScale).
+    // Applies on the CPU to canvases without SSAA, when not accumulating or sampling adaptively:
+    bool dynamic_resolution = false;
+    f32 target_milliseconds_per_frame = RAY_TRACER_DYNAMIC_RESOLUTION_TARGET_MILLISECONDS;
+    u8 resolution_scale = 1; // Pixels per traced pixel along each axis (1 at full resolution)
+    bool resolution_scale_changed = false;
+    f32 last_milliseconds_per_frame = 0;
+    u64 last_view_hash = 0;
+
+    // Which pixels of a frame get traced: Every pixel_step'th one (offset per row and column) of every row_step'th row:
+    i32 pixel_step = 1, row_step = 1, pixel_offset = 0;
+
     explicit RayTracingRenderer(Scene &scene,
                                 SceneTracer &scene_tracer,
                                 CameraRayProjection &projection,
@@ -40,13 +214,18 @@ struct RayTracingRenderer {
                                 char skybox_color_texture_id = -1,
                                 char skybox_radiance_texture_id = -1,
                                 char skybox_irradiance_texture_id = -1,
-                                RenderMode render_mode = RAY_TRACER_DEFAULT_SETTINGS_RENDER_MODE) :
-                                scene{scene}, scene_tracer{scene_tracer}, projection{projection} {
+                                RenderMode render_mode = RAY_TRACER_DEFAULT_SETTINGS_RENDER_MODE,
+                                u32 thread_count = 0,
+                                memory::MonotonicAllocator *memory_allocator = nullptr) :
+                                scene{scene}, scene_tracer{scene_tracer}, projection{projection}, thread_pool{thread_count} {
         settings.skybox_color_texture_id = skybox_color_texture_id;
         settings.skybox_radiance_texture_id = skybox_radiance_texture_id;
         settings.skybox_irradiance_texture_id = skybox_irradiance_texture_id;
         settings.max_depth = max_depth;
         settings.render_mode = render_mode;
+        settings.use_irradiance_sh = false;
+        settings.light_samples = 0;
+        settings.light_sampling_seed = 0;
         settings.mip_level_colors[0] = BrightRed;
         settings.mip_level_colors[1] = BrightYellow;
         settings.mip_level_colors[2] = BrightGreen;
@@ -57,25 +236,61 @@ struct RayTracingRenderer {
         settings.mip_level_colors[7] = Grey;
         settings.mip_level_colors[8] = DarkGrey;
 
+        // Each thread traces through its own tracer, shader and traversal stacks:
+        memory::MonotonicAllocator temp_allocator;
+        if (!memory_allocator) {
+            temp_allocator = memory::MonotonicAllocator{getSizeInBytes(scene, thread_pool.thread_count)};
+            memory_allocator = &temp_allocator;
+        }
+        u32 stack_size = scene.counts.geometries;
+        u32 mesh_stack_size = scene.mesh_stack_size;
+        workers = (RayTracingWorker*)memory_allocator->allocate(sizeof(RayTracingWorker) * thread_pool.thread_count);
+        for (u32 i = 0; i < thread_pool.thread_count; i++)
+            new(workers + i) RayTracingWorker{stack_size, mesh_stack_size, memory_allocator};
+
         initDataOnGPU(scene);
     }
 
+    // The memory needed for the workers of the given number of threads (0 meaning one per core):
+    static u64 getSizeInBytes(const Scene &scene, u32 thread_count = 0) {
+        return RayTracingWorker::getSizeInBytes(scene.counts.geometries, scene.mesh_stack_size) *
+            ThreadPool::getThreadCount(thread_count);
+    }
+
     void render(const Viewport &viewport, bool update_scene = true, bool use_GPU = false) {
-        const Camera &camera = *viewport.camera;
         const Canvas &canvas = viewport.canvas;
 
-        ray.origin = camera.position;
-
         if (update_scene) {
-            scene.updateAABBs();
-            scene.updateBVH();
+            // Only geometry marked as dirty gets new bounds, and a frame where none was leaves the BVH as it is.
+            // Likewise, the light BVH and the emissive quads are only updated when what they derive from changed:
+            updated_geometry_count = scene.updateAABBs();
+            bool lights_changed = scene.haveLightsChanged();
+            bool materials_changed = scene.haveMaterialsChanged();
+            bool emissive_quads_changed = scene.haveGeometryMaterialsChanged() || materials_changed || updated_geometry_count;
+            if (updated_geometry_count) {
+                if (refit_scene_bvh)
+                    scene.refitBVH(SCENE_BVH_MAX_REFIT_SAH_GROWTH, 1, use_threads ? &thread_pool : nullptr);
+                else
+                    scene.updateBVH(1, use_threads ? &thread_pool : nullptr);
+            }
+            if (emissive_quads_changed) scene.updateEmissiveQuads();
+            if (lights_changed) scene.updateLightBVH();
             if (use_GPU) {
-                uploadLights(scene);
                 uploadCameras(scene);
                 uploadGeometries(scene);
-                uploadSceneBVH(scene);
+                if (lights_changed) {
+                    uploadLights(scene);
+                    uploadLightBVH(scene);
+                }
+                if (materials_changed) uploadMaterials(scene);
+                if (updated_geometry_count) uploadSceneBVH(scene);
+                if (emissive_quads_changed) uploadEmissiveQuads(scene);
             }
-        }
+        } else
+            updated_geometry_count = 0;
+
+        // Lights get picked differently every frame, so that accumulating frames converges to shading from all of them:
+        if (isSamplingLights(settings, scene)) settings.light_sampling_seed++;
 #ifdef __CUDACC__
         if (use_GPU) renderOnGPU(canvas, projection, settings);
         else         renderOnCPU(canvas);
@@ -85,17 +300,652 @@ struct RayTracingRenderer {
     }
 
     void renderOnCPU(const Canvas &canvas) {
+        u32 width  = canvas.dimensions.width  * (canvas.antialias == SSAA ? 2 : 1);
+        u32 height = canvas.dimensions.height * (canvas.antialias == SSAA ? 2 : 1);
+        tiles_canvas = &canvas;
+        tile_columns = (width  + RAY_TRACER_TILE_SIZE - 1) / RAY_TRACER_TILE_SIZE;
+        tile_rows    = (height + RAY_TRACER_TILE_SIZE - 1) / RAY_TRACER_TILE_SIZE;
+        u32 tile_count = tile_columns * tile_rows;
+
+        for (u32 i = 0; i < thread_pool.thread_count; i++) {
+            workers[i].sorted_ray_count = workers[i].unsorted_key_changes = workers[i].sorted_key_changes = 0;
+            workers[i].sample_count = 0;
+            workers[i].reprojected_pixel_count = workers[i].interpolated_pixel_count = 0;
+            workers[i].accumulation_change = workers[i].accumulated_brightness = 0;
+        }
+        if (accumulate) beginAccumulatedFrame(canvas);
+
+        // A lower resolution takes precedence over checkerboarding (which reprojects from frames at full resolution):
+        bool can_skip_pixels = !accumulate && !adaptive_sampling && canvas.antialias != SSAA;
+        u8 scale = dynamic_resolution && can_skip_pixels ? resolution_scale : 1;
+        bool checkerboarding = checkerboard && can_skip_pixels && scale == 1;
+        pixel_step = row_step = scale;
+        pixel_offset = 0;
+        if (checkerboarding)
+            beginCheckerboardFrame(canvas);
+        else
+            history_is_valid = false;
+
+        runOnTiles(tile_count, renderTileTask);
+        if (scale > 1) runOnTiles(tile_count, upscaleTileTask);
+        if (checkerboarding) {
+            // Pixels are reconstructed from their neighbours in other tiles too, so all tiles need to be traced first:
+            runOnTiles(tile_count, reconstructTileTask);
+            finishCheckerboardFrame(canvas);
+        }
+        if (adaptive_sampling) {
+            // Pixels are compared to their neighbours in other tiles too, so all center samples need to be in first:
+            if (!pixel_needs_samples) {
+                memory::MonotonicAllocator memory_allocator{sizeof(bool) * MAX_WINDOW_SIZE * 4};
+                pixel_needs_samples = (bool*)memory_allocator.allocate(sizeof(bool) * MAX_WINDOW_SIZE * 4);
+            }
+            runOnTiles(tile_count, findPixelsNeedingSamplesTask);
+            runOnTiles(tile_count, sampleTileAdaptivelyTask);
+        }
+
+        u32 unsorted_key_changes = 0, sorted_key_changes = 0, sample_count = 0;
+        sorted_secondary_ray_count = 0;
+        for (u32 i = 0; i < thread_pool.thread_count; i++) {
+            sample_count += workers[i].sample_count;
+            sorted_secondary_ray_count += workers[i].sorted_ray_count;
+            unsorted_key_changes += workers[i].unsorted_key_changes;
+            sorted_key_changes += workers[i].sorted_key_changes;
+        }
+        secondary_ray_coherence_gain = (f32)Max(unsorted_key_changes, 1) / (f32)Max(sorted_key_changes, 1);
+        samples_per_pixel = (f32)sample_count / (f32)(width * height);
+
+        if (accumulate) finishAccumulatedFrame();
+    }
+
+    void beginCheckerboardFrame(const Canvas &canvas) {
+        if (!history_colors[0]) {
+            memory::MonotonicAllocator memory_allocator{(sizeof(Color) + sizeof(f32)) * MAX_WINDOW_SIZE * 2};
+            for (u8 i = 0; i < 2; i++) {
+                history_colors[i] = (Color*)memory_allocator.allocate(sizeof(Color) * MAX_WINDOW_SIZE);
+                history_depths[i] = (f32*  )memory_allocator.allocate(sizeof(f32)   * MAX_WINDOW_SIZE);
+            }
+        }
+        if (history_dimensions.width  != canvas.dimensions.width ||
+            history_dimensions.height != canvas.dimensions.height)
+            history_is_valid = false;
+
+        // Alternate the pixels that get traced between frames (along with the history they get kept in):
+        pixel_step = 2;
+        pixel_offset = history_index;
+    }
+
+    void finishCheckerboardFrame(const Canvas &canvas) {
+        history_projection = projection;
+        history_dimensions = canvas.dimensions;
+        history_index ^= 1;
+        history_is_valid = true;
+
+        u32 reprojected_pixel_count = 0, interpolated_pixel_count = 0;
+        for (u32 i = 0; i < thread_pool.thread_count; i++) {
+            reprojected_pixel_count += workers[i].reprojected_pixel_count;
+            interpolated_pixel_count += workers[i].interpolated_pixel_count;
+        }
+        reprojected_pixel_ratio = (f32)reprojected_pixel_count / (f32)Max(reprojected_pixel_count + interpolated_pixel_count, 1);
+    }
+
+    // Fills in the pixels of the tile that were not traced (keeping the whole frame for reprojecting the next one from):
+    void reconstructTile(i32 start_x, i32 start_y, i32 end_x, i32 end_y, RayTracingWorker &worker) {
+        const Canvas &canvas = *tiles_canvas;
+        i32 width  = canvas.dimensions.width;
+        i32 height = canvas.dimensions.height;
+        Color *colors = history_colors[history_index];
+        f32 *depths = history_depths[history_index];
+        i32 neighbour_offsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+        u32 neighbours[4];
+        for (i32 y = start_y; y < end_y; y++) {
+            for (i32 x = start_x; x < end_x; x++) {
+                u32 offset = getCanvasOffset(canvas, x, y);
+                Pixel &pixel = canvas.pixels[offset];
+                f32 &depth = canvas.depths[canvas.antialias == MSAA ? offset * 4 : offset];
+                if ((x + y + pixel_offset) % 2 == 0) { // Traced
+                    colors[offset] = pixel.color;
+                    depths[offset] = depth;
+                    continue;
+                }
+
+                // All the neighbours of a pixel that was not traced were traced:
+                u8 neighbour_count = 0;
+                f32 nearest_depth = INFINITY, farthest_depth = 0.0f;
+                for (auto &neighbour_offset : neighbour_offsets) {
+                    i32 neighbour_x = x + neighbour_offset[0];
+                    i32 neighbour_y = y + neighbour_offset[1];
+                    if (neighbour_x < 0 || neighbour_x == width ||
+                        neighbour_y < 0 || neighbour_y == height)
+                        continue;
+
+                    u32 neighbour = getCanvasOffset(canvas, neighbour_x, neighbour_y);
+                    neighbours[neighbour_count++] = neighbour;
+                    f32 neighbour_depth = canvas.depths[canvas.antialias == MSAA ? neighbour * 4 : neighbour];
+                    nearest_depth = Min(nearest_depth, neighbour_depth);
+                    farthest_depth = Max(farthest_depth, neighbour_depth);
+                }
+
+                // Try reprojecting from the previous frame at the depth of each neighbour:
+                bool reprojected = false;
+                if (history_is_valid)
+                    for (u8 i = 0; i < neighbour_count && !reprojected; i++) {
+                        u32 neighbour = neighbours[i];
+                        reprojected = reprojectPixel(x, y, canvas.depths[canvas.antialias == MSAA ? neighbour * 4 : neighbour],
+                                                     farthest_depth, pixel.color, depth);
+                    }
+
+                if (reprojected) {
+                    // Keep within the colors of the traced neighbours, rejecting what got reprojected from across an edge:
+                    Color lowest = canvas.pixels[neighbours[0]].color;
+                    Color highest = lowest;
+                    for (u8 i = 1; i < neighbour_count; i++) {
+                        const Color &color = canvas.pixels[neighbours[i]].color;
+                        lowest.r = Min(lowest.r, color.r); highest.r = Max(highest.r, color.r);
+                        lowest.g = Min(lowest.g, color.g); highest.g = Max(highest.g, color.g);
+                        lowest.b = Min(lowest.b, color.b); highest.b = Max(highest.b, color.b);
+                    }
+                    pixel.color.r = clampedValue(pixel.color.r, lowest.r, highest.r);
+                    pixel.color.g = clampedValue(pixel.color.g, lowest.g, highest.g);
+                    pixel.color.b = clampedValue(pixel.color.b, lowest.b, highest.b);
+                    worker.reprojected_pixel_count++;
+                } else {
+                    pixel.color = Black;
+                    for (u8 i = 0; i < neighbour_count; i++) pixel.color += canvas.pixels[neighbours[i]].color;
+                    pixel.color /= (f32)Max(neighbour_count, 1);
+                    depth = nearest_depth;
+                    worker.interpolated_pixel_count++;
+                }
+                pixel.opacity = 1.0f;
+
+                colors[offset] = pixel.color;
+                depths[offset] = depth;
+            }
+        }
+    }
+
+    // Looks up what the previous frame saw at a position seen through the pixel at the given depth.
+    // That is only used when it would be seen through the pixel now (and not from behind what its neighbours see):
+    bool reprojectPixel(i32 x, i32 y, f32 depth, f32 farthest_neighbour_depth, Color &color, f32 &reprojected_depth) const {
+        const Canvas &canvas = *tiles_canvas;
+        vec2 coords;
+        f32 previous_depth;
+        if (!history_projection.getCoordsOf(projection.getPositionAt(vec2{(f32)x, (f32)y}, depth), depth == INFINITY, coords, previous_depth) ||
+            coords.x < -0.5f || coords.x >= (f32)canvas.dimensions.width  - 0.5f ||
+            coords.y < -0.5f || coords.y >= (f32)canvas.dimensions.height - 0.5f)
+            return false;
+
+        // Only reproject what the previous frame traced, as reprojecting what it reconstructed compounds the error:
+        vec2 previous_coords{floorf(coords.x + 0.5f), floorf(coords.y + 0.5f)};
+        if (((i32)previous_coords.x + (i32)previous_coords.y + pixel_offset) % 2 == 0) {
+            vec2 offset{coords - previous_coords};
+            if (abs(offset.x) > abs(offset.y))
+                previous_coords.x += offset.x < 0 ? -1.0f : 1.0f;
+            else
+                previous_coords.y += offset.y < 0 ? -1.0f : 1.0f;
+            if (previous_coords.x < 0 || previous_coords.x == (f32)canvas.dimensions.width ||
+                previous_coords.y < 0 || previous_coords.y == (f32)canvas.dimensions.height)
+                return false;
+        }
+        u32 previous_offset = getCanvasOffset(canvas, (i32)previous_coords.x, (i32)previous_coords.y);
+        previous_depth = history_depths[history_index ^ 1][previous_offset];
+        if (!projection.getCoordsOf(history_projection.getPositionAt(previous_coords, previous_depth), previous_depth == INFINITY, coords, reprojected_depth) ||
+            abs(coords.x - (f32)x) > RAY_TRACER_CHECKERBOARD_MAX_REPROJECTION_ERROR ||
+            abs(coords.y - (f32)y) > RAY_TRACER_CHECKERBOARD_MAX_REPROJECTION_ERROR ||
+            reprojected_depth > farthest_neighbour_depth * RAY_TRACER_CHECKERBOARD_MAX_DEPTH_RATIO)
+            return false;
+
+        color = history_colors[history_index ^ 1][previous_offset];
+        return true;
+    }
+
+    // Picks the resolution of the next frame given how long frames recently took to render (on average), for when the
+    // resolution is dynamic: While the view moves, that is the highest resolution estimated to meet the target frame time.
+    // Once the view holds still, frames render at full resolution again:
+    void updateResolutionScale(f32 milliseconds_per_frame) {
+        u64 view_hash = hashBytes(&projection, sizeof(CameraRayProjection));
+        bool view_moved = view_hash != last_view_hash;
+        last_view_hash = view_hash;
+
+        u8 scale = resolution_scale;
+        if (!view_moved)
+            scale = 1;
+        else if (milliseconds_per_frame != last_milliseconds_per_frame) {
+            // The first new average after a change still includes frames at the previous resolution, so skip it:
+            if (resolution_scale_changed)
+                resolution_scale_changed = false;
+            else {
+                // Rendering time is mostly proportional to the number of pixels traced:
+                f32 milliseconds_at_full_resolution = milliseconds_per_frame * (f32)(resolution_scale * resolution_scale);
+                scale = 1;
+                while (scale < RAY_TRACER_DYNAMIC_RESOLUTION_MAX_SCALE &&
+                       milliseconds_at_full_resolution > target_milliseconds_per_frame * (f32)(scale * scale))
+                    scale *= 2;
+            }
+        }
+        last_milliseconds_per_frame = milliseconds_per_frame;
+
+        if (scale != resolution_scale) {
+            resolution_scale = scale;
+            resolution_scale_changed = true;
+        }
+    }
+
+    // Fills in the pixels of the tile that were not traced at a lower resolution, interpolating the traced pixels
+    // around them bilinearly (taking the depth of the nearest one):
+    void upscaleTile(i32 start_x, i32 start_y, i32 end_x, i32 end_y) {
+        const Canvas &canvas = *tiles_canvas;
+        i32 width  = canvas.dimensions.width;
+        i32 height = canvas.dimensions.height;
+        i32 scale = pixel_step;
+        f32 to_weight = 1.0f / (f32)scale;
+        for (i32 y = start_y; y < end_y; y++) {
+            i32 top = y - y % scale;
+            i32 bottom = top + scale < height ? top + scale : top;
+            f32 v = (f32)(y - top) * to_weight;
+            for (i32 x = start_x; x < end_x; x++) {
+                i32 left = x - x % scale;
+                if (left == x && top == y) continue; // Traced
+
+                i32 right = left + scale < width ? left + scale : left;
+                f32 u = (f32)(x - left) * to_weight;
+                u32 offset = getCanvasOffset(canvas, x, y);
+                Pixel &pixel = canvas.pixels[offset];
+                pixel.color = (canvas.pixels[getCanvasOffset(canvas, left,  top)].color * (1.0f - u) +
+                               canvas.pixels[getCanvasOffset(canvas, right, top)].color * u) * (1.0f - v) +
+                              (canvas.pixels[getCanvasOffset(canvas, left,  bottom)].color * (1.0f - u) +
+                               canvas.pixels[getCanvasOffset(canvas, right, bottom)].color * u) * v;
+                pixel.opacity = 1.0f;
+
+                u32 nearest = getCanvasOffset(canvas, u < 0.5f ? left : right, v < 0.5f ? top : bottom);
+                canvas.depths[canvas.antialias == MSAA ? offset * 4 : offset] = canvas.depths[canvas.antialias == MSAA ? nearest * 4 : nearest];
+            }
+        }
+    }
+
+    void resetAccumulation() { accumulated_frame_count = 0; }
+
+    // Whether the accumulated image has converged enough to stop rendering more frames of it (e.g. for stills):
+    bool accumulationConverged(f32 max_change = RAY_TRACER_ACCUMULATION_MAX_CHANGE) const {
+        return accumulate && accumulated_frame_count > 1 && accumulation_change <= max_change;
+    }
+
+    void beginAccumulatedFrame(const Canvas &canvas) {
+        if (!accumulated_colors) {
+            memory::MonotonicAllocator memory_allocator{sizeof(Color) * MAX_WINDOW_SIZE * 4};
+            accumulated_colors = (Color*)memory_allocator.allocate(sizeof(Color) * MAX_WINDOW_SIZE * 4);
+        }
+
+        u64 state_hash = hashAccumulatedState(canvas);
+        if (updated_geometry_count || state_hash != accumulated_state_hash) accumulated_frame_count = 0;
+        accumulated_state_hash = state_hash;
+        accumulated_frame_count++;
+
+        // The first frame samples the pixels' centers (just like without accumulation),
+        // later frames sample positions within the pixels along a Halton sequence:
+        unjittered_projection_start = projection.start;
+        if (accumulated_frame_count > 1)
+            projection.start += projection.right * (getHaltonValue(accumulated_frame_count, 2) - 0.5f) +
+                                projection.down  * (getHaltonValue(accumulated_frame_count, 3) - 0.5f);
+    }
+
+    void finishAccumulatedFrame() {
+        projection.start = unjittered_projection_start;
+
+        f32 change = 0, brightness = 0;
+        for (u32 i = 0; i < thread_pool.thread_count; i++) {
+            change += workers[i].accumulation_change;
+            brightness += workers[i].accumulated_brightness;
+        }
+        accumulation_change = accumulated_frame_count > 1 ? change / Max(brightness, EPS) : INFINITY;
+    }
+
+    // Averages the colors just rendered to the tile with those of the frames accumulated before it:
+    void accumulateTile(i32 start_x, i32 start_y, i32 end_x, i32 end_y, RayTracingWorker &worker) {
+        const Canvas &canvas = *tiles_canvas;
+        f32 frame_weight = 1.0f / (f32)accumulated_frame_count;
+        f32 previous_frame_weight = accumulated_frame_count > 1 ? 1.0f / (f32)(accumulated_frame_count - 1) : 0.0f;
+        for (i32 y = start_y; y < end_y; y++) {
+            for (i32 x = start_x; x < end_x; x++) {
+                u32 offset = getCanvasOffset(canvas, x, y);
+                Color &sum = accumulated_colors[offset];
+                Color &color = canvas.pixels[offset].color;
+                if (accumulated_frame_count == 1) {
+                    sum = color;
+                    continue;
+                }
+
+                Color previous_average = sum * previous_frame_weight;
+                sum += color;
+                color = sum * frame_weight;
+                worker.accumulation_change += abs(color.r - previous_average.r) +
+                                              abs(color.g - previous_average.g) +
+                                              abs(color.b - previous_average.b);
+                worker.accumulated_brightness += color.r + color.g + color.b;
+            }
+        }
+    }
+
+    // Everything that rendered images depend on, other than the bounds of geometry (which are tracked as dirty):
+    u64 hashAccumulatedState(const Canvas &canvas) const {
+        u64 hash = hashBytes(&projection, sizeof(CameraRayProjection));
+        hash = hashSettings(settings, hash);
+        hash = hashBytes(&canvas.dimensions, sizeof(Dimensions), hash);
+        hash = hashBytes(&canvas.antialias, sizeof(AntiAliasing), hash);
+        hash = hashBytes(scene.geometries, sizeof(Geometry) * scene.counts.geometries, hash);
+        if (scene.lights)    hash = hashBytes(scene.lights,    sizeof(Light)    * scene.counts.lights,    hash);
+        if (scene.materials) hash = hashBytes(scene.materials, sizeof(Material) * scene.counts.materials, hash);
+        return hash;
+    }
+
+    // The settings are hashed field by field, as they have padding between fields. The light sampling seed is left out,
+    // as it varies per frame by design (and so are the irradiance harmonics while they are not in use):
+    static u64 hashSettings(const RayTracerSettings &settings, u64 hash) {
+        hash = hashBytes(&settings.max_depth, sizeof(u8), hash);
+        hash = hashBytes(&settings.skybox_color_texture_id, sizeof(char), hash);
+        hash = hashBytes(&settings.skybox_radiance_texture_id, sizeof(char), hash);
+        hash = hashBytes(&settings.skybox_irradiance_texture_id, sizeof(char), hash);
+        hash = hashBytes(&settings.render_mode, sizeof(RenderMode), hash);
+        hash = hashBytes(settings.mip_level_colors, sizeof(settings.mip_level_colors), hash);
+        hash = hashBytes(&settings.use_irradiance_sh, sizeof(bool), hash);
+        if (settings.use_irradiance_sh)
+            hash = hashBytes(settings.irradiance_sh.coefficients, sizeof(settings.irradiance_sh.coefficients), hash);
+        hash = hashBytes(&settings.light_samples, sizeof(u8), hash);
+        return hash;
+    }
+
+    void runOnTiles(u32 tile_count, ThreadPoolTask task) {
+        if (use_threads && thread_pool.thread_count > 1)
+            thread_pool.run(tile_count, task, this);
+        else
+            for (u32 tile_index = 0; tile_index < tile_count; tile_index++)
+                task(this, tile_index, 0);
+    }
+
+    static void renderTileTask(void *renderer, u32 tile_index, u32 thread_index) {
+        RayTracingRenderer &self = *(RayTracingRenderer*)renderer;
+        self.renderTile(tile_index, self.workers[thread_index]);
+    }
+
+    static void findPixelsNeedingSamplesTask(void *renderer, u32 tile_index, u32 thread_index) {
+        RayTracingRenderer &self = *(RayTracingRenderer*)renderer;
+        i32 start_x, start_y, end_x, end_y;
+        self.getTileBounds(tile_index, start_x, start_y, end_x, end_y);
+        self.findPixelsNeedingSamples(start_x, start_y, end_x, end_y);
+    }
+
+    static void sampleTileAdaptivelyTask(void *renderer, u32 tile_index, u32 thread_index) {
+        RayTracingRenderer &self = *(RayTracingRenderer*)renderer;
+        RayTracingWorker &worker = self.workers[thread_index];
+        i32 start_x, start_y, end_x, end_y;
+        self.getTileBounds(tile_index, start_x, start_y, end_x, end_y);
+        self.sampleTileAdaptively(start_x, start_y, end_x, end_y, worker);
+        if (self.accumulate) self.accumulateTile(start_x, start_y, end_x, end_y, worker);
+    }
+
+    static void upscaleTileTask(void *renderer, u32 tile_index, u32 thread_index) {
+        RayTracingRenderer &self = *(RayTracingRenderer*)renderer;
+        i32 start_x, start_y, end_x, end_y;
+        self.getTileBounds(tile_index, start_x, start_y, end_x, end_y);
+        self.upscaleTile(start_x, start_y, end_x, end_y);
+    }
+
+    static void reconstructTileTask(void *renderer, u32 tile_index, u32 thread_index) {
+        RayTracingRenderer &self = *(RayTracingRenderer*)renderer;
+        i32 start_x, start_y, end_x, end_y;
+        self.getTileBounds(tile_index, start_x, start_y, end_x, end_y);
+        self.reconstructTile(start_x, start_y, end_x, end_y, self.workers[thread_index]);
+    }
+
+    void getTileBounds(u32 tile_index, i32 &start_x, i32 &start_y, i32 &end_x, i32 &end_y) const {
+        const Canvas &canvas = *tiles_canvas;
+        i32 width  = canvas.dimensions.width  * (canvas.antialias == SSAA ? 2 : 1);
+        i32 height = canvas.dimensions.height * (canvas.antialias == SSAA ? 2 : 1);
+        start_x = (i32)(tile_index % tile_columns) * RAY_TRACER_TILE_SIZE;
+        start_y = (i32)(tile_index / tile_columns) * RAY_TRACER_TILE_SIZE;
+        end_x = Min(start_x + RAY_TRACER_TILE_SIZE, width);
+        end_y = Min(start_y + RAY_TRACER_TILE_SIZE, height);
+    }
+
+    void renderTile(u32 tile_index, RayTracingWorker &worker) {
+        const Canvas &canvas = *tiles_canvas;
+        i32 start_x, start_y, end_x, end_y;
+        getTileBounds(tile_index, start_x, start_y, end_x, end_y);
+
+        // Occluders are only likely to be shared by shadow rays of nearby pixels:
+        worker.scene_tracer.clearOccluderCache();
+
+        if (use_wavefront && settings.render_mode == RenderMode_Beauty)
+            worker.wavefront.renderTile(settings, projection, scene, worker.scene_tracer,
+                                        use_packets ? &worker.packet_tracer : nullptr,
+                                        worker.surface, canvas, start_x, start_y, end_x, end_y, pixel_step, row_step, pixel_offset);
+        else if (sort_secondary_rays && settings.render_mode == RenderMode_Beauty)
+            renderTileSortingSecondaryRays(start_x, start_y, end_x, end_y, worker);
+        else if (use_packets)
+            renderTileInPackets(start_x, start_y, end_x, end_y, worker);
+        else
+            renderTilePixelByPixel(start_x, start_y, end_x, end_y, worker);
+
+        for (i32 y = start_y; y < end_y; y += row_step)
+            worker.sample_count += (end_x - getFirstTracedX(start_x, y) + pixel_step - 1) / pixel_step;
+
+        // Adaptive sampling accumulates the tile once it is done adding samples to it:
+        if (accumulate && !adaptive_sampling) accumulateTile(start_x, start_y, end_x, end_y, worker);
+    }
+
+    // Marks the pixels of the tile that differ from any of their neighbours in luminance or depth:
+    void findPixelsNeedingSamples(i32 start_x, i32 start_y, i32 end_x, i32 end_y) {
+        const Canvas &canvas = *tiles_canvas;
         i32 width  = canvas.dimensions.width  * (canvas.antialias == SSAA ? 2 : 1);
         i32 height = canvas.dimensions.height * (canvas.antialias == SSAA ? 2 : 1);
-        vec3 C, direction;
-        for (C.y = projection.C_start.y, ray.pixel_coords.y = 0; ray.pixel_coords.y < height;
-             C.y -= projection.sample_size, ray.pixel_coords.y++, projection.start += projection.down) {
-            for (direction = projection.start, C.x = projection.C_start.x, ray.pixel_coords.x = 0;  ray.pixel_coords.x < width;
-                 direction += projection.right, C.x += projection.sample_size, ray.pixel_coords.x++) {
-                hit.scaling_factor = 1.0f / sqrtf(C.squaredLength() + projection.squared_distance_to_projection_plane);
-                renderPixel(settings, projection, scene, scene_tracer, surface, ray, hit, direction, color, depth);
-                canvas.setPixel(ray.pixel_coords.x, ray.pixel_coords.y, color, -1, depth);
+        i32 neighbour_offsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+        for (i32 y = start_y; y < end_y; y++) {
+            for (i32 x = start_x; x < end_x; x++) {
+                u32 offset = getCanvasOffset(canvas, x, y);
+                f32 luminance = canvas.pixels[offset].color.luminance();
+                f32 depth = canvas.depths[canvas.antialias == MSAA ? offset * 4 : offset];
+                bool needs_samples = false;
+                for (auto &neighbour_offset : neighbour_offsets) {
+                    i32 neighbour_x = x + neighbour_offset[0];
+                    i32 neighbour_y = y + neighbour_offset[1];
+                    if (neighbour_x < 0 || neighbour_x == width ||
+                        neighbour_y < 0 || neighbour_y == height)
+                        continue;
+
+                    u32 neighbour = getCanvasOffset(canvas, neighbour_x, neighbour_y);
+                    f32 neighbour_depth = canvas.depths[canvas.antialias == MSAA ? neighbour * 4 : neighbour];
+                    if (abs(canvas.pixels[neighbour].color.luminance() - luminance) >= RAY_TRACER_ADAPTIVE_SAMPLING_MIN_CONTRAST ||
+                        (depth != neighbour_depth && Max(depth, neighbour_depth) >= Min(depth, neighbour_depth) * RAY_TRACER_ADAPTIVE_SAMPLING_MIN_DEPTH_RATIO)) {
+                        needs_samples = true;
+                        break;
+                    }
+                }
+                pixel_needs_samples[offset] = needs_samples;
             }
         }
     }
+
+    // Adds samples to the pixels of the tile that differ from their neighbours, averaging them with the center samples:
+    void sampleTileAdaptively(i32 start_x, i32 start_y, i32 end_x, i32 end_y, RayTracingWorker &worker) {
+        const Canvas &canvas = *tiles_canvas;
+        Ray &ray = worker.ray;
+        RayHit &hit = worker.hit;
+        for (ray.pixel_coords.y = start_y; ray.pixel_coords.y < end_y; ray.pixel_coords.y++) {
+            for (ray.pixel_coords.x = start_x; ray.pixel_coords.x < end_x; ray.pixel_coords.x++) {
+                u32 offset = getCanvasOffset(canvas, ray.pixel_coords.x, ray.pixel_coords.y);
+                if (!pixel_needs_samples[offset]) continue;
+
+                vec3 center_direction = projection.getRayDirectionAt(ray.pixel_coords.x, ray.pixel_coords.y);
+                Pixel &pixel = canvas.pixels[offset];
+
+                // Running mean and variance of the luminance of the samples (Welford's algorithm):
+                Color sum = pixel.color;
+                f32 mean = pixel.color.luminance(), squared_deviations = 0, luminance, delta, f32_samples;
+                u32 samples = 1;
+                while (samples < adaptive_sampling_max_samples) {
+                    hit.scaling_factor = projection.getScalingFactorAt(ray.pixel_coords.x, ray.pixel_coords.y);
+                    vec3 direction = center_direction +
+                        projection.right * (getHaltonValue(samples, 2) - 0.5f) +
+                        projection.down  * (getHaltonValue(samples, 3) - 0.5f);
+                    renderPixel(settings, projection, scene, worker.scene_tracer, worker.surface, ray, hit,
+                                direction, worker.color, worker.depth);
+
+                    // Matching how the canvas stores colors:
+                    worker.color = worker.color.clamped();
+                    worker.color *= worker.color;
+                    sum += worker.color;
+                    samples++;
+
+                    f32_samples = (f32)samples;
+                    luminance = worker.color.luminance();
+                    delta = luminance - mean;
+                    mean += delta / f32_samples;
+                    squared_deviations += delta * (luminance - mean);
+                    if (samples >= RAY_TRACER_ADAPTIVE_SAMPLING_MIN_SAMPLES &&
+                        squared_deviations / ((f32_samples - 1.0f) * f32_samples) <=
+                        adaptive_sampling_target_error * adaptive_sampling_target_error * Max(mean * mean, EPS))
+                        break;
+                }
+
+                pixel.color = sum / (f32)samples;
+                worker.sample_count += samples - 1;
+            }
+        }
+    }
+
+    static INLINE u32 getCanvasOffset(const Canvas &canvas, i32 x, i32 y) {
+        return canvas.antialias == SSAA ? ((canvas.dimensions.stride * (y >> 1) + (x >> 1)) * 4 + (2 * (y & 1)) + (x & 1)) : (canvas.dimensions.stride * y + x);
+    }
+
+    // The first pixel of the tile's row that gets traced (when checkerboarding, every other pixel of a row is skipped).
+    // At a lower resolution, tiles start at multiples of the pixel step, so that is the first pixel of the tile's row:
+    INLINE i32 getFirstTracedX(i32 start_x, i32 y) const {
+        return start_x + (start_x + y + pixel_offset) % pixel_step;
+    }
+
+    void renderTilePixelByPixel(i32 start_x, i32 start_y, i32 end_x, i32 end_y, RayTracingWorker &worker) {
+        const Canvas &canvas = *tiles_canvas;
+        Ray &ray = worker.ray;
+        RayHit &hit = worker.hit;
+        for (ray.pixel_coords.y = start_y; ray.pixel_coords.y < end_y; ray.pixel_coords.y += row_step) {
+            for (ray.pixel_coords.x = getFirstTracedX(start_x, ray.pixel_coords.y); ray.pixel_coords.x < end_x; ray.pixel_coords.x += pixel_step) {
+                hit.scaling_factor = projection.getScalingFactorAt(ray.pixel_coords.x, ray.pixel_coords.y);
+
+                renderPixel(settings, projection, scene, worker.scene_tracer, worker.surface, ray, hit,
+                            projection.getRayDirectionAt(ray.pixel_coords.x, ray.pixel_coords.y),
+                            worker.color, worker.depth);
+                canvas.setPixel(ray.pixel_coords.x, ray.pixel_coords.y, worker.color, -1, worker.depth);
+            }
+        }
+    }
+
+    // Primary rays of horizontally neighbouring pixels are traced together as a packet,
+    // then each pixel continues shading (and tracing secondary rays) on its own:
+    void renderTileInPackets(i32 start_x, i32 start_y, i32 end_x, i32 end_y, RayTracingWorker &worker) {
+        const Canvas &canvas = *tiles_canvas;
+        u32 ray_count;
+        for (i32 y = start_y; y < end_y; y += row_step) {
+            for (i32 x = getFirstTracedX(start_x, y); x < end_x; x += RAY_PACKET_SIZE * pixel_step) {
+                ray_count = (u32)Min(RAY_PACKET_SIZE, (end_x - x + pixel_step - 1) / pixel_step);
+                for (u32 i = 0; i < ray_count; i++) {
+                    Ray &ray = worker.rays[i];
+                    ray.pixel_coords.x = x + (i32)i * pixel_step;
+                    ray.pixel_coords.y = y;
+                    ray.depth = 1;
+                    worker.hits[i].scaling_factor = projection.getScalingFactorAt(ray.pixel_coords.x, ray.pixel_coords.y);
+                    ray.reset(projection.camera_position, projection.getRayDirectionAt(ray.pixel_coords.x, y).normalized());
+                }
+                worker.packet_tracer.trace(worker.rays, worker.hits, worker.geometries, ray_count, scene);
+
+                for (u32 i = 0; i < ray_count; i++) {
+                    Ray &ray = worker.rays[i];
+                    worker.surface.geometry = worker.geometries[i];
+                    renderPixel(settings, projection, scene, worker.scene_tracer, worker.surface, ray, worker.hits[i],
+                                ray.direction, worker.color, worker.depth, true);
+                    canvas.setPixel(ray.pixel_coords.x, ray.pixel_coords.y, worker.color, -1, worker.depth);
+                }
+            }
+        }
+    }
+
+    // Traces the primary rays of the tile in pixel order (as packets when enabled), and then its secondary rays in waves
+    // of one bounce each: Every wave is sorted by the rays' sort keys first, so that similar rays get traced together:
+    void renderTileSortingSecondaryRays(i32 start_x, i32 start_y, i32 end_x, i32 end_y, RayTracingWorker &worker) {
+        u32 ray_count, path_count = 0;
+        for (i32 y = start_y; y < end_y; y += row_step) {
+            for (i32 x = getFirstTracedX(start_x, y); x < end_x; x += RAY_PACKET_SIZE * pixel_step) {
+                ray_count = (u32)Min(RAY_PACKET_SIZE, (end_x - x + pixel_step - 1) / pixel_step);
+                for (u32 i = 0; i < ray_count; i++) {
+                    RayTracerPath &path = worker.paths[path_count + i];
+                    Ray &ray = path.ray;
+                    ray.pixel_coords.x = x + (i32)i * pixel_step;
+                    ray.pixel_coords.y = y;
+                    ray.depth = 1;
+                    path.hit.scaling_factor = projection.getScalingFactorAt(ray.pixel_coords.x, ray.pixel_coords.y);
+                    ray.reset(projection.camera_position, projection.getRayDirectionAt(ray.pixel_coords.x, y).normalized());
+                    path.color = Black;
+                    path.throughput = 1.0f;
+                    path.depth = INFINITY;
+                    path.depth_left = settings.max_depth;
+                }
+
+                if (use_packets) {
+                    for (u32 i = 0; i < ray_count; i++) {
+                        worker.rays[i] = worker.paths[path_count + i].ray;
+                        worker.hits[i] = worker.paths[path_count + i].hit;
+                    }
+                    worker.packet_tracer.trace(worker.rays, worker.hits, worker.geometries, ray_count, scene);
+                    for (u32 i = 0; i < ray_count; i++) {
+                        worker.paths[path_count + i].ray = worker.rays[i];
+                        worker.paths[path_count + i].hit = worker.hits[i];
+                    }
+                } else
+                    for (u32 i = 0; i < ray_count; i++) {
+                        RayTracerPath &path = worker.paths[path_count + i];
+                        worker.geometries[i] = worker.scene_tracer.trace(path.ray, path.hit, scene);
+                    }
+
+                for (u32 i = 0; i < ray_count; i++) {
+                    worker.surface.geometry = worker.geometries[i];
+                    shadePath(worker.paths[path_count + i], worker);
+                }
+                path_count += ray_count;
+            }
+        }
+
+        u32 tile_path_count = path_count;
+        while (true) {
+            // Gather the paths that continue (in pixel order) along with the sort keys of their next rays:
+            RayQueue &queue = worker.path_queue;
+            queue.count = 0;
+            for (u32 path_id = 0; path_id < tile_path_count; path_id++)
+                if (worker.paths[path_id].depth_left)
+                    queue.push(path_id, worker.paths[path_id].sort_key);
+            if (!queue.count) break;
+
+            worker.sorted_ray_count += queue.count;
+            worker.unsorted_key_changes += queue.countKeyChanges();
+            queue.sort();
+            worker.sorted_key_changes += queue.countKeyChanges();
+
+            for (u32 i = 0; i < queue.count; i++) {
+                RayTracerPath &path = worker.paths[queue.ids[i]];
+                worker.surface.geometry = worker.scene_tracer.trace(path.ray, path.hit, scene);
+                shadePath(path, worker);
+            }
+        }
+    }
+
+    // Shades the bounce that the path's ray was just traced for. Paths that continue get the sort key of their next ray,
+    // while paths that end get their pixel written:
+    void shadePath(RayTracerPath &path, RayTracingWorker &worker) {
+        worker.scene_tracer.aux_ray.depth = path.ray.depth;
+        if (shadeBounce(settings, projection, scene, worker.scene_tracer, worker.surface, path.ray, path.hit,
+                        path.color, path.depth, path.throughput, path.depth_left)) {
+            path.sort_key = getSecondaryRaySortKey(path.ray, worker.surface.geometry->material_id, scene.bvh.nodes[0].aabb);
+            return;
+        }
+
+        path.color.applyToneMapping();
+        tiles_canvas->setPixel(path.ray.pixel_coords.x, path.ray.pixel_coords.y, path.color, -1, path.depth);
+    }
 };
\ No newline at end of file
@@ -16,6 +16,8 @@ SceneData t_scene;
 CanvasData t_canvas;
 BVHNode *d_mesh_bvh_nodes;
 Triangle *d_triangles;
+TriangleBlock *d_triangle_blocks;
+u32 *d_triangle_block_ids;
 TextureMip *d_texture_mips;
 TexelQuad *d_texel_quads;
 
@@ -35,9 +37,7 @@ __global__ void d_render(const RayTracerSettings settings, const CameraRayProjec
 
     ray.pixel_coords.x = (i32)(i % ((u32)d_canvas.dimensions.width * s));
     ray.pixel_coords.y = (i32)(i / ((u32)d_canvas.dimensions.width * s));
-    hit.scaling_factor = 1.0f / sqrtf(projection.squared_distance_to_projection_plane +
-        vec2{ray.pixel_coords.x,
-            -ray.pixel_coords.y}.scaleAdd(projection.sample_size,projection.C_start).squaredLength());
+    hit.scaling_factor = projection.getScalingFactorAt(ray.pixel_coords.x, ray.pixel_coords.y);
 
     renderPixel(settings, projection, *((Scene*)(&d_scene)), scene_tracer, surface, ray, hit,
                 projection.getRayDirectionAt(ray.pixel_coords.x, ray.pixel_coords.y), color, depth);
@@ -77,14 +77,48 @@ void uploadSceneBVH(const Scene &scene)   {
     if (scene.counts.geometries) uploadN(scene.bvh_leaf_geometry_indices, t_scene.bvh_leaf_geometry_indices, scene.counts.geometries)
 }
 
+// The list of area lights changes along with geometry and materials, and its length lives in the scene's constant memory:
+void uploadEmissiveQuads(const Scene &scene) {
+    if (scene.emissive_quad_count) uploadN(scene.emissive_quad_ids, t_scene.emissive_quad_ids, scene.emissive_quad_count)
+    if (scene.emissive_quad_count != t_scene.emissive_quad_count || scene.flags != t_scene.flags) {
+        t_scene.emissive_quad_count = scene.emissive_quad_count;
+        t_scene.flags = scene.flags;
+        uploadConstant(&t_scene, d_scene)
+    }
+}
+
+// The light BVH gets rebuilt whenever lights change, and its size lives in the scene's constant memory:
+void uploadLightBVH(const Scene &scene) {
+    if (scene.light_bvh.node_count) {
+        uploadN(scene.light_bvh.nodes,              t_scene.light_bvh.nodes,              scene.light_bvh.node_count)
+        uploadN(scene.light_bvh_node_powers,        t_scene.light_bvh_node_powers,        scene.light_bvh.node_count)
+        uploadN(scene.light_bvh_leaf_light_indices, t_scene.light_bvh_leaf_light_indices, scene.point_light_count)
+    }
+    if (scene.directional_light_count)
+        uploadN(scene.directional_light_ids, t_scene.directional_light_ids, scene.directional_light_count)
+
+    if (scene.light_bvh.node_count    != t_scene.light_bvh.node_count ||
+        scene.point_light_count       != t_scene.point_light_count ||
+        scene.directional_light_count != t_scene.directional_light_count) {
+        t_scene.light_bvh.node_count = scene.light_bvh.node_count;
+        t_scene.light_bvh.height = scene.light_bvh.height;
+        t_scene.point_light_count = scene.point_light_count;
+        t_scene.directional_light_count = scene.directional_light_count;
+        uploadConstant(&t_scene, d_scene)
+    }
+}
+
 void initDataOnGPU(const Scene &scene) {
     t_scene = scene;
+    t_scene.wide_bvh = WideBVH{}; // The GPU traverses the binary BVHs (with fixed-size stacks)
     gpuErrchk(cudaMalloc(&t_canvas.pixels, sizeof(Pixel) * MAX_WINDOW_SIZE * 4))
     gpuErrchk(cudaMalloc(&t_canvas.depths, sizeof(f32) * MAX_WINDOW_SIZE * 4))
     gpuErrchk(cudaMalloc(&t_scene.bvh_leaf_geometry_indices, sizeof(u32) * scene.counts.geometries))
     gpuErrchk(cudaMalloc(&t_scene.bvh.nodes,sizeof(BVHNode)  * scene.counts.geometries * 2))
+    gpuErrchk(cudaMalloc(&t_scene.emissive_quad_ids, sizeof(u32) * scene.counts.geometries))
 
     uploadSceneBVH(scene);
+    uploadEmissiveQuads(scene);
 
     u32 total_triangles = 0;
 
@@ -100,7 +134,12 @@ void initDataOnGPU(const Scene &scene) {
 
     if (scene.counts.lights) {
         gpuErrchk(cudaMalloc(&t_scene.lights,    sizeof(Light)    * scene.counts.lights))
+        gpuErrchk(cudaMalloc(&t_scene.light_bvh.nodes,              sizeof(BVHNode) * scene.counts.lights * 2))
+        gpuErrchk(cudaMalloc(&t_scene.light_bvh_node_powers,        sizeof(f32)     * scene.counts.lights * 2))
+        gpuErrchk(cudaMalloc(&t_scene.light_bvh_leaf_light_indices, sizeof(u32)     * scene.counts.lights))
+        gpuErrchk(cudaMalloc(&t_scene.directional_light_ids,        sizeof(u32)     * scene.counts.lights))
         uploadLights(scene);
+        uploadLightBVH(scene);
     }
 
     if (scene.counts.cameras) {
@@ -110,32 +149,48 @@ void initDataOnGPU(const Scene &scene) {
 
     if (scene.counts.meshes) {
         u32 total_bvh_nodes = 0;
+        u32 total_triangle_blocks = 0;
         for (u32 i = 0; i < scene.counts.meshes; i++) {
             total_triangles += scene.meshes[i].triangle_count;
             total_bvh_nodes += scene.meshes[i].bvh.node_count;
+            total_triangle_blocks += scene.meshes[i].triangle_block_count;
         }
 
         gpuErrchk(cudaMalloc(&t_scene.meshes,   sizeof(Mesh)     * scene.counts.meshes))
         gpuErrchk(cudaMalloc(&d_triangles,      sizeof(Triangle) * total_triangles))
         gpuErrchk(cudaMalloc(&d_mesh_bvh_nodes, sizeof(BVHNode)  * total_bvh_nodes))
+        gpuErrchk(cudaMalloc(&d_triangle_blocks, sizeof(TriangleBlock) * total_triangle_blocks))
+        gpuErrchk(cudaMalloc(&d_triangle_block_ids, sizeof(u32) * total_triangles))
 
         Mesh d_mesh;
         Mesh *mesh = scene.meshes;
         Mesh *d_mehses = t_scene.meshes;
         Triangle *triangles = d_triangles;
+        TriangleBlock *triangle_blocks = d_triangle_blocks;
+        u32 *triangle_block_ids = d_triangle_block_ids;
         BVHNode *nodes = d_mesh_bvh_nodes;
         for (u32 i = 0; i < scene.counts.meshes; i++, mesh++) {
+            u32 triangle_block_count = mesh->triangle_blocks ? mesh->triangle_block_count : 0;
             uploadN(mesh->bvh.nodes, nodes, mesh->bvh.node_count)
             uploadN(mesh->triangles, triangles, mesh->triangle_count)
+            if (triangle_block_count) {
+                uploadN(mesh->triangle_blocks, triangle_blocks, triangle_block_count)
+                uploadN(mesh->triangle_block_ids, triangle_block_ids, mesh->triangle_count)
+            }
 
             d_mesh = *mesh;
             d_mesh.triangles = triangles;
+            d_mesh.triangle_blocks = triangle_block_count ? triangle_blocks : nullptr;
+            d_mesh.triangle_block_ids = triangle_block_count ? triangle_block_ids : nullptr;
+            d_mesh.wide_bvh = WideBVH{};
             d_mesh.bvh.nodes = nodes;
             uploadN(&d_mesh, d_mehses, 1)
             d_mehses++;
 
             nodes     += mesh->bvh.node_count;
             triangles += mesh->triangle_count;
+            triangle_blocks += triangle_block_count;
+            triangle_block_ids += mesh->triangle_count;
         }
     }
 
@@ -34,28 +34,162 @@ struct SurfaceShader {
     Geometry *geometry = nullptr;
     Material *material = nullptr;
     Color F, albedo_from_map, Fs, Fd;
-    Ray shadow_ray;
+    Ray shadow_ray, light_ray;
     RayHit shadow_hit;
+    ShadowRays shadow_rays;
     vec3 P, N, V, L, R, RF, H, emissive_quad_vertices[4];
     f32 Ld, Ld2, NdotL, NdotV, NdotH, HdotL, IOR;
     bool refracted = false;
 
-    INLINE_XPU bool inShadow(const Scene &scene, SceneTracer &scene_tracer, const vec3 &origin, const vec3 &direction, float max_distance = INFINITY) {
+    INLINE_XPU bool inShadow(const Scene &scene, SceneTracer &scene_tracer, const vec3 &origin, const vec3 &direction, float max_distance = INFINITY, u32 light_index = 0) {
         shadow_ray.origin = origin;
         shadow_ray.direction = direction;
-        return scene_tracer.trace(shadow_ray, shadow_hit, scene, true, max_distance);
+        return scene_tracer.isOccluded(shadow_ray, scene, max_distance, light_index);
     }
 
     INLINE_XPU void shadeFromLight(const Light &light, const Scene &scene, SceneTracer &scene_tracer, Color &color) {
         if (isFacingLight(light) && (
                 !(light.flags & Light_IsShadowing) ||
-                !inShadow(scene, scene_tracer, P, L, Ld)
+                !inShadow(scene, scene_tracer, P, L, Ld, (u32)(&light - scene.lights))
             )
-        ) {
-            // color += fr(p, L, V) * Li(p, L) * cos(w)
-            radianceFraction();
-            color = (Fs + Fd).mulAdd(light.color * (NdotL * light.intensity / Ld2), color);
+        )
+            shadeFromVisibleLight(light, color);
+    }
+
+    // Shades from all the point / directional lights, tracing the shadow rays towards (up to SCENE_TRACER_SHADOW_RAYS)
+    // lights together first, rather than walking the BVH once per light:
+    INLINE_XPU void shadeFromLights(const Scene &scene, SceneTracer &scene_tracer, Color &color) {
+        u32 first_light = 0, last_light, occluded, ray_index;
+        while (first_light < scene.counts.lights) {
+            last_light = Min(first_light + SCENE_TRACER_SHADOW_RAYS, scene.counts.lights);
+
+            shadow_rays.count = 0;
+            for (u32 i = first_light; i < last_light; i++)
+                if ((scene.lights[i].flags & Light_IsShadowing) && isFacingLight(scene.lights[i]))
+                    shadow_rays.add(P, L, Ld, i);
+
+            occluded = shadow_rays.count ? scene_tracer.findOccludedRays(shadow_rays, scene) : 0;
+
+            ray_index = 0;
+            for (u32 i = first_light; i < last_light; i++) {
+                const Light &light = scene.lights[i];
+                if (!isFacingLight(light) || ((light.flags & Light_IsShadowing) && (occluded & (1u << ray_index++))))
+                    continue;
+
+                shadeFromVisibleLight(light, color);
+            }
+
+            first_light = last_light;
+        }
+    }
+
+    // An upper bound on how much of the given power, emitted from within the given bounds, can reach the surface
+    // (for picking lights by their importance): The power over the squared distance to the center of the bounds,
+    // times the cosine of the smallest angle between the normal and the bounds (point lights emit in all directions):
+    INLINE_XPU f32 getLightImportance(const AABB &bounds, f32 power) const {
+        vec3 to_center{(bounds.min + bounds.max) * 0.5f - P};
+        f32 squared_radius = (bounds.max - bounds.min).squaredLength() * 0.25f;
+        f32 squared_distance = to_center.squaredLength();
+        if (squared_distance <= squared_radius) // The surface is within the bounds
+            return power / Max(squared_radius, EPS);
+
+        f32 cos_to_center = N.dot(to_center) / sqrtf(squared_distance);
+        f32 sin2_of_bounds = squared_radius / squared_distance;
+        f32 cos_of_bounds = sqrtf(1.0f - sin2_of_bounds);
+        if (cos_to_center >= cos_of_bounds) // The normal points into the bounds
+            return power / squared_distance;
+
+        // Cosine of the angle to the center less the angle of the bounds:
+        f32 cos_bound = cos_to_center * cos_of_bounds + sqrtf(Max(0.0f, 1.0f - cos_to_center * cos_to_center) * sin2_of_bounds);
+        return cos_bound > 0.0f ? power * cos_bound / squared_distance : 0.0f;
+    }
+
+    // Picks a point light at random by its importance (see getLightImportance()), walking down the scene's light BVH
+    // choosing between the children of each node in proportion to theirs. Returns the light's index (or -1 when no
+    // light can reach the surface) and outputs the probability of it having been picked:
+    INLINE_XPU i32 pickLight(const Scene &scene, f32 random_value, f32 &probability) const {
+        const BVHNode *nodes = scene.light_bvh.nodes;
+        const f32 *powers = scene.light_bvh_node_powers;
+        u32 node_id = 0, child_id;
+        f32 left, right, left_probability;
+        probability = 1.0f;
+
+        while (!nodes[node_id].leaf_count) {
+            child_id = nodes[node_id].first_index;
+            left  = getLightImportance(nodes[child_id    ].aabb, powers[child_id    ]);
+            right = getLightImportance(nodes[child_id + 1].aabb, powers[child_id + 1]);
+            if (left + right <= 0.0f)
+                return -1;
+
+            // Reuse the random value for the next choice, by rescaling the part of it that this choice was made on:
+            left_probability = left / (left + right);
+            if (random_value < left_probability) {
+                node_id = child_id;
+                probability *= left_probability;
+                random_value /= left_probability;
+            } else {
+                node_id = child_id + 1;
+                probability *= 1.0f - left_probability;
+                random_value = (random_value - left_probability) / (1.0f - left_probability);
+            }
+            random_value = Min(random_value, 0.99999994f); // Below 1, despite rounding
+        }
+
+        // Leaves are built to hold a single light, so the rare leaf with more (that could not be split) is picked from uniformly:
+        const BVHNode &leaf = nodes[node_id];
+        u32 light_offset = Min((u32)(random_value * (f32)leaf.leaf_count), (u32)leaf.leaf_count - 1);
+        probability /= (f32)leaf.leaf_count;
+        return (i32)scene.light_bvh_leaf_light_indices[leaf.first_index + light_offset];
+    }
+
+    // Shades from a number of point lights picked at random (see pickLight()), seeded by the surface position and the
+    // given seed (to vary per frame), weighing each by how unlikely it was to be picked. This is noisy but costs the same
+    // however many point lights there are, converging to shading from all of them as frames accumulate.
+    // Directional lights are all shaded from:
+    INLINE_XPU void shadeFromSampledLights(const Scene &scene, SceneTracer &scene_tracer, u32 sample_count, u32 seed, Color &color) {
+        f32 light_weights[SCENE_TRACER_SHADOW_RAYS], probability;
+        u32 light_ids[SCENE_TRACER_SHADOW_RAYS], light_count = 0, occluded, ray_index = 0;
+        i32 light_index;
+
+        union { f32 value; unsigned int bits; } x{P.x}, y{P.y}, z{P.z};
+        seed = hashBits(x.bits ^ hashBits(y.bits ^ hashBits(z.bits ^ hashBits(seed))));
+
+        sample_count = Min(sample_count, SCENE_TRACER_SHADOW_RAYS);
+        shadow_rays.count = 0;
+        for (u32 s = 0; s < sample_count; s++) {
+            light_index = pickLight(scene, getRandomValue(hashBits(seed + s)), probability);
+            if (light_index < 0 || !isFacingLight(scene.lights[light_index]))
+                continue;
+
+            light_ids[light_count] = (u32)light_index;
+            light_weights[light_count++] = 1.0f / ((f32)sample_count * probability);
+            if (scene.lights[light_index].flags & Light_IsShadowing)
+                shadow_rays.add(P, L, Ld, (u32)light_index);
+        }
+
+        occluded = shadow_rays.count ? scene_tracer.findOccludedRays(shadow_rays, scene) : 0;
+
+        Color light_color;
+        for (u32 i = 0; i < light_count; i++) {
+            const Light &light = scene.lights[light_ids[i]];
+            isFacingLight(light);
+            if ((light.flags & Light_IsShadowing) && (occluded & (1u << ray_index++)))
+                continue;
+
+            light_color = Black;
+            shadeFromVisibleLight(light, light_color);
+            color = light_color.scaleAdd(light_weights[i], color);
         }
+
+        for (u32 i = 0; i < scene.directional_light_count; i++)
+            shadeFromLight(scene.lights[scene.directional_light_ids[i]], scene, scene_tracer, color);
+    }
+
+    // Shades from a light that the surface is known to be facing (see isFacingLight()) and to not be in the shadow of:
+    INLINE_XPU void shadeFromVisibleLight(const Light &light, Color &color) {
+        // color += fr(p, L, V) * Li(p, L) * cos(w)
+        radianceFraction();
+        color = (Fs + Fd).mulAdd(light.color * (NdotL * light.intensity / Ld2), color);
     }
 
     INLINE_XPU void prepareForShading(Ray &ray, RayHit &hit, Material *materials, const Texture *textures) {
@@ -185,18 +319,67 @@ struct SurfaceShader {
         };
     }
 
-    INLINE_XPU bool shadeFromEmissiveQuads(const Scene &scene, Color &color) {
+    // Estimates how much of an area light is left unshaded by the spheres and quads that the ray towards it passes through
+    // (in between or not). Only the geometries whose bounds the ray enters are considered, by walking the scene's BVH:
+    INLINE_XPU f32 getAreaLightShading(const Scene &scene, SceneTracer &scene_tracer, const Geometry *emissive_quad,
+                                       const vec3 &Ro, f32 emission_intensity) {
+        f32 shaded_light = 1.0f, near_distance, far_distance, sphere_squared_distance_To_center;
+        u32 *stack = scene_tracer.stack;
+        u32 node_id = 0, top = 0;
+
+        light_ray.reset(Ro, L);
+        while (true) {
+            const BVHNode &node = scene.bvh.nodes[node_id];
+            if (light_ray.hitsAABB(node.aabb, near_distance, far_distance)) {
+                if (!node.leaf_count) {
+                    stack[top++] = node.first_index + 1;
+                    node_id = node.first_index;
+                    continue;
+                }
+
+                for (u32 i = 0; i < node.leaf_count; i++) {
+                    const Geometry *shadowing_geo = scene.geometries + scene.bvh_leaf_geometry_indices[node.first_index + i];
+                    if (shadowing_geo == emissive_quad || shadowing_geo == geometry ||
+                        (shadowing_geo->type != GeometryType_Sphere && shadowing_geo->type != GeometryType_Quad))
+                        continue;
+
+                    shadow_ray.localize(Ro, L, shadowing_geo->transform);
+                    shadow_hit.distance = INFINITY;
+                    shadow_ray.direction = shadow_ray.direction.normalized();
+                    f32 d = 1.0f;
+                    if (shadowing_geo->type == GeometryType_Sphere) {
+                        if (shadow_ray.hitsDefaultSphere(shadow_hit, shadowing_geo->flags & GEOMETRY_IS_TRANSPARENT, &sphere_squared_distance_To_center)) {
+                            d -= (1.0f - sqrtf(sphere_squared_distance_To_center)) /
+                                 (shadow_hit.distance * emission_intensity * 3.0f);
+                        }
+                    } else if (shadow_ray.hitsDefaultQuad(shadow_hit, shadowing_geo->flags & GEOMETRY_IS_TRANSPARENT))
+                        d -= 3.0f * (1.0f - Max(abs(shadow_hit.position.x), abs(shadow_hit.position.z))) /
+                             (shadow_hit.distance * emission_intensity);
+
+                    shaded_light = Min(shaded_light, d);
+                    if (shaded_light <= 0.0f)
+                        return shaded_light;
+                }
+            }
+
+            if (!top)
+                return shaded_light;
+
+            node_id = stack[--top];
+        }
+    }
+
+    INLINE_XPU bool shadeFromEmissiveQuads(const Scene &scene, SceneTracer &scene_tracer, Color &color) {
         bool found = false;
 
         vec3 Ro;
-        f32 Ld_rcp, sphere_squared_distance_To_center;
+        f32 Ld_rcp;
 
         Transform *xform;
-        Geometry *shadowing_geo, *emissive_quad = scene.geometries;
-        for (u32 i = 0; i < scene.counts.geometries; i++, emissive_quad++) {
-            if (emissive_quad == geometry ||
-                emissive_quad->type != GeometryType_Quad ||
-                !(scene.materials[emissive_quad->material_id].isEmissive()))
+        Geometry *emissive_quad;
+        for (u32 q = 0; q < scene.emissive_quad_count; q++) {
+            emissive_quad = scene.geometries + scene.emissive_quad_ids[q];
+            if (emissive_quad == geometry)
                 continue;
 
             xform = &emissive_quad->transform;
@@ -229,30 +412,7 @@ struct SurfaceShader {
                 if (skip)
                     continue;
 
-                f32 shaded_light = 1.0f;
-                shadowing_geo = scene.geometries;
-                for (u32 s = 0; s < scene.counts.geometries; s++, shadowing_geo++) {
-                    if (shadowing_geo == emissive_quad||
-                        shadowing_geo == geometry)
-                        continue;
-
-                    shadow_ray.localize(Ro, L, shadowing_geo->transform);
-                    shadow_hit.distance = INFINITY;
-                    shadow_ray.direction = shadow_ray.direction.normalized();
-                    f32 d = 1.0f;
-                    if (shadowing_geo->type == GeometryType_Sphere) {
-                        if (shadow_ray.hitsDefaultSphere(shadow_hit, shadowing_geo->flags & GEOMETRY_IS_TRANSPARENT, &sphere_squared_distance_To_center)) {
-                            d -= (1.0f - sqrtf(sphere_squared_distance_To_center)) /
-                                 (shadow_hit.distance * emission_intensity * 3.0f);
-                        }
-                    } else if (shadowing_geo->type == GeometryType_Quad) {
-                        if (shadow_ray.hitsDefaultQuad(shadow_hit, shadowing_geo->flags & GEOMETRY_IS_TRANSPARENT))
-                            d -= 3.0f * (1.0f - Max(abs(shadow_hit.position.x), abs(shadow_hit.position.z))) /
-                                (shadow_hit.distance * emission_intensity);
-                    }
-                    shaded_light = Min(shaded_light, d);
-                }
-
+                f32 shaded_light = getAreaLightShading(scene, scene_tracer, emissive_quad, Ro, emission_intensity);
                 if (shaded_light > 0.0f) {
                     radianceFraction();
                     color = (Fd + Fs).mulAdd(scene.materials[emissive_quad->material_id].emission * (emission_intensity * shaded_light * 7.0f), color);
@@ -0,0 +1,330 @@
+#pragma once
+
+#include "./ray_tracer.h"
+#include "../scene/packet_tracer.h"
+
+#define RAY_QUEUE_SORT_KEY_RADIX_BITS 10 // Sort keys have 2 radix digits
+
+// The ids of paths (or rays) along with keys to sort them by:
+struct RayQueue {
+    u32 *ids, *keys, *sorted_ids, *sorted_keys;
+    u32 count = 0;
+
+    static u64 getSizeInBytes(u32 capacity) {
+        return sizeof(u32) * 4 * capacity;
+    }
+
+    RayQueue(u32 capacity, memory::MonotonicAllocator *memory_allocator) {
+        ids         = (u32*)memory_allocator->allocate(sizeof(u32) * capacity);
+        keys        = (u32*)memory_allocator->allocate(sizeof(u32) * capacity);
+        sorted_ids  = (u32*)memory_allocator->allocate(sizeof(u32) * capacity);
+        sorted_keys = (u32*)memory_allocator->allocate(sizeof(u32) * capacity);
+    }
+
+    INLINE void push(u32 id, u32 key) {
+        ids[count] = id;
+        keys[count++] = key;
+    }
+
+    // Sorts the ids by their keys (LSD radix sort, keeping the order of equal keys):
+    void sort() {
+        u32 digit_counts[1 << RAY_QUEUE_SORT_KEY_RADIX_BITS];
+        for (u32 shift = 0; shift < 2 * RAY_QUEUE_SORT_KEY_RADIX_BITS; shift += RAY_QUEUE_SORT_KEY_RADIX_BITS) {
+            for (u32 &digit_count : digit_counts) digit_count = 0;
+            for (u32 i = 0; i < count; i++) digit_counts[(keys[i] >> shift) & ((1 << RAY_QUEUE_SORT_KEY_RADIX_BITS) - 1)]++;
+
+            u32 offset = 0;
+            for (u32 &digit_count : digit_counts) {
+                u32 current_count = digit_count;
+                digit_count = offset;
+                offset += current_count;
+            }
+            for (u32 i = 0; i < count; i++) {
+                u32 &position = digit_counts[(keys[i] >> shift) & ((1 << RAY_QUEUE_SORT_KEY_RADIX_BITS) - 1)];
+                sorted_ids[position] = ids[i];
+                sorted_keys[position] = keys[i];
+                position++;
+            }
+
+            u32 *swapped_ids = ids;
+            u32 *swapped_keys = keys;
+            ids = sorted_ids;
+            keys = sorted_keys;
+            sorted_ids = swapped_ids;
+            sorted_keys = swapped_keys;
+        }
+    }
+
+    // How many of the ids have a different key than the one before them:
+    u32 countKeyChanges() const {
+        u32 changes = 0;
+        for (u32 i = 1; i < count; i++) changes += keys[i] != keys[i - 1];
+        return changes;
+    }
+};
+
+enum WavefrontHitType {
+    WavefrontHitType_Miss,
+    WavefrontHitType_Emitter,
+    WavefrontHitType_Surface
+};
+
+// A pixel's path through the scene, along with the shading inputs of its current surface (carried between stages):
+struct WavefrontPath {
+    Ray ray;
+    RayHit hit;
+    Geometry *geometry;
+    Color color, throughput, direct_light, albedo_from_map;
+    vec3 R, RF;
+    f32 depth, NdotV;
+    u32 depth_left;
+    WavefrontHitType hit_type;
+    bool refracted;
+};
+
+struct WavefrontShadowRay {
+    vec3 origin, direction;
+    f32 max_distance;
+    u32 path_id;
+    bool occluded;
+};
+
+// Renders the beauty pass of a tile as a pipeline of stages that each run over all the tile's paths before the next:
+// 1. Generation: Primary rays of all the pixels.
+// 2. Extension: Closest hits of all the queued rays (primary rays are traced as packets when a packet tracer is given).
+// 3. Material shading: Queued paths get sorted by the material they hit, and their surfaces get prepared for shading.
+// 4. Shadow connection: Shadow rays from all the surfaces towards each light get traced together, then shaded.
+// 5. Continuation: Area lights and the skybox get shaded, and reflective/refractive paths re-queue their next rays.
+// Stages 2 to 5 repeat (one bounce per wave) until no path continues.
+// The paths' colors are identical to those of the per-pixel megakernel (renderPixelBeauty), as each path is shaded
+// in the same order. Only the order paths are worked on in differs.
+struct Wavefront {
+    WavefrontPath *paths;
+    WavefrontShadowRay *shadow_rays;
+    RayQueue queue;
+    u32 path_count = 0;
+    u32 shadow_ray_count = 0;
+
+    Ray shadow_ray;
+    Ray packet_rays[RAY_PACKET_SIZE];
+    RayHit packet_hits[RAY_PACKET_SIZE];
+    Geometry *packet_geometries[RAY_PACKET_SIZE];
+
+    static u64 getSizeInBytes(u32 path_capacity) {
+        return (sizeof(WavefrontPath) + sizeof(WavefrontShadowRay)) * path_capacity + RayQueue::getSizeInBytes(path_capacity);
+    }
+
+    Wavefront(u32 path_capacity, memory::MonotonicAllocator *memory_allocator) : queue{path_capacity, memory_allocator} {
+        paths       = (WavefrontPath*     )memory_allocator->allocate(sizeof(WavefrontPath)      * path_capacity);
+        shadow_rays = (WavefrontShadowRay*)memory_allocator->allocate(sizeof(WavefrontShadowRay) * path_capacity);
+    }
+
+    void renderTile(const RayTracerSettings &settings, const CameraRayProjection &projection, Scene &scene,
+                    SceneTracer &scene_tracer, PacketTracer *packet_tracer, SurfaceShader &surface, const Canvas &canvas,
+                    i32 start_x, i32 start_y, i32 end_x, i32 end_y, i32 pixel_step = 1, i32 row_step = 1, i32 pixel_offset = 0) {
+        generate(projection, settings.max_depth, start_x, start_y, end_x, end_y, pixel_step, row_step, pixel_offset);
+        extend(scene, scene_tracer, packet_tracer);
+        while (queue.count) {
+            shadeMaterials(settings, projection, scene, surface);
+            connectLights(settings, scene, scene_tracer, surface);
+            continuePaths(settings, scene, scene_tracer, surface, canvas);
+            extend(scene, scene_tracer, nullptr);
+        }
+    }
+
+    // Pixels can be skipped (as when checkerboarding or at a lower resolution),
+    // tracing every pixel_step'th one (offset per row and column) of every row_step'th row:
+    void generate(const CameraRayProjection &projection, u8 max_depth, i32 start_x, i32 start_y, i32 end_x, i32 end_y,
+                  i32 pixel_step, i32 row_step, i32 pixel_offset) {
+        path_count = queue.count = 0;
+        for (i32 y = start_y; y < end_y; y += row_step) {
+            for (i32 x = start_x + (start_x + y + pixel_offset) % pixel_step; x < end_x; x += pixel_step) {
+                WavefrontPath &path = paths[path_count];
+                Ray &ray = path.ray;
+                ray.pixel_coords.x = x;
+                ray.pixel_coords.y = y;
+                ray.depth = 1;
+                ray.reset(projection.camera_position, projection.getRayDirectionAt(x, y).normalized());
+                path.hit.scaling_factor = projection.getScalingFactorAt(x, y);
+                path.color = Black;
+                path.throughput = 1.0f;
+                path.depth = INFINITY;
+                path.depth_left = max_depth;
+                queue.push(path_count++, 0);
+            }
+        }
+    }
+
+    // Traces the queued rays, keying each path by the material it hit (misses first):
+    void extend(const Scene &scene, SceneTracer &scene_tracer, PacketTracer *packet_tracer) {
+        u32 i = 0;
+        if (packet_tracer) {
+            // Packets are made of neighbouring pixels of the same row:
+            while (i < queue.count) {
+                u32 ray_count = 0;
+                i32 y = paths[queue.ids[i]].ray.pixel_coords.y;
+                while (i + ray_count < queue.count && ray_count < RAY_PACKET_SIZE &&
+                       paths[queue.ids[i + ray_count]].ray.pixel_coords.y == y) {
+                    WavefrontPath &path = paths[queue.ids[i + ray_count]];
+                    packet_rays[ray_count] = path.ray;
+                    packet_hits[ray_count++] = path.hit;
+                }
+                packet_tracer->trace(packet_rays, packet_hits, packet_geometries, ray_count, scene);
+                for (u32 r = 0; r < ray_count; r++, i++) {
+                    WavefrontPath &path = paths[queue.ids[i]];
+                    path.ray = packet_rays[r];
+                    path.hit = packet_hits[r];
+                    path.geometry = packet_geometries[r];
+                    queue.keys[i] = getMaterialKey(path);
+                }
+            }
+        } else
+            for (; i < queue.count; i++) {
+                WavefrontPath &path = paths[queue.ids[i]];
+                scene_tracer.aux_ray.depth = path.ray.depth;
+                path.geometry = scene_tracer.trace(path.ray, path.hit, scene);
+                queue.keys[i] = getMaterialKey(path);
+            }
+    }
+
+    INLINE static u32 getMaterialKey(const WavefrontPath &path) {
+        return path.geometry ? ((path.geometry->material_id + 1) & ((1 << (2 * RAY_QUEUE_SORT_KEY_RADIX_BITS)) - 1)) : 0;
+    }
+
+    // Sorts the queue by material, and prepares the surfaces of all the hits for shading (material by material):
+    void shadeMaterials(const RayTracerSettings &settings, const CameraRayProjection &projection, Scene &scene, SurfaceShader &surface) {
+        queue.sort();
+
+        for (u32 run_start = 0, run_end; run_start < queue.count; run_start = run_end) {
+            for (run_end = run_start + 1; run_end < queue.count && queue.keys[run_end] == queue.keys[run_start];) run_end++;
+            if (!queue.keys[run_start]) { // Misses:
+                for (u32 i = run_start; i < run_end; i++) paths[queue.ids[i]].hit_type = WavefrontHitType_Miss;
+                continue;
+            }
+
+            Material *material = scene.materials + paths[queue.ids[run_start]].geometry->material_id;
+            surface.material = material;
+            for (u32 i = run_start; i < run_end; i++) {
+                WavefrontPath &path = paths[queue.ids[i]];
+                if (material->isEmissive() && path.geometry->type == GeometryType_Quad && !path.hit.from_behind) {
+                    path.hit_type = WavefrontHitType_Emitter;
+                    continue;
+                }
+
+                path.hit_type = WavefrontHitType_Surface;
+                path.direct_light = Black;
+                surface.geometry = path.geometry;
+                surface.prepareForShading(path.ray, path.hit, scene.materials, scene.textures);
+                if (path.depth_left == settings.max_depth) path.depth = projection.getDepthAt(path.hit.position);
+
+                path.R = surface.R;
+                path.RF = surface.RF;
+                path.NdotV = surface.NdotV;
+                path.albedo_from_map = surface.albedo_from_map;
+                path.refracted = surface.refracted;
+            }
+        }
+    }
+
+    // Shades all the surfaces from each point / directional light in turn, tracing their shadow rays together first.
+    // When sampling lights, each surface gets shaded from lights of its own instead:
+    void connectLights(const RayTracerSettings &settings, const Scene &scene, SceneTracer &scene_tracer, SurfaceShader &surface) {
+        if (!scene.lights) return;
+
+        if (isSamplingLights(settings, scene)) {
+            for (u32 i = 0; i < queue.count; i++) {
+                WavefrontPath &path = paths[queue.ids[i]];
+                if (path.hit_type != WavefrontHitType_Surface) continue;
+
+                loadSurface(path, scene, surface);
+                surface.shadeFromSampledLights(scene, scene_tracer, settings.light_samples, settings.light_sampling_seed, path.direct_light);
+            }
+            return;
+        }
+
+        for (u32 l = 0; l < scene.counts.lights; l++) {
+            const Light &light = scene.lights[l];
+
+            shadow_ray_count = 0;
+            for (u32 i = 0; i < queue.count; i++) {
+                WavefrontPath &path = paths[queue.ids[i]];
+                if (path.hit_type != WavefrontHitType_Surface) continue;
+
+                loadSurface(path, scene, surface);
+                if (!surface.isFacingLight(light)) continue;
+
+                if (light.flags & Light_IsShadowing)
+                    shadow_rays[shadow_ray_count++] = {surface.P, surface.L, surface.Ld, queue.ids[i], false};
+                else
+                    surface.shadeFromVisibleLight(light, path.direct_light);
+            }
+
+            for (u32 i = 0; i < shadow_ray_count; i++) {
+                WavefrontShadowRay &ray = shadow_rays[i];
+                shadow_ray.origin = ray.origin;
+                shadow_ray.direction = ray.direction;
+                ray.occluded = scene_tracer.isOccluded(shadow_ray, scene, ray.max_distance, l);
+            }
+
+            for (u32 i = 0; i < shadow_ray_count; i++) {
+                if (shadow_rays[i].occluded) continue;
+
+                WavefrontPath &path = paths[shadow_rays[i].path_id];
+                loadSurface(path, scene, surface);
+                surface.isFacingLight(light);
+                surface.shadeFromVisibleLight(light, path.direct_light);
+            }
+        }
+    }
+
+    // Finishes shading the bounce of each queued path, writing the pixels of paths that end to the canvas
+    // and re-queueing the rest with their next rays:
+    void continuePaths(const RayTracerSettings &settings, const Scene &scene, SceneTracer &scene_tracer, SurfaceShader &surface, const Canvas &canvas) {
+        u32 continuing_count = 0;
+        for (u32 i = 0; i < queue.count; i++) {
+            u32 path_id = queue.ids[i];
+            WavefrontPath &path = paths[path_id];
+            Color next_throughput, current_color = Black;
+            scene_tracer.aux_ray.depth = path.ray.depth;
+
+            if (path.hit_type == WavefrontHitType_Surface) {
+                current_color = path.direct_light;
+                loadSurface(path, scene, surface);
+                shadeFromAreaLightsAndSkybox(settings, scene, scene_tracer, surface, current_color);
+                continuePath(scene_tracer, surface, path.ray, path.hit, path.depth_left, next_throughput);
+            } else {
+                path.depth_left = 0;
+                if (path.hit_type == WavefrontHitType_Emitter)
+                    current_color = scene.materials[path.geometry->material_id].emission;
+                else
+                    shadeMiss(settings, scene, path.ray, current_color);
+            }
+
+            shadeLightGlows(scene, scene_tracer, path.ray, path.hit, current_color);
+
+            path.color = current_color.mulAdd(path.throughput, path.color);
+            if (path.depth_left) {
+                path.throughput *= next_throughput;
+                queue.ids[continuing_count++] = path_id; // Compacts the queue in place
+            } else {
+                path.color.applyToneMapping();
+                canvas.setPixel(path.ray.pixel_coords.x, path.ray.pixel_coords.y, path.color, -1, path.depth);
+            }
+        }
+        queue.count = continuing_count;
+    }
+
+    // Restores the surface shader to where it was when the path's surface was prepared for shading:
+    INLINE static void loadSurface(const WavefrontPath &path, const Scene &scene, SurfaceShader &surface) {
+        surface.geometry = path.geometry;
+        surface.material = scene.materials + path.geometry->material_id;
+        surface.P = path.hit.position;
+        surface.N = path.hit.normal;
+        surface.V = -path.ray.direction;
+        surface.R = path.R;
+        surface.RF = path.RF;
+        surface.NdotV = path.NdotV;
+        surface.albedo_from_map = path.albedo_from_map;
+        surface.refracted = path.refracted;
+    }
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "./scene_tracer.h"
+#include "../core/thread_pool.h"
+
+#define BATCH_TRACER_RAYS_PER_TASK 256
+#define RAY_QUERY_MISS 0xFFFFFFFF
+
+// A batch of ray queries in SoA layout (one array per component), as produced by external callers.
+// Directions need not be normalized: distances are reported in units of the direction's length.
+struct RayQueries {
+    const f32 *origin_x, *origin_y, *origin_z;
+    const f32 *direction_x, *direction_y, *direction_z;
+    const f32 *max_distance; // Optional (nullptr means unbounded)
+    u32 count;
+};
+
+// A compact hit record for a single query.
+// geometry_id is the index into scene.geometries (RAY_QUERY_MISS when nothing was hit)
+// primitive_id is the triangle index for meshes (0 for implicit geometry)
+// u, v are the barycentric weights of the triangle's 2nd and 3rd vertex for meshes,
+// and the surface parameterization for implicit geometry.
+struct RayQueryHit {
+    f32 distance;
+    u32 geometry_id;
+    u32 primitive_id;
+    f32 u, v;
+};
+
+struct BatchTracer;
+
+// The state of one traceClosest()/traceAny() call, handed to the pool's tasks.
+struct BatchTrace {
+    const BatchTracer &tracer;
+    const RayQueries &queries;
+    RayQueryHit *hits;
+    bool any_hit;
+};
+
+// Traces batches of ray queries on a thread pool.
+// Calls are reentrant: Their state lives on the caller's stack, and the pool runs concurrent calls one after the other
+// (also across batch tracers sharing a pool), so each thread's tracer only ever serves one call at a time.
+// As with any pool task, a call must not be made from within a task running on the same pool.
+struct BatchTracer {
+    const Scene &scene;
+    ThreadPool &thread_pool;
+    SceneTracer *tracers;
+
+    static u64 getSizeInBytes(const Scene &scene, u32 thread_count) {
+        return (sizeof(SceneTracer) + SceneTracer::getSizeInBytes(scene.counts.geometries, scene.mesh_stack_size)) * thread_count;
+    }
+
+    BatchTracer(const Scene &scene, ThreadPool &thread_pool, memory::MonotonicAllocator *memory_allocator = nullptr) :
+        scene{scene}, thread_pool{thread_pool} {
+        // Each thread of the pool traces through its own tracer (and traversal stacks):
+        memory::MonotonicAllocator temp_allocator;
+        if (!memory_allocator) {
+            temp_allocator = memory::MonotonicAllocator{getSizeInBytes(scene, thread_pool.thread_count)};
+            memory_allocator = &temp_allocator;
+        }
+        u32 stack_size = scene.counts.geometries;
+        u32 mesh_stack_size = scene.mesh_stack_size;
+        tracers = (SceneTracer*)memory_allocator->allocate(sizeof(SceneTracer) * thread_pool.thread_count);
+        for (u32 i = 0; i < thread_pool.thread_count; i++)
+            new(tracers + i) SceneTracer{stack_size, mesh_stack_size, memory_allocator};
+    }
+
+    // Finds the closest hit (against visible geometry) for every query:
+    void traceClosest(const RayQueries &rays, RayQueryHit *out_hits) const { trace(rays, out_hits, false); }
+
+    // Finds any hit (against shadowing geometry) for every query, for visibility and line-of-sight checks:
+    void traceAny(const RayQueries &rays, RayQueryHit *out_hits) const { trace(rays, out_hits, true); }
+
+    void trace(const RayQueries &rays, RayQueryHit *out_hits, bool find_any_hit) const {
+        BatchTrace batch_trace{*this, rays, out_hits, find_any_hit};
+        u32 task_count = (rays.count + BATCH_TRACER_RAYS_PER_TASK - 1) / BATCH_TRACER_RAYS_PER_TASK;
+        thread_pool.run(task_count, traceTask, &batch_trace);
+    }
+
+    static void traceTask(void *batch_trace, u32 task_index, u32 thread_index) {
+        const BatchTrace &trace = *(BatchTrace*)batch_trace;
+        u32 first = task_index * BATCH_TRACER_RAYS_PER_TASK;
+        u32 end = Min(first + BATCH_TRACER_RAYS_PER_TASK, trace.queries.count);
+        trace.tracer.traceRange(trace, first, end, trace.tracer.tracers[thread_index]);
+    }
+
+    void traceRange(const BatchTrace &trace, u32 first, u32 end, SceneTracer &tracer) const {
+        const RayQueries &rays = trace.queries;
+        bool any_hit = trace.any_hit;
+        Ray ray;
+        RayHit hit;
+        for (u32 i = first; i < end; i++) {
+            RayQueryHit &out_hit = trace.hits[i];
+            ray.origin = {rays.origin_x[i], rays.origin_y[i], rays.origin_z[i]};
+            ray.direction = {rays.direction_x[i], rays.direction_y[i], rays.direction_z[i]};
+            Geometry *geo = tracer.trace(ray, hit, scene, any_hit, rays.max_distance ? rays.max_distance[i] : INFINITY);
+            if (!geo) {
+                out_hit.distance = INFINITY;
+                out_hit.geometry_id = out_hit.primitive_id = RAY_QUERY_MISS;
+                out_hit.u = out_hit.v = 0.0f;
+                continue;
+            }
+
+            // Any-hit traces leave the hit in the tracer's auxiliary (local-space) hit:
+            const RayHit &local_hit = any_hit ? tracer.aux_hit : hit;
+            out_hit.distance = local_hit.distance;
+            out_hit.geometry_id = (u32)(geo - scene.geometries);
+            if (geo->type == GeometryType_Mesh) {
+                // Mesh hits may have had their uvs interpolated from vertex attributes, so recover the barycentrics:
+                const Triangle &triangle = scene.meshes[geo->id].triangles[local_hit.id];
+                vec3 UV{triangle.local_to_tangent * (local_hit.position - triangle.position)};
+                out_hit.primitive_id = local_hit.id;
+                out_hit.u = UV.y;
+                out_hit.v = UV.x;
+            } else {
+                out_hit.primitive_id = 0;
+                out_hit.u = local_hit.uv.u;
+                out_hit.v = local_hit.uv.v;
+            }
+        }
+    }
+};
@@ -1,6 +1,11 @@
 #pragma once
 
 #include "../math/vec3.h"
+#include "../core/ray.h"
+
+#ifndef BVH_WIDTH
+#define BVH_WIDTH 4 // 4 for SSE, 8 for AVX2 (2 disables collapsing into a wide BVH)
+#endif
 
 struct BVHNode {
     AABB aabb;
@@ -18,4 +23,283 @@ struct BVH {
     BVHNode *nodes;
     u32 node_count;
     u8 height;
-};
\ No newline at end of file
+};
+
+// The surface area heuristic cost of a BVH: the expected cost of tracing a ray that hits the root through it,
+// weighing each node by the probability of the ray hitting it (its surface area relative to the root's):
+f32 getSAHCost(const BVH &bvh, f32 node_cost = 1.0f, f32 primitive_cost = 1.0f) {
+    f32 root_area = bvh.nodes[0].aabb.area();
+    if (root_area <= 0) return 0;
+
+    f32 cost = 0;
+    for (u32 i = 0; i < bvh.node_count; i++) {
+        const BVHNode &node = bvh.nodes[i];
+        cost += node.aabb.area() * (node.leaf_count ? primitive_cost * (f32)node.leaf_count : node_cost);
+    }
+
+    return cost / root_area;
+}
+
+// Recomputes the bounds of every node from the (moved) primitive bounds, keeping the topology of the BVH.
+// Leaves refer to their primitives through the given leaf indices (or directly, when there are none).
+// Children are always stored after their parent, so one reverse pass visits every child before its parent:
+void refitBVH(BVH &bvh, const AABB *primitive_aabbs, const u32 *leaf_primitive_indices = nullptr) {
+    for (u32 i = bvh.node_count; i-- > 0;) {
+        BVHNode &node = bvh.nodes[i];
+        if (node.leaf_count) {
+            node.aabb = AABB{INFINITY, -INFINITY};
+            for (u32 l = node.first_index; l < node.first_index + node.leaf_count; l++)
+                node.aabb += primitive_aabbs[leaf_primitive_indices ? leaf_primitive_indices[l] : l];
+        } else
+            node.aabb = bvh.nodes[node.first_index].aabb + bvh.nodes[node.first_index + 1].aabb;
+    }
+}
+
+#ifndef BVH_QUANTIZATION
+#define BVH_QUANTIZATION 0 // Bits per quantized child bound: 8 or 16 to shrink wide nodes (0 keeps full-precision bounds)
+#endif
+
+#if BVH_QUANTIZATION == 16
+typedef u16 BVHQuantizedBound;
+#define BVH_QUANTIZED_BOUND_MAX 65535
+#elif BVH_QUANTIZATION
+typedef u8 BVHQuantizedBound;
+#define BVH_QUANTIZED_BOUND_MAX 255
+#endif
+
+// Quantization steps are powers of two, stored as biased float exponents (0 for flat axes) so they decode exactly:
+INLINE_XPU f32 getQuantizationStep(u8 exponent) {
+    union { f32 value; unsigned int bits; } step;
+    step.bits = (unsigned int)exponent << 23;
+    return step.value;
+}
+
+// A node of a wide BVH, holding the bounds of up to BVH_WIDTH children in SoA layout (one array per component).
+// Inner children refer to wide nodes, while leaf children refer to primitives directly (there are no leaf nodes).
+// With BVH_QUANTIZATION the child bounds are stored as integer steps from the node's own minimum corner,
+// rounded outwards so that a decoded child box always contains the original one (a 4-wide 8-bit node is 64 bytes,
+// as the child count takes the byte after the exponents that would otherwise be padding):
+struct WideBVHNodeData {
+#if BVH_QUANTIZATION
+    f32 origin_x, origin_y, origin_z;
+    u8 exponent_x, exponent_y, exponent_z;
+    u8 child_count;
+    BVHQuantizedBound min_x[BVH_WIDTH], min_y[BVH_WIDTH], min_z[BVH_WIDTH];
+    BVHQuantizedBound max_x[BVH_WIDTH], max_y[BVH_WIDTH], max_z[BVH_WIDTH];
+#else
+    f32 min_x[BVH_WIDTH], min_y[BVH_WIDTH], min_z[BVH_WIDTH];
+    f32 max_x[BVH_WIDTH], max_y[BVH_WIDTH], max_z[BVH_WIDTH];
+#endif
+    u32 first_index[BVH_WIDTH]; // Index of the child's wide node, or of the leaf child's first primitive
+    u16 leaf_count[BVH_WIDTH];  // 0 for inner children
+#if !BVH_QUANTIZATION
+    u8 child_count;
+#endif
+};
+
+// Nodes are padded to whole cache lines, so that (allocated at a cache line boundary) each spans as few lines as it can.
+// That only pays off when little of the last line goes unused, so nodes that would waste more than a quarter of it
+// (like 4-wide 16-bit ones, at 88 bytes) are left unpadded:
+#define WIDE_BVH_NODE_PADDING ((CACHE_LINE_SIZE - sizeof(WideBVHNodeData) % CACHE_LINE_SIZE) % CACHE_LINE_SIZE)
+#define WIDE_BVH_NODE_ALIGNMENT (WIDE_BVH_NODE_PADDING <= CACHE_LINE_SIZE / 4 ? CACHE_LINE_SIZE : alignof(WideBVHNodeData))
+
+struct alignas(WIDE_BVH_NODE_ALIGNMENT) WideBVHNode : WideBVHNodeData {
+    // Slab test against all the child boxes at once. Rather than selecting near/far corners by the ray's octant
+    // (as Ray::hitsAABB does) the per-axis distances are ordered with min/max, which keeps the loop branch-free.
+    // Outputs the children that are hit closer than the closest distance, sorted by their near distance,
+    // and returns how many of them there are:
+    INLINE_XPU u8 hitChildren(const Ray &ray, f32 closest_distance, f32 *near_distances, f32 *far_distances, u8 *hit_children) const {
+        const vec3 &Rd_rcp = ray.direction_reciprocal;
+#if BVH_QUANTIZATION
+        // Fold the dequantization into the ray: origin + step * q maps to (origin * Rd_rcp + Ro_scaled) + (step * Rd_rcp) * q
+        const vec3 Ro_scaled{
+            fast_mul_add(origin_x, Rd_rcp.x, ray.scaled_origin.x),
+            fast_mul_add(origin_y, Rd_rcp.y, ray.scaled_origin.y),
+            fast_mul_add(origin_z, Rd_rcp.z, ray.scaled_origin.z)
+        };
+        const vec3 step_rcp{
+            getQuantizationStep(exponent_x) * Rd_rcp.x,
+            getQuantizationStep(exponent_y) * Rd_rcp.y,
+            getQuantizationStep(exponent_z) * Rd_rcp.z
+        };
+#else
+        const vec3 &Ro_scaled = ray.scaled_origin;
+        const vec3 &step_rcp = Rd_rcp;
+#endif
+        f32 near_t[BVH_WIDTH], far_t[BVH_WIDTH];
+        for (u32 i = 0; i < BVH_WIDTH; i++) {
+            f32 min_t_x = fast_mul_add((f32)min_x[i], step_rcp.x, Ro_scaled.x);
+            f32 min_t_y = fast_mul_add((f32)min_y[i], step_rcp.y, Ro_scaled.y);
+            f32 min_t_z = fast_mul_add((f32)min_z[i], step_rcp.z, Ro_scaled.z);
+            f32 max_t_x = fast_mul_add((f32)max_x[i], step_rcp.x, Ro_scaled.x);
+            f32 max_t_y = fast_mul_add((f32)max_y[i], step_rcp.y, Ro_scaled.y);
+            f32 max_t_z = fast_mul_add((f32)max_z[i], step_rcp.z, Ro_scaled.z);
+            near_t[i] = Max(Max(0, Min(min_t_x, max_t_x)), Max(Min(min_t_y, max_t_y), Min(min_t_z, max_t_z)));
+            far_t[i] = Min(Max(min_t_x, max_t_x), Min(Max(min_t_y, max_t_y), Max(min_t_z, max_t_z)));
+        }
+
+        // Insertion-sort the hit children by their near distance:
+        u8 hit_count = 0;
+        for (u8 i = 0; i < child_count; i++) {
+            near_distances[i] = near_t[i];
+            far_distances[i] = far_t[i];
+            if (near_t[i] > far_t[i] || near_t[i] >= closest_distance) continue;
+
+            u8 j = hit_count++;
+            for (; j && near_distances[hit_children[j - 1]] > near_distances[i]; j--)
+                hit_children[j] = hit_children[j - 1];
+            hit_children[j] = i;
+        }
+
+        return hit_count;
+    }
+
+    // Sets the node's own bounds, that its children's bounds are quantized relative to:
+    void setBounds(const AABB &bounds) {
+#if BVH_QUANTIZATION
+        origin_x = bounds.min.x;
+        origin_y = bounds.min.y;
+        origin_z = bounds.min.z;
+        exponent_x = getQuantizationExponent(origin_x, bounds.max.x);
+        exponent_y = getQuantizationExponent(origin_y, bounds.max.y);
+        exponent_z = getQuantizationExponent(origin_z, bounds.max.z);
+#else
+        (void)bounds; // Full-precision child bounds need no reference
+#endif
+    }
+
+    void setChildBounds(u32 i, const AABB &bounds) {
+#if BVH_QUANTIZATION
+        min_x[i] = quantizeBound(bounds.min.x, origin_x, exponent_x, false);
+        min_y[i] = quantizeBound(bounds.min.y, origin_y, exponent_y, false);
+        min_z[i] = quantizeBound(bounds.min.z, origin_z, exponent_z, false);
+        max_x[i] = quantizeBound(bounds.max.x, origin_x, exponent_x, true);
+        max_y[i] = quantizeBound(bounds.max.y, origin_y, exponent_y, true);
+        max_z[i] = quantizeBound(bounds.max.z, origin_z, exponent_z, true);
+#else
+        min_x[i] = bounds.min.x;
+        min_y[i] = bounds.min.y;
+        min_z[i] = bounds.min.z;
+        max_x[i] = bounds.max.x;
+        max_y[i] = bounds.max.y;
+        max_z[i] = bounds.max.z;
+#endif
+    }
+
+#if BVH_QUANTIZATION
+    // The smallest power-of-two step that spans the given range in BVH_QUANTIZED_BOUND_MAX steps:
+    static u8 getQuantizationExponent(f32 origin, f32 end) {
+        f32 extent = end - origin;
+        if (extent <= 0) return 0;
+
+        int exponent;
+        frexpf(extent / BVH_QUANTIZED_BOUND_MAX, &exponent);
+        exponent = Min(Max(exponent + 127, 1), 254);
+        while (exponent < 254 && origin + getQuantizationStep((u8)exponent) * BVH_QUANTIZED_BOUND_MAX < end) exponent++;
+        return (u8)exponent;
+    }
+
+    // Rounds down for minimums and up for maximums, verifying against the decoded value to stay conservative:
+    static BVHQuantizedBound quantizeBound(f32 value, f32 origin, u8 exponent, bool round_up) {
+        f32 step = getQuantizationStep(exponent);
+        if (step == 0) return 0;
+
+        f32 steps = Min(Max((value - origin) / step, 0), BVH_QUANTIZED_BOUND_MAX);
+        i32 q = (i32)(round_up ? ceilf(steps) : floorf(steps));
+        if (round_up) while (q < BVH_QUANTIZED_BOUND_MAX && origin + step * (f32)q < value) q++;
+        else          while (q > 0                       && origin + step * (f32)q > value) q--;
+        return (BVHQuantizedBound)q;
+    }
+#endif
+};
+
+#if BVH_QUANTIZATION == 8 && BVH_WIDTH == 4
+static_assert(sizeof(WideBVHNode) == CACHE_LINE_SIZE, "A 4-wide 8-bit node should fill exactly one cache line");
+#endif
+
+struct WideBVH {
+    WideBVHNode *nodes{nullptr};
+    u32 node_count{0};
+};
+
+// A wide BVH never needs more nodes than the binary BVH it is collapsed from has inner nodes:
+INLINE_XPU u32 getWideBVHNodeCount(u32 binary_node_count) {
+    return BVH_WIDTH > 2 ? Max(1, binary_node_count / 2) : 0;
+}
+
+// Collapses a binary BVH into a wide one, by repeatedly opening up the child with the largest surface area
+// until a node has BVH_WIDTH children (or only leaf children). The inner children of a wide node are stored together,
+// and laid out depth-first with the largest child's subtree first (as BVHBuilder::reorder does for binary BVHs).
+void collapseBVH(const BVH &bvh, WideBVH &wide_bvh) {
+    if (!wide_bvh.nodes) return;
+
+    // Every level of the tree leaves at most BVH_WIDTH - 1 children pending:
+    u32 stack[BVH_WIDTH * 256];
+    u32 children[BVH_WIDTH], inner_children[BVH_WIDTH];
+    u32 child_count, inner_child_count, top = 0;
+    wide_bvh.node_count = 1;
+    wide_bvh.nodes[0].first_index[0] = 0; // The binary node each wide node is collapsed from is parked in its first slot
+    stack[top++] = 0;
+
+    while (top) {
+        WideBVHNode &wide_node = wide_bvh.nodes[stack[--top]];
+        const BVHNode &binary_node = bvh.nodes[wide_node.first_index[0]];
+        if (binary_node.leaf_count) {
+            children[0] = wide_node.first_index[0];
+            child_count = 1;
+        } else {
+            children[0] = binary_node.first_index;
+            children[1] = binary_node.first_index + 1;
+            child_count = 2;
+            while (child_count < BVH_WIDTH) {
+                i32 largest_child = -1;
+                f32 largest_area = -1;
+                for (u32 i = 0; i < child_count; i++) {
+                    const BVHNode &child = bvh.nodes[children[i]];
+                    if (!child.leaf_count && child.aabb.area() > largest_area) {
+                        largest_area = child.aabb.area();
+                        largest_child = (i32)i;
+                    }
+                }
+                if (largest_child < 0) break;
+
+                const BVHNode &opened_child = bvh.nodes[children[largest_child]];
+                children[largest_child] = opened_child.first_index;
+                children[child_count++] = opened_child.first_index + 1;
+            }
+        }
+
+        wide_node.child_count = (u8)child_count;
+        AABB bounds{bvh.nodes[children[0]].aabb};
+        for (u32 i = 1; i < child_count; i++) bounds += bvh.nodes[children[i]].aabb;
+        wide_node.setBounds(bounds);
+        inner_child_count = 0;
+        for (u32 i = 0; i < BVH_WIDTH; i++) {
+            if (i < child_count) {
+                const BVHNode &child = bvh.nodes[children[i]];
+                wide_node.setChildBounds(i, child.aabb);
+                wide_node.leaf_count[i] = child.leaf_count;
+                if (child.leaf_count)
+                    wide_node.first_index[i] = child.first_index;
+                else {
+                    wide_node.first_index[i] = wide_bvh.node_count;
+                    wide_bvh.nodes[wide_bvh.node_count++].first_index[0] = children[i];
+
+                    // Keep the inner children sorted by decreasing surface area:
+                    u32 j = inner_child_count++;
+                    for (; j && bvh.nodes[children[inner_children[j - 1]]].aabb.area() < child.aabb.area(); j--)
+                        inner_children[j] = inner_children[j - 1];
+                    inner_children[j] = i;
+                }
+            } else {
+                wide_node.setChildBounds(i, AABB{INFINITY, -INFINITY});
+                wide_node.first_index[i] = 0;
+                wide_node.leaf_count[i] = 0;
+            }
+        }
+
+        // Push the largest child last so that its subtree gets laid out first:
+        for (u32 i = inner_child_count; i-- > 0;)
+            stack[top++] = wide_node.first_index[inner_children[i]];
+    }
+}
@@ -1,6 +1,114 @@
 #pragma once
 
 #include "./mesh.h"
+#include "../core/thread_pool.h"
+
+#ifndef BVH_SAH_BIN_COUNT
+#define BVH_SAH_BIN_COUNT 16 // 16 or 32 bins per axis for the binned SAH strategy
+#endif
+
+#ifndef BVH_BUILDER_SUBTREE_SIZE
+#define BVH_BUILDER_SUBTREE_SIZE 4096 // Ranges at most this large are built as independent subtrees (one task each)
+#endif
+
+#ifndef BVH_BUILDER_BINNING_TASK_SIZE
+#define BVH_BUILDER_BINNING_TASK_SIZE 16384 // Nodes binned per task when binning the top splits in parallel
+#endif
+
+#ifndef BVH_LBVH_MORTON_BITS
+#define BVH_LBVH_MORTON_BITS 30 // 30 (10 bits per axis) or 63 (21 bits per axis) bits per Morton code of the LBVH strategy
+#endif
+
+#define BVH_LBVH_RADIX_BITS 11
+#define BVH_LBVH_RADIX_SIZE (1 << BVH_LBVH_RADIX_BITS)
+
+#ifndef BVH_SPATIAL_SPLITS_MAX_GROWTH
+#define BVH_SPATIAL_SPLITS_MAX_GROWTH 0.3f // Spatial splits add at most this fraction of the triangle count as references
+#endif
+
+#ifndef BVH_SPATIAL_SPLITS_MIN_OVERLAP
+#define BVH_SPATIAL_SPLITS_MIN_OVERLAP 0.00001f // Spatial splits are only tried where children of an object split overlap
+#endif                                          // by more than this fraction of the surface area of the root
+
+enum BVHBuildStrategy {
+    BVHBuildStrategy_BinnedSAH, // Evaluates the SAH at bin boundaries of the node centroids: O(n) per split
+    BVHBuildStrategy_FullSort,  // Evaluates the SAH at every node, sorting the nodes on every axis: O(n log n) per split
+    BVHBuildStrategy_LBVH,      // Sorts the nodes along a Morton curve once, splitting at Morton code bits: O(n) overall
+    BVHBuildStrategy_SpatialSplits // Binned SAH that can also split triangles across bin planes (meshes only, single-threaded)
+};
+
+// Spreads the low 21 bits of the given value apart, so that they occupy every third bit:
+INLINE u64 expandBitsForMortonCode(u64 value) {
+    value &= 0x1fffff;
+    value = (value | value << 32) & 0x1f00000000ffff;
+    value = (value | value << 16) & 0x1f0000ff0000ff;
+    value = (value | value << 8)  & 0x100f00f00f00f00f;
+    value = (value | value << 4)  & 0x10c30c30c30c30c3;
+    value = (value | value << 2)  & 0x1249249249249249;
+    return value;
+}
+
+// Isolates the highest set bit of the given (non-zero) value:
+INLINE u64 getHighestBit(u64 value) {
+    value |= value >> 1;
+    value |= value >> 2;
+    value |= value >> 4;
+    value |= value >> 8;
+    value |= value >> 16;
+    value |= value >> 32;
+    return value ^ (value >> 1);
+}
+
+struct BVHBin {
+    AABB aabb;
+    u32 count;
+};
+
+struct BVHSpatialBin {
+    AABB aabb;
+    u32 entries, exits;
+};
+
+// Flat axes are given some thickness, so that boxes around axis-aligned triangles can still be hit:
+INLINE void thickenFlatAxes(AABB &aabb) {
+    for (u8 axis = 0; axis < 3; axis++) {
+        f32 diff = aabb.max.components[axis] - aabb.min.components[axis];
+        if (diff < 0) diff = -diff;
+        if (diff < EPS) {
+            aabb.min.components[axis] -= EPS;
+            aabb.max.components[axis] += EPS;
+        }
+    }
+}
+
+// The bounds of the part of a triangle that lies between 2 planes along the given axis, within the given bounds
+// (empty when none of it does). Every vertex in between and every edge crossing of the planes bounds that part:
+AABB getClippedTriangleBounds(const vec3 *vertices, u8 axis, f32 from, f32 to, const AABB &bounds) {
+    AABB clipped{INFINITY, -INFINITY};
+    for (u8 i = 0; i < 3; i++) {
+        const vec3 &a = vertices[i];
+        const vec3 &b = vertices[(i + 1) % 3];
+        f32 a_pos = a.components[axis];
+        f32 b_pos = b.components[axis];
+        if (from <= a_pos && a_pos <= to) clipped += AABB{a, a};
+
+        f32 planes[2] = {from, to};
+        for (f32 plane : planes)
+            if ((a_pos < plane && plane < b_pos) || (b_pos < plane && plane < a_pos)) {
+                vec3 crossing{(b - a).scaleAdd((plane - a_pos) / (b_pos - a_pos), a)};
+                crossing.components[axis] = plane;
+                clipped += AABB{crossing, crossing};
+            }
+    }
+    clipped.min = maximum(clipped.min, bounds.min);
+    clipped.max = minimum(clipped.max, bounds.max);
+
+    return clipped;
+}
+
+INLINE bool isEmpty(const AABB &aabb) {
+    return aabb.min.x > aabb.max.x || aabb.min.y > aabb.max.y || aabb.min.z > aabb.max.z;
+}
 
 struct BVHPartitionSide {
     AABB *aabbs;
@@ -118,35 +226,125 @@ struct BVHBuildIteration {
     u8 depth;
 };
 
+// Builds a BVH over the AABBs of the builder's nodes (as given by node_ids), optionally on a thread pool.
+// The top of the tree is split breadth-first (binning the large nodes in parallel), until the remaining ranges are
+// small enough to be built as independent subtrees (one task each, with per-thread scratch memory).
+// The subtrees are then appended in a fixed order, so the final layout doesn't depend on the thread count.
+// Leaves refer to their range of leaf_ids, which are laid out in the final order of node_ids.
+// The LBVH strategy first sorts node_ids by the Morton codes of the node centroids (radix sorting them), and then
+// splits every range where its first and last codes start to differ. Such splits don't look at the bounds at all,
+// so the bounds are only computed once the whole tree is built (bottom-up, in a single pass).
+// A builder that was allocated for the LBVH strategy can also build using the binned SAH strategy.
+// The spatial splits strategy builds mesh BVHs depth-first, trying to split a node's triangle references at a plane
+// (clipping triangles that cross it into a reference on each side) wherever its object split leaves overlapping children.
+// References are added to the builder's nodes (after the triangles), up to a budget of BVH_SPATIAL_SPLITS_MAX_GROWTH.
+// Every range of node_ids is laid out last while it is being split, so that it can grow into the space after it.
 struct BVHBuilder {
     BVHNode *nodes;
     BVHPartition partitions[3];
-    BVHBuildIteration *iterations;
-    u32 *node_ids, *leaf_ids;
+    BVHBin bins[3 * BVH_SAH_BIN_COUNT];
+    BVHSpatialBin spatial_bins[3 * BVH_SAH_BIN_COUNT];
+    BVHBin *thread_bins;
+    BVHBuildIteration *iterations, *subtrees;
+    BVHNode *subtree_nodes;
+    u32 *node_ids, *leaf_ids, *subtree_node_counts, *scratch_ids;
+    u64 *morton_codes, *sorting_codes;
+    u8 *subtree_heights;
     i32 *sort_stack;
+    BVHBuildStrategy strategy;
+
+    // State shared with the tasks of the current build:
+    ThreadPool *thread_pool;
+    BVH *building_bvh;
+    u32 subtree_count;
+    u16 building_max_leaf_size;
+
+    // State of the current build with spatial splits:
+    const Mesh *splitting_mesh;
+    u32 reference_count, max_reference_count;
+    f32 min_overlap_area;
+
+    // State shared with the tasks of the current parallel binning:
+    const u32 *binning_ids;
+    u32 binning_count;
+    vec3 binning_centroids_min;
+    f32 binning_scales[3];
+    vec3 thread_centroids_min[THREAD_POOL_MAX_THREADS];
+    vec3 thread_centroids_max[THREAD_POOL_MAX_THREADS];
+
+    // Subtrees span disjoint ranges of more than one node each. Lopsided splits can chain the top nodes
+    // (each peeling off a subtree of as little as 2 nodes), so the count is bound by the nodes rather than the top nodes:
+    INLINE static u32 getMaxSubtreeCount(u32 max_leaf_node_count) {
+        return max_leaf_node_count / 2 + 1;
+    }
+
+    // Meshes built with spatial splits store every reference as a triangle of their own, so need room for this many:
+    INLINE static u32 getMaxTriangleReferenceCount(u32 triangle_count) {
+        return triangle_count + (u32)((f32)triangle_count * BVH_SPATIAL_SPLITS_MAX_GROWTH);
+    }
+
+    static u32 getSizeInBytes(u32 max_leaf_node_count, BVHBuildStrategy strategy = BVHBuildStrategy_BinnedSAH) {
+        u32 memory_size = sizeof(BVHBuildIteration) + sizeof(BVHNode) * 3 + sizeof(u32) * 2;
+
+        // Only the full-sort strategy needs the per-axis sorting and sweeping scratch arrays:
+        if (strategy == BVHBuildStrategy_FullSort)
+            memory_size += sizeof(i32) + 3 * (sizeof(u32) + 2 * (sizeof(AABB) + sizeof(f32)));
+
+        // Only the LBVH strategy needs the Morton codes, double-buffered (with the node ids) for radix sorting:
+        if (strategy == BVHBuildStrategy_LBVH)
+            memory_size += 2 * sizeof(u64) + sizeof(u32);
+
+        // The spatial splits strategy partitions node ids out of place:
+        if (strategy == BVHBuildStrategy_SpatialSplits)
+            memory_size += sizeof(u32);
 
-    static u32 getSizeInBytes(u32 max_leaf_node_count) {
-        u32 memory_size = sizeof(u32) + sizeof(i32) + 2 * (sizeof(AABB) + sizeof(f32));
-        memory_size *= 3;
-        memory_size += sizeof(BVHBuildIteration) + sizeof(BVHNode) + sizeof(u32) * 2;
         memory_size *= max_leaf_node_count;
+        memory_size += (sizeof(BVHBuildIteration) + sizeof(u32) + sizeof(u8)) * getMaxSubtreeCount(max_leaf_node_count);
+        memory_size += sizeof(BVHBin) * 3 * BVH_SAH_BIN_COUNT * THREAD_POOL_MAX_THREADS;
 
         return memory_size;
     }
 
-    BVHBuilder(u32 max_leaf_node_count, memory::MonotonicAllocator *memory_allocator = nullptr) {
+    BVHBuilder(u32 max_leaf_node_count, BVHBuildStrategy strategy = BVHBuildStrategy_BinnedSAH,
+               memory::MonotonicAllocator *memory_allocator = nullptr) : strategy{strategy} {
         memory::MonotonicAllocator temp_allocator;
         if (!memory_allocator) {
-            temp_allocator = memory::MonotonicAllocator{getSizeInBytes(max_leaf_node_count)};
+            temp_allocator = memory::MonotonicAllocator{getSizeInBytes(max_leaf_node_count, strategy)};
             memory_allocator = &temp_allocator;
         }
 
-        iterations = (BVHBuildIteration*)memory_allocator->allocate(sizeof(BVHBuildIteration) * max_leaf_node_count);
-        nodes      = (BVHNode*          )memory_allocator->allocate(sizeof(BVHNode)           * max_leaf_node_count);
-        node_ids   = (u32*              )memory_allocator->allocate(sizeof(u32)                 * max_leaf_node_count);
-        leaf_ids   = (u32*              )memory_allocator->allocate(sizeof(u32)                 * max_leaf_node_count);
-        sort_stack = (i32*              )memory_allocator->allocate(sizeof(i32)                 * max_leaf_node_count);
+        u32 max_subtree_count = getMaxSubtreeCount(max_leaf_node_count);
+        iterations    = (BVHBuildIteration*)memory_allocator->allocate(sizeof(BVHBuildIteration) * max_leaf_node_count);
+        nodes         = (BVHNode*          )memory_allocator->allocate(sizeof(BVHNode)           * max_leaf_node_count);
+        subtree_nodes = (BVHNode*          )memory_allocator->allocate(sizeof(BVHNode)           * max_leaf_node_count * 2);
+        node_ids      = (u32*              )memory_allocator->allocate(sizeof(u32)                 * max_leaf_node_count);
+        leaf_ids      = (u32*              )memory_allocator->allocate(sizeof(u32)                 * max_leaf_node_count);
+        subtrees            = (BVHBuildIteration*)memory_allocator->allocate(sizeof(BVHBuildIteration) * max_subtree_count);
+        subtree_node_counts = (u32*              )memory_allocator->allocate(sizeof(u32)                 * max_subtree_count);
+        subtree_heights     = (u8*               )memory_allocator->allocate(sizeof(u8)                  * max_subtree_count);
+        thread_bins = (BVHBin*)memory_allocator->allocate(sizeof(BVHBin) * 3 * BVH_SAH_BIN_COUNT * THREAD_POOL_MAX_THREADS);
+        thread_pool = nullptr;
+        building_bvh = nullptr;
+        subtree_count = 0;
+        building_max_leaf_size = 1;
+        splitting_mesh = nullptr;
+        reference_count = max_reference_count = 0;
+        min_overlap_area = 0;
+
+        sort_stack = nullptr;
+        morton_codes = sorting_codes = nullptr;
+        scratch_ids = nullptr;
+        for (u8 i = 0; i < 3; i++) partitions[i] = BVHPartition{};
+        if (strategy == BVHBuildStrategy_LBVH) {
+            morton_codes  = (u64*)memory_allocator->allocate(sizeof(u64) * max_leaf_node_count);
+            sorting_codes = (u64*)memory_allocator->allocate(sizeof(u64) * max_leaf_node_count);
+        }
+        if (strategy == BVHBuildStrategy_LBVH || strategy == BVHBuildStrategy_SpatialSplits)
+            scratch_ids = (u32*)memory_allocator->allocate(sizeof(u32) * max_leaf_node_count);
+        if (strategy != BVHBuildStrategy_FullSort)
+            return;
 
+        sort_stack = (i32*)memory_allocator->allocate(sizeof(i32) * max_leaf_node_count);
         for (u8 i = 0; i < 3; i++) {
             partitions[i].sorted_node_ids     = (u32* )memory_allocator->allocate(sizeof(u32)  * max_leaf_node_count);
             partitions[i].left.aabbs          = (AABB*)memory_allocator->allocate(sizeof(AABB) * max_leaf_node_count);
@@ -156,13 +354,186 @@ struct BVHBuilder {
         }
     }
 
-    u32 splitNode(BVHNode &node, u32 start, u32 end, BVH &bvh) {
+    // Splits the given node's range of node_ids in two, appending its 2 children to the given nodes:
+    u32 splitNode(BVHNode &node, u32 start, u32 end, BVHNode *out_nodes, u32 &node_count, BVHBin *node_bins, bool parallel = false) {
+        switch (strategy) {
+            case BVHBuildStrategy_FullSort: return splitNodeFullSort(node, start, end, out_nodes, node_count);
+            case BVHBuildStrategy_LBVH    : return splitNodeLBVH(node, start, end, out_nodes, node_count);
+            default                       : return splitNodeBinned(node, start, end, out_nodes, node_count, node_bins, parallel);
+        }
+    }
+
+    INLINE static u32 getBinIndex(const AABB &aabb, u8 axis, f32 centroids_min, f32 bin_scale) {
+        f32 centroid = aabb.min.components[axis] + aabb.max.components[axis];
+        u32 bin = (u32)Max(0, (centroid - centroids_min) * bin_scale);
+        return Min(bin, BVH_SAH_BIN_COUNT - 1);
+    }
+
+    // Centroids are kept doubled (as min + max):
+    static void getCentroidBounds(const BVHNode *nodes, const u32 *ids, u32 N, vec3 &centroids_min, vec3 &centroids_max) {
+        for (u32 i = 0; i < N; i++) {
+            const AABB &aabb = nodes[ids[i]].aabb;
+            centroids_min = minimum(centroids_min, aabb.min + aabb.max);
+            centroids_max = maximum(centroids_max, aabb.min + aabb.max);
+        }
+    }
+
+    // Bins the nodes along every axis that has a (non-zero) bin scale:
+    static void binNodes(const BVHNode *nodes, const u32 *ids, u32 N, const vec3 &centroids_min, const f32 *bin_scales, BVHBin *axis_bins) {
+        for (u8 axis = 0; axis < 3; axis++, axis_bins += BVH_SAH_BIN_COUNT) {
+            if (bin_scales[axis] == 0) continue;
+
+            for (u32 i = 0; i < N; i++) {
+                const AABB &aabb = nodes[ids[i]].aabb;
+                BVHBin &bin = axis_bins[getBinIndex(aabb, axis, centroids_min.components[axis], bin_scales[axis])];
+                bin.aabb += aabb;
+                bin.count++;
+            }
+        }
+    }
+
+    static void clearBins(BVHBin *bins_to_clear) {
+        for (u32 b = 0; b < 3 * BVH_SAH_BIN_COUNT; b++) bins_to_clear[b] = {AABB{INFINITY, -INFINITY}, 0};
+    }
+
+    static void getCentroidBoundsTask(void *builder, u32 task_index, u32 thread_index) {
+        BVHBuilder &self = *(BVHBuilder*)builder;
+        u32 first = task_index * BVH_BUILDER_BINNING_TASK_SIZE;
+        u32 count = Min(BVH_BUILDER_BINNING_TASK_SIZE, self.binning_count - first);
+        getCentroidBounds(self.nodes, self.binning_ids + first, count,
+                          self.thread_centroids_min[thread_index], self.thread_centroids_max[thread_index]);
+    }
+
+    static void binNodesTask(void *builder, u32 task_index, u32 thread_index) {
+        BVHBuilder &self = *(BVHBuilder*)builder;
+        u32 first = task_index * BVH_BUILDER_BINNING_TASK_SIZE;
+        u32 count = Min(BVH_BUILDER_BINNING_TASK_SIZE, self.binning_count - first);
+        binNodes(self.nodes, self.binning_ids + first, count, self.binning_centroids_min, self.binning_scales,
+                 self.thread_bins + thread_index * 3 * BVH_SAH_BIN_COUNT);
+    }
+
+    u32 splitNodeBinned(BVHNode &node, u32 start, u32 end, BVHNode *out_nodes, u32 &node_count, BVHBin *node_bins, bool parallel) {
+        u32 N = end - start;
+        u32 *ids = node_ids + start;
+
+        node.first_index = node_count;
+        BVHNode &left_node  = out_nodes[node_count++];
+        BVHNode &right_node = out_nodes[node_count++];
+        left_node = BVHNode{};
+        right_node = BVHNode{};
+
+        // Bin by centroid within the bounds of the centroids. In parallel, every thread bins into its own bins,
+        // which are then merged (bounds and counts merge exactly, so the result doesn't depend on the scheduling):
+        u32 task_count = (N + BVH_BUILDER_BINNING_TASK_SIZE - 1) / BVH_BUILDER_BINNING_TASK_SIZE;
+        parallel = parallel && thread_pool && thread_pool->thread_count > 1 && task_count > 1;
+        u32 thread_count = parallel ? thread_pool->thread_count : 1;
+
+        vec3 centroids_min{INFINITY}, centroids_max{-INFINITY};
+        f32 bin_scales[3];
+        if (parallel) {
+            binning_ids = ids;
+            binning_count = N;
+            for (u32 t = 0; t < thread_count; t++) {
+                thread_centroids_min[t] = INFINITY;
+                thread_centroids_max[t] = -INFINITY;
+            }
+            thread_pool->run(task_count, getCentroidBoundsTask, this);
+            for (u32 t = 0; t < thread_count; t++) {
+                centroids_min = minimum(centroids_min, thread_centroids_min[t]);
+                centroids_max = maximum(centroids_max, thread_centroids_max[t]);
+            }
+        } else
+            getCentroidBounds(nodes, ids, N, centroids_min, centroids_max);
+
+        for (u8 axis = 0; axis < 3; axis++) {
+            f32 extent = centroids_max.components[axis] - centroids_min.components[axis];
+            bin_scales[axis] = extent > 0 ? (f32)BVH_SAH_BIN_COUNT / extent : 0;
+        }
+
+        clearBins(node_bins);
+        if (parallel) {
+            binning_centroids_min = centroids_min;
+            for (u8 axis = 0; axis < 3; axis++) binning_scales[axis] = bin_scales[axis];
+            for (u32 t = 0; t < thread_count; t++) clearBins(thread_bins + t * 3 * BVH_SAH_BIN_COUNT);
+            thread_pool->run(task_count, binNodesTask, this);
+            for (u32 t = 0; t < thread_count; t++) {
+                BVHBin *bins_of_thread = thread_bins + t * 3 * BVH_SAH_BIN_COUNT;
+                for (u32 b = 0; b < 3 * BVH_SAH_BIN_COUNT; b++) {
+                    node_bins[b].aabb += bins_of_thread[b].aabb;
+                    node_bins[b].count += bins_of_thread[b].count;
+                }
+            }
+        } else
+            binNodes(nodes, ids, N, centroids_min, bin_scales, node_bins);
+
+        f32 right_costs[BVH_SAH_BIN_COUNT];
+        f32 smallest_cost = INFINITY;
+        u32 chosen_split = 0;
+        u8 chosen_axis = 0;
+
+        for (u8 axis = 0; axis < 3; axis++) {
+            if (bin_scales[axis] == 0) continue;
+            BVHBin *axis_bins = node_bins + axis * BVH_SAH_BIN_COUNT;
+
+            // Sweep from the right to gather the cost of each right side, then from the left to evaluate each split:
+            AABB side{INFINITY, -INFINITY};
+            u32 side_count = 0;
+            for (u32 b = BVH_SAH_BIN_COUNT - 1; b > 0; b--) {
+                side += axis_bins[b].aabb;
+                side_count += axis_bins[b].count;
+                right_costs[b] = side_count ? side.area() * (f32)side_count : INFINITY;
+            }
+
+            side = AABB{INFINITY, -INFINITY};
+            side_count = 0;
+            for (u32 split = 1; split < BVH_SAH_BIN_COUNT; split++) {
+                side += axis_bins[split - 1].aabb;
+                side_count += axis_bins[split - 1].count;
+                if (!side_count) continue;
+
+                f32 cost = side.area() * (f32)side_count + right_costs[split];
+                if (cost < smallest_cost) {
+                    smallest_cost = cost;
+                    chosen_split = split;
+                    chosen_axis = axis;
+                }
+            }
+        }
+
+        u32 left_count = 0;
+        if (smallest_cost == INFINITY) {
+            // All centroids coincide, so no bin boundary separates them: Split the nodes in half instead
+            left_count = N / 2;
+        } else {
+            u32 i = 0, j = N, t;
+            f32 centroids_min_of_axis = centroids_min.components[chosen_axis];
+            f32 bin_scale = bin_scales[chosen_axis];
+            while (i < j) {
+                if (getBinIndex(nodes[ids[i]].aabb, chosen_axis, centroids_min_of_axis, bin_scale) < chosen_split)
+                    i++;
+                else {
+                    t = ids[i];
+                    ids[i] = ids[--j];
+                    ids[j] = t;
+                }
+            }
+            left_count = i;
+        }
+
+        left_node.aabb = right_node.aabb = AABB{INFINITY, -INFINITY};
+        for (u32 i = 0; i < left_count; i++) left_node.aabb += nodes[ids[i]].aabb;
+        for (u32 i = left_count; i < N; i++) right_node.aabb += nodes[ids[i]].aabb;
+
+        return start + left_count;
+    }
+
+    u32 splitNodeFullSort(BVHNode &node, u32 start, u32 end, BVHNode *out_nodes, u32 &node_count) {
         u32 N = end - start;
         u32 *ids = node_ids + start;
 
-        node.first_index = bvh.node_count;
-        BVHNode &left_node  = bvh.nodes[bvh.node_count++];
-        BVHNode &right_node = bvh.nodes[bvh.node_count++];
+        node.first_index = node_count;
+        BVHNode &left_node  = out_nodes[node_count++];
+        BVHNode &right_node = out_nodes[node_count++];
         left_node = BVHNode{};
         right_node = BVHNode{};
 
@@ -192,77 +563,470 @@ struct BVHBuilder {
         return start + chosen_partition_axis.left_node_count;
     }
 
-    void build(BVH &bvh, u32 N, u16 max_leaf_size) {
+    // Quantizes the node centroids within their bounds and interleaves the bits of their axes into Morton codes,
+    // then radix sorts the node ids by their codes (leaving morton_codes in the same order as node_ids):
+    void sortByMortonCodes(u32 N) {
+        vec3 centroids_min{INFINITY}, centroids_max{-INFINITY};
+        getCentroidBounds(nodes, node_ids, N, centroids_min, centroids_max);
+
+        const u32 max_coordinate = (1 << (BVH_LBVH_MORTON_BITS / 3)) - 1;
+        vec3 scale;
+        for (u8 axis = 0; axis < 3; axis++) {
+            f32 extent = centroids_max.components[axis] - centroids_min.components[axis];
+            scale.components[axis] = extent > 0 ? (f32)max_coordinate / extent : 0;
+        }
+
+        for (u32 i = 0; i < N; i++) {
+            const AABB &aabb = nodes[node_ids[i]].aabb;
+            vec3 coordinates{(aabb.min + aabb.max - centroids_min) * scale};
+            morton_codes[i] = expandBitsForMortonCode((u64)coordinates.x) << 2 |
+                              expandBitsForMortonCode((u64)coordinates.y) << 1 |
+                              expandBitsForMortonCode((u64)coordinates.z);
+        }
+
+        // Least-significant digit first, so every (stable) pass keeps the order of the previous ones for equal digits:
+        u32 offsets[BVH_LBVH_RADIX_SIZE];
+        u64 *codes = morton_codes, *other_codes = sorting_codes, *swapped_codes;
+        u32 *ids = node_ids, *other_ids = scratch_ids, *swapped_ids;
+        for (u32 shift = 0; shift < BVH_LBVH_MORTON_BITS; shift += BVH_LBVH_RADIX_BITS) {
+            for (u32 d = 0; d < BVH_LBVH_RADIX_SIZE; d++) offsets[d] = 0;
+            for (u32 i = 0; i < N; i++) offsets[(codes[i] >> shift) & (BVH_LBVH_RADIX_SIZE - 1)]++;
+
+            u32 offset = 0, count;
+            for (u32 d = 0; d < BVH_LBVH_RADIX_SIZE; d++) {
+                count = offsets[d];
+                offsets[d] = offset;
+                offset += count;
+            }
+
+            for (u32 i = 0; i < N; i++) {
+                u32 target = offsets[(codes[i] >> shift) & (BVH_LBVH_RADIX_SIZE - 1)]++;
+                other_codes[target] = codes[i];
+                other_ids[target] = ids[i];
+            }
+
+            swapped_codes = codes; codes = other_codes; other_codes = swapped_codes;
+            swapped_ids = ids; ids = other_ids; other_ids = swapped_ids;
+        }
+
+        if (codes != morton_codes)
+            for (u32 i = 0; i < N; i++) {
+                morton_codes[i] = codes[i];
+                node_ids[i] = ids[i];
+            }
+    }
+
+    // The codes of a range are sorted and share all their bits above the highest bit in which its first and last
+    // codes differ, so the range is split where that bit becomes set (found by binary search):
+    u32 splitNodeLBVH(BVHNode &node, u32 start, u32 end, BVHNode *out_nodes, u32 &node_count) {
+        node.first_index = node_count;
+        out_nodes[node_count++] = BVHNode{};
+        out_nodes[node_count++] = BVHNode{};
+
+        u64 first_code = morton_codes[start];
+        u64 last_code = morton_codes[end - 1];
+        if (first_code == last_code)
+            return start + (end - start) / 2;
+
+        u64 split_bit = getHighestBit(first_code ^ last_code);
+        u32 low = start, high = end - 1, middle;
+        while (low + 1 < high) {
+            middle = (low + high) / 2;
+            if (morton_codes[middle] & split_bit)
+                high = middle;
+            else
+                low = middle;
+        }
+
+        return high;
+    }
+
+    // Computes the bounds of every node of a built tree from its leaves' nodes (children are stored after parents):
+    void computeBounds(BVH &bvh) {
+        for (u32 i = bvh.node_count; i-- > 0;) {
+            BVHNode &node = bvh.nodes[i];
+            if (node.leaf_count) {
+                node.aabb = AABB{INFINITY, -INFINITY};
+                for (u32 l = node.first_index; l < node.first_index + node.leaf_count; l++)
+                    node.aabb += nodes[node_ids[l]].aabb;
+            } else
+                node.aabb = bvh.nodes[node.first_index].aabb + bvh.nodes[node.first_index + 1].aabb;
+        }
+    }
+
+    // Lays a built tree out depth-first (keeping siblings adjacent and after their parent), descending into the child
+    // with the larger surface area first: The pair of nodes a ray is most likely to test next is then stored right
+    // after the pair it just tested, rather than wherever the build happened to emit it.
+    // Leaf ranges are renumbered in the same order (reordering the leaf ids), so primitives follow the nodes too:
+    void reorder(BVH &bvh) {
+        if (bvh.node_count < 3) return;
+
+        BVHNode *built_nodes = subtree_nodes;
+        for (u32 i = 0; i < bvh.node_count; i++) built_nodes[i] = bvh.nodes[i];
+
+        BVHBuildIteration *stack = iterations;
+        u32 top = 0, leaf_id_count = 0;
+        bvh.node_count = 1;
+        stack[top++].node_id = 0;
+        while (top) {
+            BVHNode &node = bvh.nodes[stack[--top].node_id];
+            if (node.leaf_count) {
+                for (u32 i = 0; i < node.leaf_count; i++) node_ids[leaf_id_count + i] = leaf_ids[node.first_index + i];
+                node.first_index = leaf_id_count;
+                leaf_id_count += node.leaf_count;
+                continue;
+            }
+
+            const BVHNode &left_node  = built_nodes[node.first_index];
+            const BVHNode &right_node = built_nodes[node.first_index + 1];
+            node.first_index = bvh.node_count;
+            bvh.nodes[bvh.node_count++] = left_node;
+            bvh.nodes[bvh.node_count++] = right_node;
+
+            // Push the larger child last so that its subtree gets laid out first:
+            bool left_is_larger = left_node.aabb.area() >= right_node.aabb.area();
+            stack[top++].node_id = node.first_index + left_is_larger;
+            stack[top++].node_id = node.first_index + !left_is_larger;
+        }
+
+        for (u32 i = 0; i < leaf_id_count; i++) leaf_ids[i] = node_ids[i];
+    }
+
+    INLINE static u32 getSpatialBinIndex(f32 position, f32 bounds_min, f32 bin_scale) {
+        u32 bin = (u32)Max(0, (position - bounds_min) * bin_scale);
+        return Min(bin, BVH_SAH_BIN_COUNT - 1);
+    }
+
+    void getTriangleVertices(u32 triangle_id, vec3 *vertices) const {
+        TriangleVertexIndices indices = splitting_mesh->vertex_position_indices[triangle_id];
+        for (u8 i = 0; i < 3; i++) vertices[i] = splitting_mesh->vertex_positions[indices.ids[i]];
+    }
+
+    // Splits the node by objects (binned SAH) and then, if that leaves its children overlapping, evaluates splitting
+    // the node's space instead: Triangles get binned into every bin they span (clipped to each), and each plane between
+    // bins is evaluated using the references entering bins to its left and exiting bins to its right.
+    // Returns where the right child's range starts, and sets where it ends (growing past the node's own end when
+    // references were split in two):
+    u32 splitNodeSpatially(BVHNode &node, u32 start, u32 end, BVHNode *out_nodes, u32 &node_count, u32 &new_end) {
+        u32 N = end - start;
+        u32 middle = splitNodeBinned(node, start, end, out_nodes, node_count, bins, false);
+        BVHNode &left_node  = out_nodes[node.first_index];
+        BVHNode &right_node = out_nodes[node.first_index + 1];
+        new_end = end;
+
+        AABB overlap{maximum(left_node.aabb.min, right_node.aabb.min), minimum(left_node.aabb.max, right_node.aabb.max)};
+        if (isEmpty(overlap) || overlap.area() <= min_overlap_area)
+            return middle;
+
+        f32 object_split_cost = left_node.aabb.area() * (f32)(middle - start) + right_node.aabb.area() * (f32)(end - middle);
+        f32 smallest_cost = object_split_cost;
+        u32 chosen_split = 0, chosen_left_count = 0, chosen_right_count = 0;
+        u8 chosen_axis = 0;
+
+        const AABB &bounds = node.aabb;
+        vec3 extents{bounds.max - bounds.min};
+        vec3 vertices[3];
+        for (u8 axis = 0; axis < 3; axis++) {
+            f32 extent = extents.components[axis];
+            if (extent <= 0) continue;
+
+            f32 bounds_min = bounds.min.components[axis];
+            f32 bin_size = extent / (f32)BVH_SAH_BIN_COUNT;
+            f32 bin_scale = (f32)BVH_SAH_BIN_COUNT / extent;
+            BVHSpatialBin *axis_bins = spatial_bins + axis * BVH_SAH_BIN_COUNT;
+            for (u32 b = 0; b < BVH_SAH_BIN_COUNT; b++) axis_bins[b] = {AABB{INFINITY, -INFINITY}, 0, 0};
+
+            for (u32 i = start; i < end; i++) {
+                const BVHNode &reference = nodes[node_ids[i]];
+                u32 first_bin = getSpatialBinIndex(reference.aabb.min.components[axis], bounds_min, bin_scale);
+                u32 last_bin  = getSpatialBinIndex(reference.aabb.max.components[axis], bounds_min, bin_scale);
+                axis_bins[first_bin].entries++;
+                axis_bins[last_bin].exits++;
+                if (first_bin == last_bin) {
+                    axis_bins[first_bin].aabb += reference.aabb;
+                    continue;
+                }
+
+                getTriangleVertices(reference.first_index, vertices);
+                for (u32 b = first_bin; b <= last_bin; b++) {
+                    f32 from = b == first_bin ? -INFINITY : bounds_min + (f32)b * bin_size;
+                    f32 to   = b == last_bin  ?  INFINITY : bounds_min + (f32)(b + 1) * bin_size;
+                    AABB clipped{getClippedTriangleBounds(vertices, axis, from, to, reference.aabb)};
+                    if (!isEmpty(clipped)) axis_bins[b].aabb += clipped;
+                }
+            }
+
+            // Sweep from the right to gather the cost of each right side, then from the left to evaluate each split:
+            f32 right_costs[BVH_SAH_BIN_COUNT];
+            u32 right_counts[BVH_SAH_BIN_COUNT];
+            AABB side{INFINITY, -INFINITY};
+            u32 side_count = 0;
+            for (u32 b = BVH_SAH_BIN_COUNT - 1; b > 0; b--) {
+                side += axis_bins[b].aabb;
+                side_count += axis_bins[b].exits;
+                right_counts[b] = side_count;
+                right_costs[b] = side_count ? side.area() * (f32)side_count : INFINITY;
+            }
+
+            side = AABB{INFINITY, -INFINITY};
+            side_count = 0;
+            for (u32 split = 1; split < BVH_SAH_BIN_COUNT; split++) {
+                side += axis_bins[split - 1].aabb;
+                side_count += axis_bins[split - 1].entries;
+                if (!side_count || side_count == N || right_counts[split] == N) continue;
+                if (reference_count + side_count + right_counts[split] - N > max_reference_count) continue;
+
+                f32 cost = side.area() * (f32)side_count + right_costs[split];
+                if (cost < smallest_cost) {
+                    smallest_cost = cost;
+                    chosen_split = split;
+                    chosen_axis = axis;
+                    chosen_left_count = side_count;
+                    chosen_right_count = right_counts[split];
+                }
+            }
+        }
+        if (smallest_cost == object_split_cost)
+            return middle;
+
+        // Partition the references into the scratch ids (left ones from the start, right ones from the end),
+        // clipping those that span the chosen plane into a reference on each side:
+        f32 bounds_min = bounds.min.components[chosen_axis];
+        f32 bin_scale = (f32)BVH_SAH_BIN_COUNT / extents.components[chosen_axis];
+        f32 plane = bounds_min + (f32)chosen_split * (extents.components[chosen_axis] / (f32)BVH_SAH_BIN_COUNT);
+        u32 left_count = 0, right_count = 0, total_count = chosen_left_count + chosen_right_count;
+        left_node.aabb = right_node.aabb = AABB{INFINITY, -INFINITY};
+        for (u32 i = start; i < end; i++) {
+            u32 node_id = node_ids[i];
+            BVHNode &reference = nodes[node_id];
+            u32 first_bin = getSpatialBinIndex(reference.aabb.min.components[chosen_axis], bounds_min, bin_scale);
+            u32 last_bin  = getSpatialBinIndex(reference.aabb.max.components[chosen_axis], bounds_min, bin_scale);
+            bool goes_left = last_bin < chosen_split;
+            if (first_bin < chosen_split && last_bin >= chosen_split) {
+                getTriangleVertices(reference.first_index, vertices);
+                AABB left_part{ getClippedTriangleBounds(vertices, chosen_axis, -INFINITY, plane, reference.aabb)};
+                AABB right_part{getClippedTriangleBounds(vertices, chosen_axis, plane, INFINITY, reference.aabb)};
+                if (isEmpty(left_part) && isEmpty(right_part)) left_part = reference.aabb;
+                goes_left = !isEmpty(left_part);
+                if (goes_left && !isEmpty(right_part)) {
+                    BVHNode &right_reference = nodes[reference_count];
+                    right_reference.aabb = right_part;
+                    right_reference.first_index = reference.first_index;
+                    thickenFlatAxes(right_reference.aabb);
+                    right_node.aabb += right_reference.aabb;
+                    scratch_ids[total_count - ++right_count] = reference_count++;
+                }
+                reference.aabb = goes_left ? left_part : right_part;
+                thickenFlatAxes(reference.aabb);
+            }
+            if (goes_left) {
+                left_node.aabb += reference.aabb;
+                scratch_ids[left_count++] = node_id;
+            } else {
+                right_node.aabb += reference.aabb;
+                scratch_ids[total_count - ++right_count] = node_id;
+            }
+        }
+
+        // References that turned out to lie on one side only leave a gap between the left and right ones:
+        for (u32 i = 0; i < left_count; i++) node_ids[start + i] = scratch_ids[i];
+        for (u32 i = 0; i < right_count; i++) node_ids[start + left_count + i] = scratch_ids[total_count - right_count + i];
+        new_end = start + left_count + right_count;
+        if (left_count && right_count)
+            return start + left_count;
+
+        // Clipping can leave all references on one side (when none of those spanning the plane actually cross it):
+        left_count = (new_end - start) / 2;
+        left_node.aabb = right_node.aabb = AABB{INFINITY, -INFINITY};
+        for (u32 i = start; i < new_end; i++)
+            (i < start + left_count ? left_node : right_node).aabb += nodes[node_ids[i]].aabb;
+
+        return start + left_count;
+    }
+
+    // Builds the BVH of a mesh depth-first with spatial splits, from references to its triangles in the builder's nodes.
+    // Leaves are emitted into leaf_ids as they are reached (referring to the triangles), and the reference count
+    // becomes the number of leaf_ids:
+    void buildWithSpatialSplits(BVH &bvh, const Mesh &mesh, u16 max_leaf_size) {
+        u32 N = mesh.triangle_count;
+        splitting_mesh = &mesh;
+        reference_count = N;
+        max_reference_count = getMaxTriangleReferenceCount(N);
         bvh.height = 1;
         bvh.node_count = 1;
 
         BVHNode &root = bvh.nodes[0];
         root = BVHNode{};
+        root.aabb = AABB{INFINITY, -INFINITY};
+        for (u32 i = 0; i < N; i++) root.aabb += nodes[i].aabb;
+        min_overlap_area = root.aabb.area() * BVH_SPATIAL_SPLITS_MIN_OVERLAP;
 
-        if (N <= max_leaf_size) {
-            root.leaf_count = (u16)N;
-            root.aabb.min = INFINITY;
-            root.aabb.max = -INFINITY;
+        // The right child's range is laid out last, so it gets popped first:
+        BVHBuildIteration *stack = iterations;
+        BVHBuildIteration current;
+        u32 middle, end, leaf_id_count = 0, top = 0;
+        stack[top++] = {0, N, 0, 0};
+        while (top) {
+            current = stack[--top];
+            BVHNode &node = bvh.nodes[current.node_id];
+            node.depth = current.depth;
+            if (current.depth > bvh.height) bvh.height = current.depth;
 
-            BVHNode *builder_node = nodes;
-            for (u32 i = 0; i < N; i++, builder_node++) {
-                leaf_ids[i] = builder_node->first_index;
-                root.aabb += builder_node->aabb;
+            u32 count = current.end - current.start;
+            if (count <= max_leaf_size) {
+                node.leaf_count = (u16)count;
+                node.first_index = leaf_id_count;
+                for (u32 i = current.start; i < current.end; i++)
+                    leaf_ids[leaf_id_count++] = nodes[node_ids[i]].first_index;
+            } else {
+                middle = splitNodeSpatially(node, current.start, current.end, bvh.nodes, bvh.node_count, end);
+                stack[top++] = {current.start, middle, node.first_index, (u8)(current.depth + 1)};
+                stack[top++] = {middle, end, node.first_index + 1, (u8)(current.depth + 1)};
             }
-
-            return;
         }
 
-        u32 middle = splitNode(root, 0, N, bvh);
-        BVHBuildIteration *stack = iterations;
-        u32 *node_id;
+        splitting_mesh = nullptr;
+    }
 
-        BVHBuildIteration left{0, middle, 1, 1};
-        BVHBuildIteration right{middle, N, 2, 1};
+    static void buildSubtreeTask(void *builder, u32 task_index, u32 thread_index) {
+        ((BVHBuilder*)builder)->buildSubtree(task_index, thread_index);
+    }
 
-        stack[0] = left;
-        stack[1] = right;
+    // Builds a subtree depth-first into its own region of the subtree nodes (its root first),
+    // using the range of the iterations that matches its range of node_ids as its stack:
+    void buildSubtree(u32 subtree_index, u32 thread_index) {
+        const BVHBuildIteration &root = subtrees[subtree_index];
+        BVHNode *subtree = subtree_nodes + 2 * root.start;
+        BVHBuildIteration *stack = iterations + root.start;
+        BVHBin *bins_of_thread = thread_bins + thread_index * 3 * BVH_SAH_BIN_COUNT;
+        BVHBuildIteration left, right;
+        u32 N, middle, node_count = 1;
+        u8 height = root.depth;
 
-        i32 stack_size = 1;
-        u32 leaf_count = 0;;
+        subtree[0] = building_bvh->nodes[root.node_id];
+        stack[0] = {root.start, root.end, 0, root.depth};
 
+        i32 stack_size = 0;
         while (stack_size >= 0) {
             left = stack[stack_size];
-            BVHNode &node = bvh.nodes[left.node_id];
+            BVHNode &node = subtree[left.node_id];
+            node.depth = left.depth;
             N = left.end - left.start;
-            if (N <= max_leaf_size) {
-                node.depth = left.depth;
+            if (N <= building_max_leaf_size) {
                 node.leaf_count = (u16)N;
-                node.first_index = leaf_count;
-
-                node_id = node_ids + left.start;
-                for (u32 i = 0; i < N; i++, node_id++)
-                    leaf_ids[leaf_count + i] = nodes[*node_id].first_index;
-                leaf_count += N;
+                node.first_index = left.start;
                 stack_size--;
             } else {
-                middle = splitNode(node, left.start, left.end, bvh);
+                middle = splitNode(node, left.start, left.end, subtree, node_count, bins_of_thread);
                 left.depth++;
                 right.depth = left.depth;
                 right.end = left.end;
                 right.start = left.end = middle;
                 left.node_id  = node.first_index;
                 right.node_id = node.first_index + 1;
-                bvh.nodes[bvh.node_count - 1].depth = left.depth;
-                bvh.nodes[bvh.node_count - 2].depth = right.depth;
                 stack[  stack_size] = left;
                 stack[++stack_size] = right;
-                if (left.depth > bvh.height) bvh.height = left.depth;
+                if (left.depth > height) height = left.depth;
             }
         }
 
+        subtree_node_counts[subtree_index] = node_count;
+        subtree_heights[subtree_index] = height;
+    }
+
+    void build(BVH &bvh, u32 N, u16 max_leaf_size, ThreadPool *pool = nullptr) {
+        // The full-sort strategy shares its sorting scratch memory, so it always builds on a single thread:
+        thread_pool = strategy != BVHBuildStrategy_FullSort ? pool : nullptr;
+        building_bvh = &bvh;
+        building_max_leaf_size = max_leaf_size;
+        subtree_count = 0;
+        bvh.height = 1;
+        bvh.node_count = 1;
+
+        BVHNode &root = bvh.nodes[0];
+        root = BVHNode{};
+
+        if (N <= max_leaf_size) {
+            root.leaf_count = (u16)N;
+            root.aabb.min = INFINITY;
+            root.aabb.max = -INFINITY;
+
+            BVHNode *builder_node = nodes;
+            for (u32 i = 0; i < N; i++, builder_node++) {
+                leaf_ids[i] = builder_node->first_index;
+                root.aabb += builder_node->aabb;
+            }
+
+            return;
+        }
+
+        if (strategy == BVHBuildStrategy_LBVH)
+            sortByMortonCodes(N);
+
+        // Split the top of the tree breadth-first (using the iterations as a queue),
+        // deferring ranges that are small enough to be built as independent subtrees.
+        // The queued ranges are disjoint, so at most N are queued at once and the queue wraps around within N:
+        BVHBuildIteration *queue = iterations;
+        BVHBuildIteration current;
+        u32 middle, head = 0, tail = 1, queued = 1;
+        queue[0] = {0, N, 0, 0};
+        while (queued) {
+            current = queue[head];
+            head = (head + 1) % N;
+            queued--;
+            BVHNode &node = bvh.nodes[current.node_id];
+            node.depth = current.depth;
+            if (current.depth > bvh.height) bvh.height = current.depth;
+
+            u32 count = current.end - current.start;
+            if (count <= max_leaf_size) {
+                node.leaf_count = (u16)count;
+                node.first_index = current.start;
+            } else if (count <= BVH_BUILDER_SUBTREE_SIZE)
+                subtrees[subtree_count++] = current;
+            else {
+                middle = splitNode(node, current.start, current.end, bvh.nodes, bvh.node_count, bins, true);
+                queue[tail] = {current.start, middle, node.first_index, (u8)(current.depth + 1)};
+                tail = (tail + 1) % N;
+                queue[tail] = {middle, current.end, node.first_index + 1, (u8)(current.depth + 1)};
+                tail = (tail + 1) % N;
+                queued += 2;
+            }
+        }
+
+        if (thread_pool && thread_pool->thread_count > 1 && subtree_count > 1)
+            thread_pool->run(subtree_count, buildSubtreeTask, this);
+        else
+            for (u32 i = 0; i < subtree_count; i++)
+                buildSubtree(i, 0);
+
+        // Append the subtrees in order, moving each subtree's root into the node that was reserved for it:
+        for (u32 s = 0; s < subtree_count; s++) {
+            const BVHBuildIteration &subtree_root = subtrees[s];
+            BVHNode *subtree = subtree_nodes + 2 * subtree_root.start;
+            u32 offset = bvh.node_count - 1;
+            for (u32 i = 0; i < subtree_node_counts[s]; i++) {
+                BVHNode &node = bvh.nodes[i ? offset + i : subtree_root.node_id];
+                node = subtree[i];
+                if (!node.leaf_count) node.first_index += offset;
+            }
+            bvh.node_count += subtree_node_counts[s] - 1;
+            if (subtree_heights[s] > bvh.height) bvh.height = subtree_heights[s];
+        }
+
+        for (u32 i = 0; i < N; i++)
+            leaf_ids[i] = nodes[node_ids[i]].first_index;
+
         BVHNode &left_node = bvh.nodes[1];
         BVHNode &right_node = bvh.nodes[2];
         left_node.depth = right_node.depth = 1;
-        root.aabb = left_node.aabb + right_node.aabb;
+        if (strategy == BVHBuildStrategy_LBVH)
+            computeBounds(bvh);
+        else
+            root.aabb = left_node.aabb + right_node.aabb;
     }
 
-    void buildMesh(Mesh &mesh) {
+    void buildMesh(Mesh &mesh, ThreadPool *pool = nullptr, u16 max_leaf_size = MAX_TRIANGLES_PER_MESH_BVH_NODE) {
         vec3 v1, v2, v3;
         TriangleVertexIndices indices{};
 
@@ -275,34 +1039,29 @@ struct BVHBuilder {
             v2 = mesh.vertex_positions[indices.ids[1]];
             v3 = mesh.vertex_positions[indices.ids[2]];
 
-            vec3 &min = node->aabb.min;
-            vec3 &max = node->aabb.max;
-            min = minimum(minimum(v1, v2), v3);
-            max = maximum(maximum(v1, v2), v3);
-
-            f32 diff = max.x - min.x;
-            if (diff < 0) diff = -diff;
-            if (diff < EPS) {
-                min.x -= EPS;
-                max.x += EPS;
-            }
+            node->aabb.min = minimum(minimum(v1, v2), v3);
+            node->aabb.max = maximum(maximum(v1, v2), v3);
+            thickenFlatAxes(node->aabb);
+        }
 
-            diff = max.y - min.y;
-            if (diff < 0) diff = -diff;
-            if (diff < EPS) {
-                min.y -= EPS;
-                max.y += EPS;
+        if (strategy == BVHBuildStrategy_SpatialSplits) {
+            // Triangles referenced more than once are stored once per reference, with the extra references appended
+            // to the vertex indices (which the mesh must have room for, see getMaxTriangleReferenceCount):
+            u32 triangle_count = mesh.triangle_count;
+            buildWithSpatialSplits(mesh.bvh, mesh, max_leaf_size);
+            for (u32 i = triangle_count; i < reference_count; i++) {
+                u32 source_id = nodes[i].first_index;
+                mesh.vertex_position_indices[i] = mesh.vertex_position_indices[source_id];
+                if (mesh.normals_count) mesh.vertex_normal_indices[i] = mesh.vertex_normal_indices[source_id];
+                if (mesh.uvs_count) mesh.vertex_uvs_indices[i] = mesh.vertex_uvs_indices[source_id];
             }
+            mesh.triangle_count = reference_count;
+        } else
+            build(mesh.bvh, mesh.triangle_count, max_leaf_size, pool);
 
-            diff = max.z - min.z;
-            if (diff < 0) diff = -diff;
-            if (diff < EPS) {
-                min.z -= EPS;
-                max.z += EPS;
-            }
-        }
+        // Triangles are stored in the order of the leaves, so lay both out for traversal:
+        reorder(mesh.bvh);
 
-        build(mesh.bvh, mesh.triangle_count, MAX_TRIANGLES_PER_MESH_BVH_NODE);
         f32 area_of_uv, area_of_parallelogram;
         u32 *triangle_id = leaf_ids;
         for (u32 i = 0; i < mesh.triangle_count; i++, triangle_id++) {
@@ -338,5 +1097,8 @@ struct BVHBuilder {
                 triangle.uv_coverage = fabsf(area_of_uv / area_of_parallelogram);
             }
         }
+
+        updateTriangleBlocks(mesh);
+        collapseBVH(mesh.bvh, mesh.wide_bvh);
     }
 };
\ No newline at end of file
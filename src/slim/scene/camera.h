@@ -61,11 +61,36 @@ struct CameraRayProjection {
     vec3 start, right, down, camera_position;
     vec2 C_start;
     f32 squared_distance_to_projection_plane;
+    f32 distance_to_projection_plane;
     f32 sample_size;
 
     INLINE_XPU f32 getDepthAt(vec3 &position) const { return (inverted_camera_rotation * (position - camera_position)).z; }
     INLINE_XPU vec3 getRayDirectionAt(i32 x, i32 y) const { return start + down*y + right*x; }
 
+    // The scaling factor of a primary ray's hits (for their texture cone widths) through the given coordinates:
+    INLINE_XPU f32 getScalingFactorAt(i32 x, i32 y) const {
+        return 1.0f / sqrtf(squared_distance_to_projection_plane + vec2{x, -y}.scaleAdd(sample_size, C_start).squaredLength());
+    }
+
+    // The position at the given depth (or just the direction, for infinite depths) seen through the given coordinates:
+    INLINE_XPU vec3 getPositionAt(const vec2 &coords, f32 depth) const {
+        vec3 direction{start + down*coords.y + right*coords.x};
+        return depth == INFINITY ? direction : direction.scaleAdd(depth / distance_to_projection_plane, camera_position);
+    }
+
+    // The coordinates that a position (or direction, for infinite depths) is seen through, and its depth.
+    // Returns whether it is in front of the camera:
+    INLINE_XPU bool getCoordsOf(const vec3 &position, bool is_at_infinity, vec2 &coords, f32 &depth) const {
+        vec3 local{inverted_camera_rotation * (is_at_infinity ? position : (position - camera_position))};
+        if (local.z <= 0.0f) return false;
+
+        f32 to_projection_plane = distance_to_projection_plane / local.z;
+        coords.x = (local.x * to_projection_plane - C_start.x) / sample_size;
+        coords.y = (C_start.y - local.y * to_projection_plane) / sample_size;
+        depth = is_at_infinity ? INFINITY : local.z;
+        return true;
+    }
+
     void reset(const Camera &camera, const Dimensions &dim, bool antialias) {
         sample_size = antialias ? 0.5f : 1.0f;
         squared_distance_to_projection_plane = dim.h_height * camera.focal_length;
@@ -79,6 +104,7 @@ struct CameraRayProjection {
         start = camera.orientation.right   * C_start.x +
                 camera.orientation.up      * C_start.y +
                 camera.orientation.forward * squared_distance_to_projection_plane;
+        distance_to_projection_plane = squared_distance_to_projection_plane;
         squared_distance_to_projection_plane *= squared_distance_to_projection_plane;
     }
 };
\ No newline at end of file
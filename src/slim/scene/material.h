@@ -22,6 +22,7 @@ struct Light {
 
     INLINE_XPU bool isDirectional() const { return flags & Light_IsDirectional; }
     INLINE_XPU bool isPoint() const { return !(isDirectional()); }
+    INLINE_XPU f32 power() const { return intensity * color.luminance(); }
 };
 
 INLINE_XPU f32 ggxTrowbridgeReitz_D(f32 roughness, f32 NdotH) { // NDF
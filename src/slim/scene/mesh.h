@@ -23,10 +23,31 @@ struct Triangle {
     f32 uv_coverage, padding;
 };
 
+// The triangles of a mesh in groups of TRIANGLE_BLOCK_SIZE in SoA layout (one array per component), for intersecting
+// a ray with a whole group at once. Each BVH leaf's triangles start a new block, so that a leaf is intersected with
+// as few blocks as it can be: Lane i of a leaf's k'th block holds its (k * TRIANGLE_BLOCK_SIZE + i)'th triangle,
+// with lanes past its last triangle holding degenerate (zero-area) triangles that can never be hit.
+struct TriangleBlock {
+    f32 position_x[TRIANGLE_BLOCK_SIZE], position_y[TRIANGLE_BLOCK_SIZE], position_z[TRIANGLE_BLOCK_SIZE];
+    f32 edge1_x[TRIANGLE_BLOCK_SIZE], edge1_y[TRIANGLE_BLOCK_SIZE], edge1_z[TRIANGLE_BLOCK_SIZE]; // v2 - v1
+    f32 edge2_x[TRIANGLE_BLOCK_SIZE], edge2_y[TRIANGLE_BLOCK_SIZE], edge2_z[TRIANGLE_BLOCK_SIZE]; // v3 - v1
+};
+
+// How many blocks the triangles of a mesh with a BVH of the given node count can take at most:
+// A binary BVH has up to (node_count + 1) / 2 leaves, each leaving up to TRIANGLE_BLOCK_SIZE - 1 lanes unused.
+INLINE_XPU u32 getMaxTriangleBlockCount(u32 triangle_count, u32 bvh_node_count) {
+    u64 leaf_count = Max(Min((bvh_node_count + 1) / 2, triangle_count), 1);
+    return (u32)(((u64)triangle_count + (TRIANGLE_BLOCK_SIZE - 1) * leaf_count) / TRIANGLE_BLOCK_SIZE);
+}
+
 struct Mesh {
     AABB aabb;
     BVH bvh;
+    WideBVH wide_bvh;
     Triangle *triangles;
+    TriangleBlock *triangle_blocks{nullptr};
+    u32 *triangle_block_ids{nullptr}; // The block holding each triangle (see TriangleBlock)
+    u32 triangle_block_count{0};
 
     vec3 *vertex_positions{nullptr};
     vec3 *vertex_normals{nullptr};
@@ -83,6 +104,45 @@ struct Mesh {
 };
 
 
+// Fills the triangle blocks from the (already BVH-ordered) triangles, a leaf at a time.
+// The edges are recovered from the triangles' tangent-space matrices (their inverse has them as its X and Y axes):
+void updateTriangleBlocks(Mesh &mesh) {
+    if (!mesh.triangle_blocks) return;
+
+    mesh.triangle_block_count = 0;
+    for (u32 n = 0; n < mesh.bvh.node_count; n++) {
+        const BVHNode &node = mesh.bvh.nodes[n];
+        if (!node.leaf_count) continue;
+
+        u32 end = node.first_index + node.leaf_count;
+        for (u32 first_triangle_id = node.first_index; first_triangle_id < end; first_triangle_id += TRIANGLE_BLOCK_SIZE) {
+            TriangleBlock &block = mesh.triangle_blocks[mesh.triangle_block_count];
+            for (u32 i = 0; i < TRIANGLE_BLOCK_SIZE; i++) {
+                u32 triangle_id = first_triangle_id + i;
+                vec3 position{0.0f}, edge1{0.0f}, edge2{0.0f};
+                if (triangle_id < end) {
+                    const Triangle &triangle = mesh.triangles[triangle_id];
+                    mat3 tangent_to_local{triangle.local_to_tangent.inverted()};
+                    position = triangle.position;
+                    edge1 = tangent_to_local.Y;
+                    edge2 = tangent_to_local.X;
+                    mesh.triangle_block_ids[triangle_id] = mesh.triangle_block_count;
+                }
+                block.position_x[i] = position.x;
+                block.position_y[i] = position.y;
+                block.position_z[i] = position.z;
+                block.edge1_x[i] = edge1.x;
+                block.edge1_y[i] = edge1.y;
+                block.edge1_z[i] = edge1.z;
+                block.edge2_x[i] = edge2.x;
+                block.edge2_y[i] = edge2.y;
+                block.edge2_z[i] = edge2.z;
+            }
+            mesh.triangle_block_count++;
+        }
+    }
+}
+
 struct CubeMesh : Mesh {
     const vec3 CUBE_VERTEX_POSITIONS[CUBE_VERTEX_COUNT] = {
             {-1, -1, -1},
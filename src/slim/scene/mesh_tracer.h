@@ -48,17 +48,244 @@ struct MeshTracer {
         return found_triangle;
     }
 
+    // Intersects the ray with a leaf's triangles a block at a time (Moller-Trumbore), starting at the leaf's first block.
+    // The resulting hit id is the index of the triangle in the mesh:
+    INLINE_XPU bool hitTriangleBlocks(const Mesh &mesh, u32 first_triangle, u32 triangle_count, f32 closest_distance, const Ray &ray, RayHit &hit, bool any_hit) const {
+        f32 distances[TRIANGLE_BLOCK_SIZE], us[TRIANGLE_BLOCK_SIZE], vs[TRIANGLE_BLOCK_SIZE], dets[TRIANGLE_BLOCK_SIZE];
+        f32 closest_u = 0, closest_v = 0, closest_det = 0;
+        u32 closest_id = 0, triangle_id, end = first_triangle + triangle_count;
+        u32 block_id = mesh.triangle_block_ids[first_triangle];
+        bool found_triangle = false;
+        const vec3 &Ro = ray.origin;
+        const vec3 &Rd = ray.direction;
+        closest_distance = Min(closest_distance, hit.distance);
+
+        for (u32 block_first_triangle = first_triangle; block_first_triangle < end; block_first_triangle += TRIANGLE_BLOCK_SIZE, block_id++) {
+            const TriangleBlock &block = mesh.triangle_blocks[block_id];
+            for (u32 i = 0; i < TRIANGLE_BLOCK_SIZE; i++) {
+                f32 p_x = Rd.y * block.edge2_z[i] - Rd.z * block.edge2_y[i];
+                f32 p_y = Rd.z * block.edge2_x[i] - Rd.x * block.edge2_z[i];
+                f32 p_z = Rd.x * block.edge2_y[i] - Rd.y * block.edge2_x[i];
+                f32 det = block.edge1_x[i] * p_x + block.edge1_y[i] * p_y + block.edge1_z[i] * p_z;
+                f32 one_over_det = 1.0f / det;
+
+                f32 t_x = Ro.x - block.position_x[i];
+                f32 t_y = Ro.y - block.position_y[i];
+                f32 t_z = Ro.z - block.position_z[i];
+                f32 u = (t_x * p_x + t_y * p_y + t_z * p_z) * one_over_det;
+
+                f32 q_x = t_y * block.edge1_z[i] - t_z * block.edge1_y[i];
+                f32 q_y = t_z * block.edge1_x[i] - t_x * block.edge1_z[i];
+                f32 q_z = t_x * block.edge1_y[i] - t_y * block.edge1_x[i];
+                f32 v = (Rd.x * q_x + Rd.y * q_y + Rd.z * q_z) * one_over_det;
+                f32 t = (block.edge2_x[i] * q_x + block.edge2_y[i] * q_y + block.edge2_z[i] * q_z) * one_over_det;
+
+                // Degenerate lanes (and rays parallel to the triangle) have a zero determinant.
+                // Conditions are combined without short-circuiting to keep the loop branch-free (and vectorizable):
+                distances[i] = ((det != 0) & (u >= 0) & (v >= 0) & ((u + v) <= 1) & (t > 0)) ? t : INFINITY;
+                us[i] = u;
+                vs[i] = v;
+                dets[i] = det;
+            }
+
+            // Lanes past the leaf's last triangle are degenerate, so never closer:
+            triangle_id = block_first_triangle;
+            for (u32 i = 0; i < TRIANGLE_BLOCK_SIZE; i++, triangle_id++) {
+                if (distances[i] >= closest_distance)
+                    continue;
+
+                closest_distance = distances[i];
+                closest_u = us[i];
+                closest_v = vs[i];
+                closest_det = dets[i];
+                closest_id = triangle_id;
+                found_triangle = true;
+
+                if (any_hit)
+                    break;
+            }
+
+            if (found_triangle && any_hit)
+                break;
+        }
+
+        if (found_triangle) {
+            const Triangle &triangle = mesh.triangles[closest_id];
+            hit.distance = closest_distance;
+            hit.position = ray.at(closest_distance);
+            hit.normal = triangle.normal;
+            hit.from_behind = closest_det > 0; // The ray travels along the normal, so it hit the back of the triangle
+            hit.uv.x = closest_v; // Weight of the 3rd vertex
+            hit.uv.y = closest_u; // Weight of the 2nd vertex
+            hit.uv_coverage = triangle.uv_coverage;
+            hit.id = closest_id;
+        }
+
+        return found_triangle;
+    }
+
+    // Whether any of a leaf's triangles blocks the ray closer than the given distance (a block at a time, as above),
+    // without computing anything about the hit:
+    INLINE_XPU bool occludedByTriangleBlocks(const Mesh &mesh, u32 first_triangle, u32 triangle_count, f32 max_distance, const Ray &ray) const {
+        f32 distances[TRIANGLE_BLOCK_SIZE];
+        u32 block_id = mesh.triangle_block_ids[first_triangle];
+        u32 block_count = (triangle_count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+        const vec3 &Ro = ray.origin;
+        const vec3 &Rd = ray.direction;
+
+        for (u32 end = block_id + block_count; block_id < end; block_id++) {
+            const TriangleBlock &block = mesh.triangle_blocks[block_id];
+            for (u32 i = 0; i < TRIANGLE_BLOCK_SIZE; i++) {
+                f32 p_x = Rd.y * block.edge2_z[i] - Rd.z * block.edge2_y[i];
+                f32 p_y = Rd.z * block.edge2_x[i] - Rd.x * block.edge2_z[i];
+                f32 p_z = Rd.x * block.edge2_y[i] - Rd.y * block.edge2_x[i];
+                f32 det = block.edge1_x[i] * p_x + block.edge1_y[i] * p_y + block.edge1_z[i] * p_z;
+                f32 one_over_det = 1.0f / det;
+
+                f32 t_x = Ro.x - block.position_x[i];
+                f32 t_y = Ro.y - block.position_y[i];
+                f32 t_z = Ro.z - block.position_z[i];
+                f32 u = (t_x * p_x + t_y * p_y + t_z * p_z) * one_over_det;
+
+                f32 q_x = t_y * block.edge1_z[i] - t_z * block.edge1_y[i];
+                f32 q_y = t_z * block.edge1_x[i] - t_x * block.edge1_z[i];
+                f32 q_z = t_x * block.edge1_y[i] - t_y * block.edge1_x[i];
+                f32 v = (Rd.x * q_x + Rd.y * q_y + Rd.z * q_z) * one_over_det;
+                f32 t = (block.edge2_x[i] * q_x + block.edge2_y[i] * q_y + block.edge2_z[i] * q_z) * one_over_det;
+                distances[i] = ((det != 0) & (u >= 0) & (v >= 0) & ((u + v) <= 1) & (t > 0)) ? t : INFINITY;
+            }
+
+            for (u32 i = 0; i < TRIANGLE_BLOCK_SIZE; i++)
+                if (distances[i] < max_distance)
+                    return true;
+        }
+
+        return false;
+    }
+
+    INLINE_XPU bool occludedByLeaf(const Mesh &mesh, u32 first_triangle, u32 triangle_count, f32 max_distance, const Ray &ray) const {
+        if (mesh.triangle_blocks)
+            return occludedByTriangleBlocks(mesh, first_triangle, triangle_count, max_distance, ray);
+
+        RayHit hit;
+        hit.distance = max_distance;
+        return hitTriangles(mesh.triangles + first_triangle, triangle_count, max_distance, ray, hit, true);
+    }
+
+    INLINE_XPU bool hitLeaf(const Mesh &mesh, u32 first_triangle, u32 triangle_count, f32 closest_distance, const Ray &ray, RayHit &hit, bool any_hit) const {
+        if (mesh.triangle_blocks)
+            return hitTriangleBlocks(mesh, first_triangle, triangle_count, closest_distance, ray, hit, any_hit);
+
+        if (!hitTriangles(mesh.triangles + first_triangle, triangle_count, closest_distance, ray, hit, any_hit))
+            return false;
+
+        hit.id += first_triangle;
+        return true;
+    }
+
     INLINE_XPU bool trace(const Mesh &mesh, Ray &ray, RayHit &hit, bool any_hit) {
+        bool found = traverseFromRoot(mesh, ray, hit, any_hit);
+        if (found && !any_hit) interpolateVertexAttributes(mesh, hit);
+        return found;
+    }
+
+    // Walks the wide BVH when there is one (and the binary one otherwise), leaving the vertex attributes uninterpolated:
+    INLINE_XPU bool traverseFromRoot(const Mesh &mesh, const Ray &ray, RayHit &hit, bool any_hit) {
+        return mesh.wide_bvh.nodes ? traverseWide(mesh, ray, hit, any_hit) : traverse(mesh, 0, ray, hit, any_hit);
+    }
+
+    // Whether any triangle blocks the ray closer than the given distance (for shadow rays): Nearest children are visited
+    // first, and the traversal stops at the first blocking triangle without computing anything about it:
+    INLINE_XPU bool isOccluded(const Mesh &mesh, const Ray &ray, f32 max_distance) {
+        if (!mesh.wide_bvh.nodes) {
+            RayHit hit;
+            hit.distance = max_distance;
+            return traverse(mesh, 0, ray, hit, true);
+        }
+
+        f32 near_distances[BVH_WIDTH], far_distances[BVH_WIDTH];
+        u8 hit_children[BVH_WIDTH], hit_count, child;
+        u32 node_id = 0, top = 0;
+
+        while (true) {
+            const WideBVHNode &node = mesh.wide_bvh.nodes[node_id];
+            hit_count = node.hitChildren(ray, max_distance, near_distances, far_distances, hit_children);
+
+            for (u8 i = 0; i < hit_count; i++) {
+                child = hit_children[i];
+                if (node.leaf_count[child] && occludedByLeaf(mesh, node.first_index[child], node.leaf_count[child], max_distance, ray))
+                    return true;
+            }
+
+            // Push inner children farthest first so that the nearest one is popped next:
+            for (u8 i = hit_count; i-- > 0;) {
+                child = hit_children[i];
+                if (!node.leaf_count[child])
+                    stack[top++] = node.first_index[child];
+            }
+
+            if (!top)
+                return false;
+
+            node_id = stack[--top];
+        }
+    }
+
+    // Which of the rays that are flagged as active (bit i for rays[i]) are blocked by a triangle closer than their
+    // max distance. The wide BVH is walked once for all of them: Each node is fetched once and its children are tested
+    // against every ray that entered it and is not blocked yet (see SceneTracer::findOccludedRays()).
+    // The rays that entered each node on the stack are kept in the given ray masks:
+    INLINE_XPU u32 findOccludedRays(const Mesh &mesh, const Ray *rays, const f32 *max_distances, u32 active, u32 *ray_masks) {
+        f32 near_distances[BVH_WIDTH], far_distances[BVH_WIDTH];
+        u32 child_masks[BVH_WIDTH], i, occluded = 0, node_id = 0, top = 0;
+        u8 hit_children[BVH_WIDTH], hit_count, child;
+
+        while (true) {
+            const WideBVHNode &node = mesh.wide_bvh.nodes[node_id];
+            for (child = 0; child < BVH_WIDTH; child++) child_masks[child] = 0;
+            for (u32 rays_left = active; rays_left; rays_left &= rays_left - 1) {
+                i = lowestSetBit(rays_left);
+                hit_count = node.hitChildren(rays[i], max_distances[i], near_distances, far_distances, hit_children);
+                for (u8 h = 0; h < hit_count; h++) child_masks[hit_children[h]] |= 1u << i;
+            }
+
+            for (child = 0; child < BVH_WIDTH; child++)
+                if (node.leaf_count[child])
+                    for (u32 rays_left = child_masks[child] & ~occluded; rays_left; rays_left &= rays_left - 1) {
+                        i = lowestSetBit(rays_left);
+                        if (occludedByLeaf(mesh, node.first_index[child], node.leaf_count[child], max_distances[i], rays[i]))
+                            occluded |= 1u << i;
+                    }
+
+            for (child = 0; child < BVH_WIDTH; child++)
+                if ((child_masks[child] & ~occluded) && !node.leaf_count[child]) {
+                    ray_masks[top] = child_masks[child];
+                    stack[top++] = node.first_index[child];
+                }
+
+            do {
+                if (!top)
+                    return occluded;
+
+                node_id = stack[--top];
+                active = ray_masks[top] & ~occluded;
+            } while (!active);
+        }
+    }
+
+    // Traverses the sub-tree of the given node (the whole BVH for the root node), without finalizing the hit:
+    INLINE_XPU bool traverse(const Mesh &mesh, u32 node_id, const Ray &ray, RayHit &hit, bool any_hit) {
         bool hit_left, hit_right, found = false;
         f32 left_near_distance, right_near_distance, left_far_distance, right_far_distance;
 
-        if (!(ray.hitsAABB(mesh.bvh.nodes->aabb, left_near_distance, left_far_distance) && left_near_distance < hit.distance))
+        BVHNode *node = mesh.bvh.nodes + node_id;
+        if (!(ray.hitsAABB(node->aabb, left_near_distance, left_far_distance) && left_near_distance < hit.distance))
             return false;
 
-        if (unlikely(mesh.bvh.nodes->leaf_count))
-            return hitTriangles(mesh.triangles, mesh.triangle_count, left_far_distance, ray, hit, any_hit);
+        if (unlikely(node->leaf_count))
+            return hitLeaf(mesh, node->first_index, node->leaf_count, left_far_distance, ray, hit, any_hit);
 
-        BVHNode *left_node = mesh.bvh.nodes + mesh.bvh.nodes->first_index;
+        BVHNode *left_node = mesh.bvh.nodes + node->first_index;
         BVHNode *right_node, *tmp_node;
         u32 top = 0;
 
@@ -70,8 +297,7 @@ struct MeshTracer {
 
             if (hit_left) {
                 if (unlikely(left_node->leaf_count)) {
-                    if (hitTriangles(mesh.triangles + left_node->first_index, left_node->leaf_count, left_far_distance, ray, hit, any_hit)) {
-                        hit.id += left_node->first_index;
+                    if (hitLeaf(mesh, left_node->first_index, left_node->leaf_count, left_far_distance, ray, hit, any_hit)) {
                         found = true;
                         if (any_hit)
                             break;
@@ -84,8 +310,7 @@ struct MeshTracer {
 
             if (hit_right) {
                 if (unlikely(right_node->leaf_count)) {
-                    if (hitTriangles(mesh.triangles + right_node->first_index, right_node->leaf_count, right_far_distance, ray, hit, any_hit)) {
-                        hit.id += right_node->first_index;
+                    if (hitLeaf(mesh, right_node->first_index, right_node->leaf_count, right_far_distance, ray, hit, any_hit)) {
                         found = true;
                         if (any_hit)
                             break;
@@ -103,7 +328,9 @@ struct MeshTracer {
                         left_node = right_node;
                         right_node = tmp_node;
                     }
+                    // The far child is only visited after the near one's subtree, so its children can be loaded by then:
                     stack[top++] = right_node->first_index;
+                    prefetch(mesh.bvh.nodes + right_node->first_index);
                 }
                 left_node = mesh.bvh.nodes + left_node->first_index;
             } else if (right_node) {
@@ -114,7 +341,58 @@ struct MeshTracer {
             }
         }
 
-        if (found && !any_hit && mesh.normals_count | mesh.uvs_count) {
+        return found;
+    }
+
+    // Traverses the wide BVH: All the children of a node are tested at once, leaf children are intersected right away
+    // (nearest first), and inner children are visited nearest first, with the rest pushed onto the stack:
+    INLINE_XPU bool traverseWide(const Mesh &mesh, const Ray &ray, RayHit &hit, bool any_hit) {
+        f32 near_distances[BVH_WIDTH], far_distances[BVH_WIDTH];
+        u8 hit_children[BVH_WIDTH], hit_count, child;
+        u32 next_node_id, node_id = 0, top = 0;
+        bool found = false;
+
+        while (true) {
+            const WideBVHNode &node = mesh.wide_bvh.nodes[node_id];
+            hit_count = node.hitChildren(ray, hit.distance, near_distances, far_distances, hit_children);
+
+            for (u8 i = 0; i < hit_count; i++) {
+                child = hit_children[i];
+                if (node.leaf_count[child] && near_distances[child] < hit.distance &&
+                    hitLeaf(mesh, node.first_index[child], node.leaf_count[child], far_distances[child], ray, hit, any_hit)) {
+                    found = true;
+                    if (any_hit)
+                        return true;
+                }
+            }
+
+            next_node_id = (u32)-1;
+            for (u8 i = hit_count; i-- > 0;) {
+                child = hit_children[i];
+                if (node.leaf_count[child] || near_distances[child] >= hit.distance)
+                    continue;
+
+                if (next_node_id != (u32)-1) {
+                    // Farther children are only visited after the nearest one's subtree, so can be loaded by then:
+                    stack[top++] = next_node_id;
+                    prefetch(mesh.wide_bvh.nodes + next_node_id);
+                }
+                next_node_id = node.first_index[child];
+            }
+
+            if (next_node_id != (u32)-1)
+                node_id = next_node_id;
+            else if (top)
+                node_id = stack[--top];
+            else
+                break;
+        }
+
+        return found;
+    }
+
+    INLINE_XPU void interpolateVertexAttributes(const Mesh &mesh, RayHit &hit) const {
+        if (mesh.normals_count | mesh.uvs_count) {
             Triangle &triangle = mesh.triangles[hit.id];
             f32 a = hit.uv.u;
             f32 b = hit.uv.v;
@@ -129,7 +407,5 @@ struct MeshTracer {
                 hit.normal.z = fast_mul_add(triangle.n3.z, a, fast_mul_add(triangle.n2.z, b, triangle.n1.z * c));
             }
         }
-
-        return found;
     }
 };
\ No newline at end of file
@@ -0,0 +1,202 @@
+#pragma once
+
+#include "./scene_tracer.h"
+
+#define RAY_PACKET_MIN_ACTIVE_RAYS 2
+
+// Traces packets of coherent rays (like primary rays of neighbouring pixels) through the scene and mesh BVHs,
+// testing each node's bounding box against all the rays of the packet at once.
+// Packets that diverge fall back to single-ray traversal through the scene tracer:
+// Rays pointing into different octants are traced individually from the start (through the wide BVHs, like single rays),
+// and sub-trees entered by fewer than RAY_PACKET_MIN_ACTIVE_RAYS rays are traversed individually by just the rays that
+// entered them (through the binary BVHs, as a binary sub-tree has no wide node of its own to start from).
+struct PacketTracer {
+    SceneTracer &scene_tracer;
+    u32 *stack{nullptr};
+    u32 *mesh_stack{nullptr};
+
+    RayPacket packet, mesh_packet;
+    bool active_rays[RAY_PACKET_SIZE];
+    bool active_mesh_rays[RAY_PACKET_SIZE];
+    bool mesh_hit_found[RAY_PACKET_SIZE];
+    u32 mesh_ray_indices[RAY_PACKET_SIZE];
+    Ray mesh_rays[RAY_PACKET_SIZE];
+    RayHit mesh_hits[RAY_PACKET_SIZE];
+
+    static u64 getSizeInBytes(u32 stack_size, u32 mesh_stack_size) {
+        return sizeof(u32) * (stack_size + mesh_stack_size + 2);
+    }
+
+    PacketTracer(SceneTracer &scene_tracer, u32 stack_size, u32 mesh_stack_size, memory::MonotonicAllocator *memory_allocator = nullptr) :
+            scene_tracer{scene_tracer} {
+        memory::MonotonicAllocator temp_allocator;
+        if (!memory_allocator) {
+            temp_allocator = memory::MonotonicAllocator{getSizeInBytes(stack_size, mesh_stack_size)};
+            memory_allocator = &temp_allocator;
+        }
+
+        // Descending into both children of a node grows a packet's stack by one entry per level (plus the root):
+        stack = (u32*)memory_allocator->allocate(sizeof(u32) * (stack_size + 1));
+        mesh_stack = (u32*)memory_allocator->allocate(sizeof(u32) * (mesh_stack_size + 1));
+    }
+
+    // Finds the closest hit (against visible geometry) of every ray, just like SceneTracer::trace does for a single ray:
+    void trace(Ray *rays, RayHit *hits, Geometry **geometries, u32 ray_count, const Scene &scene) {
+        for (u32 i = 0; i < ray_count; i++) {
+            rays[i].reset(rays[i].direction.scaleAdd(TRACE_OFFSET, rays[i].origin), rays[i].direction);
+            hits[i].distance = INFINITY;
+            geometries[i] = nullptr;
+        }
+
+        if (!packet.load(rays, hits, ray_count)) {
+            for (u32 i = 0; i < ray_count; i++)
+                geometries[i] = scene_tracer.traverseFromRoot(scene, rays[i], hits[i], false);
+
+            return;
+        }
+
+        Geometry *hit_geo;
+        u32 node_id, active_count, top = 0;
+        stack[top++] = 0;
+        while (top) {
+            node_id = stack[--top];
+            const BVHNode &node = scene.bvh.nodes[node_id];
+            active_count = packet.hitsAABB(node.aabb, active_rays);
+            if (!active_count)
+                continue;
+
+            if (node.leaf_count)
+                hitGeometries(scene.bvh_leaf_geometry_indices + node.first_index, node.leaf_count, scene, rays, hits, geometries);
+            else if (active_count < RAY_PACKET_MIN_ACTIVE_RAYS) {
+                for (u32 i = 0; i < ray_count; i++) {
+                    if (!active_rays[i]) continue;
+
+                    hit_geo = scene_tracer.traverse(scene, node_id, rays[i], hits[i], false);
+                    if (hit_geo) {
+                        geometries[i] = hit_geo;
+                        packet.closest_distance[i] = hits[i].distance;
+                    }
+                }
+            } else
+                pushChildren(scene.bvh.nodes, node, rays[firstActive(active_rays)], stack, top);
+        }
+    }
+
+    void hitGeometries(const u32 *geometry_indices, u32 geo_count, const Scene &scene, Ray *rays, RayHit *hits, Geometry **geometries) {
+        RayHit &aux_hit = scene_tracer.aux_hit;
+        Geometry *geo;
+
+        for (u32 g = 0; g < geo_count; g++) {
+            geo = scene.geometries + geometry_indices[g];
+            if (!(geo->flags & GEOMETRY_IS_VISIBLE))
+                continue;
+
+            if (geo->type == GeometryType_Mesh) {
+                hitMesh(*geo, scene, rays, hits, geometries);
+                continue;
+            }
+
+            for (u32 i = 0; i < packet.count; i++) {
+                if (!active_rays[i]) continue;
+
+                aux_hit.distance = Min(packet.far_distance[i] + EPS, hits[i].distance);
+                if (scene_tracer.hitGeometryInLocalSpace(*geo, scene.meshes, rays[i], aux_hit) &&
+                    aux_hit.distance < hits[i].distance) {
+                    hits[i] = aux_hit;
+                    hits[i].NdotRd = -(aux_hit.normal.dot(scene_tracer.aux_ray.direction));
+                    geometries[i] = geo;
+                    packet.closest_distance[i] = aux_hit.distance;
+                }
+            }
+        }
+    }
+
+    void hitMesh(const Geometry &geo, const Scene &scene, Ray *rays, RayHit *hits, Geometry **geometries) {
+        const Mesh &mesh = scene.meshes[geo.id];
+        MeshTracer &mesh_tracer = scene_tracer.mesh_tracer;
+        u32 i, mesh_ray_count = 0;
+        f32 near_distance, far_distance;
+
+        for (i = 0; i < packet.count; i++) {
+            if (!active_rays[i]) continue;
+
+            mesh_ray_indices[mesh_ray_count] = i;
+            mesh_rays[mesh_ray_count].localize(rays[i], geo.transform);
+            mesh_hits[mesh_ray_count].distance = Min(packet.far_distance[i] + EPS, hits[i].distance);
+            mesh_ray_count++;
+        }
+
+        // Rotated meshes can split a packet across octants in their local space:
+        if (mesh_ray_count >= RAY_PACKET_MIN_ACTIVE_RAYS && mesh_packet.load(mesh_rays, mesh_hits, mesh_ray_count))
+            traceMesh(mesh);
+        else
+            for (i = 0; i < mesh_ray_count; i++)
+                mesh_hit_found[i] = mesh_rays[i].hitsAABB(mesh.aabb, near_distance, far_distance) &&
+                                    mesh_tracer.traverseFromRoot(mesh, mesh_rays[i], mesh_hits[i], false);
+
+        for (u32 m = 0; m < mesh_ray_count; m++) {
+            if (!mesh_hit_found[m]) continue;
+
+            mesh_tracer.interpolateVertexAttributes(mesh, mesh_hits[m]);
+            i = mesh_ray_indices[m];
+            if (mesh_hits[m].distance < hits[i].distance) {
+                hits[i] = mesh_hits[m];
+                hits[i].NdotRd = -(mesh_hits[m].normal.dot(mesh_rays[m].direction));
+                geometries[i] = (Geometry*)&geo;
+                packet.closest_distance[i] = mesh_hits[m].distance;
+            }
+        }
+    }
+
+    void traceMesh(const Mesh &mesh) {
+        MeshTracer &mesh_tracer = scene_tracer.mesh_tracer;
+        u32 node_id, active_count, top = 0;
+        bool found;
+
+        for (u32 i = 0; i < mesh_packet.count; i++) mesh_hit_found[i] = false;
+
+        mesh_stack[top++] = 0;
+        while (top) {
+            node_id = mesh_stack[--top];
+            const BVHNode &node = mesh.bvh.nodes[node_id];
+            active_count = mesh_packet.hitsAABB(node.aabb, active_mesh_rays);
+            if (!active_count)
+                continue;
+
+            if (node.leaf_count || active_count < RAY_PACKET_MIN_ACTIVE_RAYS) {
+                for (u32 i = 0; i < mesh_packet.count; i++) {
+                    if (!active_mesh_rays[i]) continue;
+
+                    if (node.leaf_count)
+                        found = mesh_tracer.hitLeaf(mesh, node.first_index, node.leaf_count,
+                                                    mesh_packet.far_distance[i], mesh_rays[i], mesh_hits[i], false);
+                    else
+                        found = mesh_tracer.traverse(mesh, node_id, mesh_rays[i], mesh_hits[i], false);
+
+                    if (found) {
+                        mesh_hit_found[i] = true;
+                        mesh_packet.closest_distance[i] = mesh_hits[i].distance;
+                    }
+                }
+            } else
+                pushChildren(mesh.bvh.nodes, node, mesh_rays[firstActive(active_mesh_rays)], mesh_stack, top);
+        }
+    }
+
+    INLINE static u32 firstActive(const bool *active) {
+        u32 i = 0;
+        while (!active[i]) i++;
+        return i;
+    }
+
+    // Orders the children by their distance along a representative ray of the packet,
+    // pushing the farther child first so that the nearer one is visited first (shrinking the closest distances):
+    INLINE static void pushChildren(const BVHNode *nodes, const BVHNode &node, const Ray &ray, u32 *stack, u32 &top) {
+        f32 left_near_distance, right_near_distance, far_distance;
+        if (!ray.hitsAABB(nodes[node.first_index    ].aabb, left_near_distance, far_distance)) left_near_distance = INFINITY;
+        if (!ray.hitsAABB(nodes[node.first_index + 1].aabb, right_near_distance, far_distance)) right_near_distance = INFINITY;
+        bool left_is_nearer = left_near_distance <= right_near_distance;
+        stack[top++] = node.first_index + left_is_nearer;
+        stack[top++] = node.first_index + !left_is_nearer;
+    }
+};
@@ -26,6 +26,22 @@ struct SceneCounts : SceneCountsData {
 
 #define SCENE_HAD_EMISSIVE_QUADS 1
 
+#ifndef SCENE_BVH_MAX_REFIT_SAH_GROWTH
+#define SCENE_BVH_MAX_REFIT_SAH_GROWTH 1.25f // Refitting rebuilds the BVH once its SAH cost grows by this factor
+#endif
+
+#ifndef SCENE_BVH_LBVH_MIN_GEOMETRY_COUNT
+#define SCENE_BVH_LBVH_MIN_GEOMETRY_COUNT 65536 // Scene BVHs over at least this many geometries are built as LBVHs
+#endif
+
+#ifndef SCENE_LIGHT_BVH_MIN_LIGHT_COUNT
+#define SCENE_LIGHT_BVH_MIN_LIGHT_COUNT 16 // Scenes with fewer point lights go through each of them, with no light BVH
+#endif
+
+#ifndef SCENE_LIGHT_BVH_STACK_SIZE
+#define SCENE_LIGHT_BVH_STACK_SIZE 32 // Light BVHs are walked with fixed-size stacks, so deeper ones are not used
+#endif
+
 struct SceneIO {
     String file_path;
     u64 last_io_ticks = 0;
@@ -53,6 +69,21 @@ struct SceneData {
     BVHBuilder *bvh_builder;
     u32 *bvh_leaf_geometry_indices;
     BVH bvh;
+    WideBVH wide_bvh;
+    f32 bvh_built_sah_cost;
+
+    u32 *emissive_quad_ids; // The geometries that are emissive quads (area lights), see Scene::updateEmissiveQuads()
+    u32 emissive_quad_count;
+
+    // The point lights in a BVH over their glow spheres, with the total power of each node (see Scene::updateLightBVH()):
+    BVH light_bvh;
+    f32 *light_bvh_node_powers;
+    u32 *light_bvh_leaf_light_indices, *directional_light_ids;
+    u32 point_light_count, directional_light_count;
+
+    // Lights, materials and which material each geometry uses are not marked as dirty when they change,
+    // so they get hashed (see Scene::haveLightsChanged()):
+    u64 lights_hash, materials_hash, geometry_materials_hash;
 };
 
 struct Scene : SceneData {
@@ -70,10 +101,12 @@ struct Scene : SceneData {
         bvh.height = (u8)counts.geometries;
 
         memory::MonotonicAllocator temp_allocator;
-        u32 capacity = sizeof(BVHBuilder) + (sizeof(u32) + sizeof(AABB) + sizeof(RectI)) * counts.geometries;
-        u32 bvh_nodes_capacity = sizeof(BVHNode) * bvh.node_count;
+        u32 capacity = sizeof(BVHBuilder) + (sizeof(u32) * 2 + sizeof(AABB) + sizeof(RectI)) * counts.geometries;
+        capacity += sizeof(WideBVHNode) * getWideBVHNodeCount(bvh.node_count) + CACHE_LINE_SIZE;
+        u32 bvh_nodes_capacity = getSizeInBytes(bvh);
 
         if (counts.lights && !lights) capacity += sizeof(Material) * counts.lights;
+        capacity += (sizeof(BVHNode) * 2 + sizeof(f32) * 2 + sizeof(u32) * 2) * counts.lights;
         if (counts.materials && !materials) capacity += sizeof(Material) * counts.materials;
         if (counts.geometries && !geometries) capacity += sizeof(Geometry) * counts.geometries;
         if (counts.boxes && !boxes) capacity += sizeof(Box) * counts.boxes;
@@ -91,8 +124,8 @@ struct Scene : SceneData {
             capacity += getTotalMemoryForMeshes(mesh_files, counts.meshes, &max_triangle_count, &bvh_nodes_capacity);
             capacity += sizeof(u32) * (2 * counts.meshes);
         }
-        u32 max_leaf_node_count = Max(max_triangle_count, counts.geometries);
-        capacity += BVHBuilder::getSizeInBytes(max_leaf_node_count);
+        u32 max_leaf_node_count = Max(max_triangle_count, Max(counts.geometries, counts.lights));
+        capacity += BVHBuilder::getSizeInBytes(max_leaf_node_count, getBVHBuildStrategy());
 
         if (!memory_allocator) {
             temp_allocator = memory::MonotonicAllocator{bvh_nodes_capacity + capacity};
@@ -102,10 +135,17 @@ struct Scene : SceneData {
         bvh_nodes_allocator.address = (u8*)memory_allocator->allocate(bvh_nodes_capacity);
         bvh_nodes_allocator.capacity = (u64)bvh_nodes_capacity;
 
-        bvh.nodes = (BVHNode*)bvh_nodes_allocator.allocate(sizeof(BVHNode) * bvh.node_count);
+        allocateMemory(bvh, &bvh_nodes_allocator);
         bvh_leaf_geometry_indices = (u32*)memory_allocator->allocate(sizeof(u32) * counts.geometries);
+        emissive_quad_ids = (u32*)memory_allocator->allocate(sizeof(u32) * counts.geometries);
+        light_bvh.nodes = (BVHNode*)memory_allocator->allocate(sizeof(BVHNode) * counts.lights * 2);
+        light_bvh_node_powers = (f32*)memory_allocator->allocate(sizeof(f32) * counts.lights * 2);
+        light_bvh_leaf_light_indices = (u32*)memory_allocator->allocate(sizeof(u32) * counts.lights);
+        directional_light_ids = (u32*)memory_allocator->allocate(sizeof(u32) * counts.lights);
+        if (getWideBVHNodeCount(bvh.node_count))
+            wide_bvh.nodes = (WideBVHNode*)memory_allocator->allocate(sizeof(WideBVHNode) * getWideBVHNodeCount(bvh.node_count), CACHE_LINE_SIZE);
         bvh_builder = (BVHBuilder*)memory_allocator->allocate(sizeof(BVHBuilder));
-        *bvh_builder = BVHBuilder{max_leaf_node_count, memory_allocator};
+        *bvh_builder = BVHBuilder{max_leaf_node_count, getBVHBuildStrategy(), memory_allocator};
 
         aabbs = (AABB*)memory_allocator->allocate(sizeof(AABB) * counts.geometries);
 
@@ -150,16 +190,108 @@ struct Scene : SceneData {
                 load(meshes[i], mesh_files[i].char_ptr, memory_allocator, &bvh_nodes_allocator);
                 mesh_stack_size = Max(mesh_stack_size, meshes[i].bvh.height);
             }
-            mesh_stack_size += 2;
+            // Traversing a wide BVH can push up to BVH_WIDTH - 1 nodes per level:
+            mesh_stack_size = mesh_stack_size * Max(1, BVH_WIDTH - 1) + 2;
         }
 
+        updateEmissiveQuads();
+        updateLightBVH();
+
+        // Geometry stays dirty, so that whatever gets placed after the scene is constructed is picked up on the first update:
+        for (u32 i = 0; i < counts.geometries; i++)
+            updateAABB(aabbs[i], geometries[i]);
+        updateBVH();
+
+        // Geometry is usually placed after the scene is constructed, so have the first refit rebuild the BVH:
+        bvh_built_sah_cost = 0;
+    }
+
+    // Collects the geometries that are emissive quads into a list of area lights, so that shading goes through just those
+    // (rather than every geometry). Needs calling again whenever geometry changes its type or material
+    // (see haveGeometryMaterialsChanged()), or a material its emission (see haveMaterialsChanged()):
+    void updateEmissiveQuads() {
+        emissive_quad_count = 0;
         for (u32 i = 0; i < counts.geometries; i++)
-            if (geometries[i].type == GeometryType_Quad && materials[geometries[i].material_id].isEmissive()) {
-                flags = SCENE_HAD_EMISSIVE_QUADS;
+            if (geometries[i].type == GeometryType_Quad && materials[geometries[i].material_id].isEmissive())
+                emissive_quad_ids[emissive_quad_count++] = i;
+
+        if (emissive_quad_count) flags |= SCENE_HAD_EMISSIVE_QUADS;
+    }
+
+    // Builds a BVH over the glow spheres of the point lights (which bound their positions too), keeping the total power
+    // of each node (intensity weighed by the luminance of the color) for shading to pick lights by their importance.
+    // Needs calling again whenever lights change (see haveLightsChanged()).
+    // Scenes with few point lights, or with a light BVH too deep for the stacks it is walked with, get no light BVH:
+    void updateLightBVH() {
+        point_light_count = directional_light_count = 0;
+        light_bvh.node_count = 0;
+        if (!lights) return;
+
+        for (u32 i = 0; i < counts.lights; i++) {
+            const Light &light = lights[i];
+            if (light.isDirectional()) {
+                directional_light_ids[directional_light_count++] = i;
+                continue;
             }
 
-        updateAABBs();
-        updateBVH();
+            f32 radius = light.intensity * LIGHT_INTENSITY_RADIUS_FACTOR;
+            BVHNode &node = bvh_builder->nodes[point_light_count];
+            node.aabb.min = light.position_or_direction - radius;
+            node.aabb.max = light.position_or_direction + radius;
+            node.first_index = bvh_builder->node_ids[point_light_count] = i;
+            point_light_count++;
+        }
+        if (point_light_count < SCENE_LIGHT_BVH_MIN_LIGHT_COUNT)
+            return;
+
+        bvh_builder->strategy = BVHBuildStrategy_BinnedSAH;
+        bvh_builder->build(light_bvh, point_light_count, 1);
+        if (light_bvh.height >= SCENE_LIGHT_BVH_STACK_SIZE) {
+            light_bvh.node_count = 0;
+            return;
+        }
+
+        for (u32 i = 0; i < point_light_count; i++)
+            light_bvh_leaf_light_indices[i] = bvh_builder->leaf_ids[i];
+
+        // Children are always stored after their parent, so one reverse pass sums the powers up the tree:
+        for (u32 i = light_bvh.node_count; i-- > 0;) {
+            const BVHNode &node = light_bvh.nodes[i];
+            f32 &power = light_bvh_node_powers[i];
+            if (node.leaf_count) {
+                power = 0;
+                for (u32 l = node.first_index; l < node.first_index + node.leaf_count; l++)
+                    power += lights[light_bvh_leaf_light_indices[l]].power();
+            } else
+                power = light_bvh_node_powers[node.first_index] + light_bvh_node_powers[node.first_index + 1];
+        }
+    }
+
+    // Whether the lights / materials changed since the last call (the first call tells whether there are any):
+    bool haveLightsChanged() {
+        u64 hash = lights ? hashBytes(lights, sizeof(Light) * counts.lights) : 0;
+        bool changed = hash != lights_hash;
+        lights_hash = hash;
+        return changed;
+    }
+
+    bool haveMaterialsChanged() {
+        u64 hash = materials ? hashBytes(materials, sizeof(Material) * counts.materials) : 0;
+        bool changed = hash != materials_hash;
+        materials_hash = hash;
+        return changed;
+    }
+
+    // Whether any geometry changed its type or material since the last call:
+    bool haveGeometryMaterialsChanged() {
+        u64 hash = hashBytes(nullptr, 0); // Just the initial hash value
+        for (u32 i = 0; i < counts.geometries; i++) {
+            hash = hashBytes(&geometries[i].type, sizeof(GeometryType), hash);
+            hash = hashBytes(&geometries[i].material_id, sizeof(u32), hash);
+        }
+        bool changed = hash != geometry_materials_hash;
+        geometry_materials_hash = hash;
+        return changed;
     }
 
     void updateAABB(AABB &aabb, const Geometry &geo, u8 sphere_steps = 255) {
@@ -173,20 +305,54 @@ struct Scene : SceneData {
         aabb = geo.transform.externAABB(aabb);
     }
 
-    void updateAABBs() {
-        for (u32 i = 0; i < counts.geometries; i++)
-            updateAABB(aabbs[i], geometries[i]);
+    // Updates the AABBs of just the geometry that was marked as dirty (clearing the mark).
+    // Returns how many geometries were updated, so that callers can skip BVH maintenance when none were:
+    u32 updateAABBs() {
+        u32 updated_count = 0;
+        Geometry *geo = geometries;
+        for (u32 i = 0; i < counts.geometries; i++, geo++)
+            if (geo->flags & GEOMETRY_IS_DIRTY) {
+                geo->flags &= ~GEOMETRY_IS_DIRTY;
+                updateAABB(aabbs[i], *geo);
+                updated_count++;
+            }
+
+        return updated_count;
+    }
+
+    // Large scenes are built as LBVHs, which build in linear time at the cost of some tracing performance:
+    BVHBuildStrategy getBVHBuildStrategy() const {
+        return counts.geometries >= SCENE_BVH_LBVH_MIN_GEOMETRY_COUNT ? BVHBuildStrategy_LBVH : BVHBuildStrategy_BinnedSAH;
     }
 
-    void updateBVH(u16 max_leaf_size = 1) {
+    void updateBVH(u16 max_leaf_size = 1, ThreadPool *thread_pool = nullptr) {
+        bvh_builder->strategy = getBVHBuildStrategy();
         for (u32 i = 0; i < counts.geometries; i++) {
             bvh_builder->nodes[i].aabb = aabbs[i];
             bvh_builder->nodes[i].first_index = bvh_builder->node_ids[i] = i;
         }
 
-        bvh_builder->build(bvh, counts.geometries, max_leaf_size);
+        bvh_builder->build(bvh, counts.geometries, max_leaf_size, thread_pool);
 
         for (u32 i = 0; i < counts.geometries; i++)
             bvh_leaf_geometry_indices[i] = bvh_builder->leaf_ids[i];
+
+        collapseBVH(bvh, wide_bvh);
+        bvh_built_sah_cost = getSAHCost(bvh);
+    }
+
+    // Updates the BVH for geometry that moved, by refitting its bounds to the current AABBs (in linear time).
+    // Refitting keeps the topology the BVH was built with, which degrades as geometry moves away from where it was:
+    // Once the SAH cost grows past the given factor of the cost at build time, the BVH is rebuilt instead.
+    // Returns whether the BVH was rebuilt.
+    bool refitBVH(f32 max_sah_growth = SCENE_BVH_MAX_REFIT_SAH_GROWTH, u16 max_leaf_size = 1, ThreadPool *thread_pool = nullptr) {
+        ::refitBVH(bvh, aabbs, bvh_leaf_geometry_indices);
+        if (getSAHCost(bvh) > bvh_built_sah_cost * max_sah_growth) {
+            updateBVH(max_leaf_size, thread_pool);
+            return true;
+        }
+
+        collapseBVH(bvh, wide_bvh);
+        return false;
     }
 };
\ No newline at end of file
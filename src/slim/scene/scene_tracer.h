@@ -3,40 +3,337 @@
 #include "./scene.h"
 #include "./mesh_tracer.h"
 
+#ifndef SCENE_TRACER_OCCLUDER_CACHE_SIZE
+#define SCENE_TRACER_OCCLUDER_CACHE_SIZE 8 // Lights that remember their last occluder (more lights share the slots)
+#endif
+
+#ifndef SCENE_TRACER_SHADOW_RAYS
+#define SCENE_TRACER_SHADOW_RAYS 32 // Shadow rays traced together from a shading point (one bit each, so at most 32)
+#endif
+
+// Segments from a shading point towards several lights, to be traced together (see SceneTracer::findOccludedRays()):
+struct ShadowRays {
+    Ray rays[SCENE_TRACER_SHADOW_RAYS], local_rays[SCENE_TRACER_SHADOW_RAYS];
+    f32 max_distances[SCENE_TRACER_SHADOW_RAYS], local_max_distances[SCENE_TRACER_SHADOW_RAYS];
+    u32 light_indices[SCENE_TRACER_SHADOW_RAYS], local_ray_indices[SCENE_TRACER_SHADOW_RAYS];
+    u32 count = 0;
+
+    INLINE_XPU void add(const vec3 &origin, const vec3 &direction, f32 max_distance, u32 light_index) {
+        rays[count].reset(direction.scaleAdd(TRACE_OFFSET, origin), direction);
+        max_distances[count] = max_distance;
+        light_indices[count++] = light_index;
+    }
+};
+
 struct SceneTracer {
     SphereTracer light_tracer{};
     MeshTracer mesh_tracer{nullptr};
     u32 *stack{nullptr};
+    u32 *ray_masks{nullptr}, *mesh_ray_masks{nullptr}; // The shadow rays that entered the nodes on the stacks
     Ray aux_ray;
     RayHit aux_hit;
 
+    // The geometry that last blocked a shadow ray towards each light. Nearby shadow rays towards the same light tend
+    // to be blocked by the same geometry, so that gets tested first (renderers clear these per tile):
+    const Geometry *last_occluders[SCENE_TRACER_OCCLUDER_CACHE_SIZE]{};
+
     INLINE_XPU SceneTracer(u32 *stack, u32 *mesh_stack) : mesh_tracer{mesh_stack}, stack{stack} {}
 
+    static u64 getSizeInBytes(u32 stack_size, u32 mesh_stack_size) {
+        return sizeof(u32) * (stack_size + mesh_stack_size) * 2;
+    }
+
     explicit SceneTracer(u32 stack_size, u32 mesh_stack_size, memory::MonotonicAllocator *memory_allocator = nullptr) {
         memory::MonotonicAllocator temp_allocator;
         if (!memory_allocator) {
-            temp_allocator = memory::MonotonicAllocator{sizeof(u32) * (mesh_stack_size + stack_size)};
+            temp_allocator = memory::MonotonicAllocator{getSizeInBytes(stack_size, mesh_stack_size)};
             memory_allocator = &temp_allocator;
         }
 
         stack = (u32*)memory_allocator->allocate(sizeof(u32) * stack_size);
+        ray_masks = (u32*)memory_allocator->allocate(sizeof(u32) * stack_size);
+        mesh_ray_masks = (u32*)memory_allocator->allocate(sizeof(u32) * mesh_stack_size);
         mesh_tracer = MeshTracer{mesh_stack_size, memory_allocator};
     }
 
     XPU Geometry* trace(Ray &ray, RayHit &hit, const Scene &scene, bool any_hit = false, f32 max_distance = INFINITY) {
         ray.reset(ray.direction.scaleAdd(TRACE_OFFSET, ray.origin), ray.direction);
         hit.distance = max_distance;
+        return traverseFromRoot(scene, ray, hit, any_hit);
+    }
+
+    // Walks the wide BVH when there is one (and the binary one otherwise), for a ray that was already offset:
+    XPU Geometry* traverseFromRoot(const Scene &scene, const Ray &ray, RayHit &hit, bool any_hit) {
+        return scene.wide_bvh.nodes ? traverseWide(scene, ray, hit, any_hit) : traverse(scene, 0, ray, hit, any_hit);
+    }
+
+    INLINE_XPU void clearOccluderCache() {
+        for (auto &occluder : last_occluders) occluder = nullptr;
+    }
+
+    // Whether any shadowing geometry blocks the ray within the given distance (for shadow rays towards the given light).
+    // Unlike trace(), nothing is computed about the hit, the walk stops at the first blocker and the geometry that
+    // blocked the last shadow ray towards the light is tested before walking the BVH at all:
+    XPU bool isOccluded(Ray &ray, const Scene &scene, f32 max_distance, u32 light_index) {
+        ray.reset(ray.direction.scaleAdd(TRACE_OFFSET, ray.origin), ray.direction);
+        return isOccludedFromOffset(ray, scene, max_distance, light_index);
+    }
+
+    // Like isOccluded(), for a ray that already got offset from the surface it starts at:
+    XPU bool isOccludedFromOffset(const Ray &ray, const Scene &scene, f32 max_distance, u32 light_index) {
+        const Geometry *&last_occluder = last_occluders[light_index % SCENE_TRACER_OCCLUDER_CACHE_SIZE];
+        if (last_occluder && (last_occluder->flags & GEOMETRY_IS_SHADOWING) &&
+            occludedByGeometryInLocalSpace(*last_occluder, scene.meshes, ray, max_distance))
+            return true;
+
+        const Geometry *occluder = scene.wide_bvh.nodes ? findOccluderWide(scene, ray, max_distance) :
+                                   findOccluder(scene, ray, max_distance);
+        if (occluder) last_occluder = occluder;
+        return occluder != nullptr;
+    }
+
+    // Which of the shadow rays (bit i for the i-th one) are blocked by shadowing geometry within their max distances.
+    // The wide BVHs are walked once for all of them: Each node is fetched once and its children are tested against every
+    // ray that entered it and is not blocked yet, so rays retire as soon as they are found to be blocked.
+    // The last occluder of each light is tested first, as in isOccluded():
+    XPU u32 findOccludedRays(ShadowRays &shadow_rays, const Scene &scene) {
+        u32 occluded = 0;
+        if (shadow_rays.count == 1 || !scene.wide_bvh.nodes || !ray_masks) {
+            for (u32 i = 0; i < shadow_rays.count; i++)
+                if (isOccludedFromOffset(shadow_rays.rays[i], scene, shadow_rays.max_distances[i],
+                                         shadow_rays.light_indices[i]))
+                    occluded |= 1u << i;
+
+            return occluded;
+        }
+
+        for (u32 i = 0; i < shadow_rays.count; i++) {
+            const Geometry *last_occluder = last_occluders[shadow_rays.light_indices[i] % SCENE_TRACER_OCCLUDER_CACHE_SIZE];
+            if (last_occluder && (last_occluder->flags & GEOMETRY_IS_SHADOWING) &&
+                occludedByGeometryInLocalSpace(*last_occluder, scene.meshes, shadow_rays.rays[i],
+                                               shadow_rays.max_distances[i]))
+                occluded |= 1u << i;
+        }
+
+        f32 near_distances[BVH_WIDTH], far_distances[BVH_WIDTH];
+        u32 child_masks[BVH_WIDTH], i, node_id = 0, top = 0;
+        u32 active = (u32)((1ull << shadow_rays.count) - 1) & ~occluded;
+        u8 hit_children[BVH_WIDTH], hit_count, child;
+
+        while (active) {
+            const WideBVHNode &node = scene.wide_bvh.nodes[node_id];
+            for (child = 0; child < BVH_WIDTH; child++) child_masks[child] = 0;
+            for (u32 rays_left = active; rays_left; rays_left &= rays_left - 1) {
+                i = lowestSetBit(rays_left);
+                hit_count = node.hitChildren(shadow_rays.rays[i], shadow_rays.max_distances[i],
+                                             near_distances, far_distances, hit_children);
+                for (u8 h = 0; h < hit_count; h++) child_masks[hit_children[h]] |= 1u << i;
+            }
+
+            for (child = 0; child < BVH_WIDTH; child++)
+                if ((child_masks[child] & ~occluded) && node.leaf_count[child])
+                    occluded |= findOccludedRays(scene.bvh_leaf_geometry_indices + node.first_index[child],
+                                                 node.leaf_count[child], shadow_rays, child_masks[child] & ~occluded, scene);
+
+            for (child = 0; child < BVH_WIDTH; child++)
+                if ((child_masks[child] & ~occluded) && !node.leaf_count[child]) {
+                    ray_masks[top] = child_masks[child];
+                    stack[top++] = node.first_index[child];
+                }
+
+            active = 0;
+            while (top && !active) {
+                node_id = stack[--top];
+                active = ray_masks[top] & ~occluded;
+            }
+        }
+
+        return occluded;
+    }
+
+    XPU u32 findOccludedRays(const u32 *geometry_indices, u32 geo_count, ShadowRays &shadow_rays, u32 active, const Scene &scene) {
+        u32 occluded = 0, blocked, i;
+        for (u32 g = 0; g < geo_count && active; g++) {
+            const Geometry &geo = scene.geometries[geometry_indices[g]];
+            if (!(geo.flags & GEOMETRY_IS_SHADOWING))
+                continue;
+
+            // Rays that enter a mesh together walk its BVH together (in its local space, packed into the first lanes):
+            blocked = 0;
+            if (geo.type == GeometryType_Mesh && scene.meshes[geo.id].wide_bvh.nodes && (active & (active - 1))) {
+                u32 lane_count = 0;
+                for (u32 rays_left = active; rays_left; rays_left &= rays_left - 1) {
+                    i = lowestSetBit(rays_left);
+                    shadow_rays.local_rays[lane_count].localize(shadow_rays.rays[i], geo.transform);
+                    shadow_rays.local_max_distances[lane_count] = shadow_rays.max_distances[i];
+                    shadow_rays.local_ray_indices[lane_count++] = i;
+                }
+
+                u32 blocked_lanes = mesh_tracer.findOccludedRays(scene.meshes[geo.id], shadow_rays.local_rays,
+                                                                 shadow_rays.local_max_distances,
+                                                                 (u32)((1ull << lane_count) - 1), mesh_ray_masks);
+                for (; blocked_lanes; blocked_lanes &= blocked_lanes - 1)
+                    blocked |= 1u << shadow_rays.local_ray_indices[lowestSetBit(blocked_lanes)];
+            } else
+                for (u32 rays_left = active; rays_left; rays_left &= rays_left - 1) {
+                    i = lowestSetBit(rays_left);
+                    if (occludedByGeometryInLocalSpace(geo, scene.meshes, shadow_rays.rays[i], shadow_rays.max_distances[i]))
+                        blocked |= 1u << i;
+                }
+
+            for (u32 rays_left = blocked; rays_left; rays_left &= rays_left - 1)
+                last_occluders[shadow_rays.light_indices[lowestSetBit(rays_left)] % SCENE_TRACER_OCCLUDER_CACHE_SIZE] = &geo;
+
+            occluded |= blocked;
+            active &= ~blocked;
+        }
+
+        return occluded;
+    }
+
+    XPU const Geometry* findOccluderWide(const Scene &scene, const Ray &ray, f32 max_distance) {
+        f32 near_distances[BVH_WIDTH], far_distances[BVH_WIDTH];
+        u8 hit_children[BVH_WIDTH], hit_count, child;
+        u32 node_id = 0, top = 0;
+        const Geometry *occluder;
 
+        while (true) {
+            const WideBVHNode &node = scene.wide_bvh.nodes[node_id];
+            hit_count = node.hitChildren(ray, max_distance, near_distances, far_distances, hit_children);
+
+            for (u8 i = 0; i < hit_count; i++) {
+                child = hit_children[i];
+                if (node.leaf_count[child] &&
+                    (occluder = findOccluder(scene.bvh_leaf_geometry_indices + node.first_index[child],
+                                             node.leaf_count[child], scene, ray, max_distance)))
+                    return occluder;
+            }
+
+            for (u8 i = hit_count; i-- > 0;) {
+                child = hit_children[i];
+                if (!node.leaf_count[child])
+                    stack[top++] = node.first_index[child];
+            }
+
+            if (!top)
+                return nullptr;
+
+            node_id = stack[--top];
+        }
+    }
+
+    XPU const Geometry* findOccluder(const Scene &scene, const Ray &ray, f32 max_distance) {
+        f32 near_distance, far_distance;
+        u32 node_id = 0, top = 0;
+        const Geometry *occluder;
+
+        while (true) {
+            const BVHNode &node = scene.bvh.nodes[node_id];
+            if (ray.hitsAABB(node.aabb, near_distance, far_distance) && near_distance < max_distance) {
+                if (node.leaf_count) {
+                    if ((occluder = findOccluder(scene.bvh_leaf_geometry_indices + node.first_index, node.leaf_count,
+                                                 scene, ray, max_distance)))
+                        return occluder;
+                } else {
+                    stack[top++] = node.first_index + 1;
+                    node_id = node.first_index;
+                    continue;
+                }
+            }
+
+            if (!top)
+                return nullptr;
+
+            node_id = stack[--top];
+        }
+    }
+
+    XPU const Geometry* findOccluder(const u32 *geometry_indices, u32 geo_count, const Scene &scene, const Ray &ray, f32 max_distance) {
+        for (u32 i = 0; i < geo_count; i++) {
+            const Geometry &geo = scene.geometries[geometry_indices[i]];
+            if ((geo.flags & GEOMETRY_IS_SHADOWING) && occludedByGeometryInLocalSpace(geo, scene.meshes, ray, max_distance))
+                return &geo;
+        }
+
+        return nullptr;
+    }
+
+    INLINE_XPU bool occludedByGeometryInLocalSpace(const Geometry &geo, const Mesh *meshes, const Ray &ray, f32 max_distance) {
+        aux_ray.localize(ray, geo.transform);
+        bool is_transparent = geo.flags & GEOMETRY_IS_TRANSPARENT;
+        switch (geo.type) {
+            case GeometryType_Quad  : return aux_ray.occludedByDefaultQuad(max_distance, is_transparent);
+            case GeometryType_Box   : return aux_ray.occludedByDefaultBox(max_distance, is_transparent);
+            case GeometryType_Sphere: return aux_ray.occludedByDefaultSphere(max_distance, is_transparent);
+            case GeometryType_Tet   :
+                aux_hit.distance = max_distance;
+                return aux_ray.hitsDefaultTetrahedron(aux_hit, is_transparent);
+            case GeometryType_Mesh  : return mesh_tracer.isOccluded(meshes[geo.id], aux_ray, max_distance);
+            default: return false;
+        }
+    }
+
+    // Traverses the wide BVH: All the children of a node are tested at once, leaf children are intersected right away
+    // (nearest first), and inner children are visited nearest first, with the rest pushed onto the stack:
+    XPU Geometry* traverseWide(const Scene &scene, const Ray &ray, RayHit &hit, bool any_hit) {
+        f32 near_distances[BVH_WIDTH], far_distances[BVH_WIDTH];
+        u8 hit_children[BVH_WIDTH], hit_count, child;
+        u32 next_node_id, node_id = 0, top = 0;
+        Geometry *hit_geo, *closest_hit_geo = nullptr;
+
+        while (true) {
+            const WideBVHNode &node = scene.wide_bvh.nodes[node_id];
+            hit_count = node.hitChildren(ray, hit.distance, near_distances, far_distances, hit_children);
+
+            for (u8 i = 0; i < hit_count; i++) {
+                child = hit_children[i];
+                if (!node.leaf_count[child] || near_distances[child] >= hit.distance)
+                    continue;
+
+                hit_geo = hitGeometries(scene.bvh_leaf_geometry_indices + node.first_index[child], node.leaf_count[child],
+                                        scene, far_distances[child], ray, hit, any_hit);
+                if (hit_geo) {
+                    closest_hit_geo = hit_geo;
+                    if (any_hit)
+                        return hit_geo;
+                }
+            }
+
+            next_node_id = (u32)-1;
+            for (u8 i = hit_count; i-- > 0;) {
+                child = hit_children[i];
+                if (node.leaf_count[child] || near_distances[child] >= hit.distance)
+                    continue;
+
+                if (next_node_id != (u32)-1) stack[top++] = next_node_id;
+                next_node_id = node.first_index[child];
+            }
+
+            if (next_node_id != (u32)-1)
+                node_id = next_node_id;
+            else if (top)
+                node_id = stack[--top];
+            else
+                break;
+        }
+
+        return closest_hit_geo;
+    }
+
+    // Traverses the sub-tree of the given node (the whole BVH for the root node):
+    XPU Geometry* traverse(const Scene &scene, u32 node_id, const Ray &ray, RayHit &hit, bool any_hit) {
         bool hit_left, hit_right;
         f32 left_near_distance, right_near_distance, left_far_distance, right_far_distance;
-        if (!(ray.hitsAABB(scene.bvh.nodes->aabb, left_near_distance, left_far_distance) && left_near_distance < hit.distance))
+
+        BVHNode *node = scene.bvh.nodes + node_id;
+        if (!(ray.hitsAABB(node->aabb, left_near_distance, left_far_distance) && left_near_distance < hit.distance))
             return nullptr;
 
         u32 *indices = scene.bvh_leaf_geometry_indices;
-        if (unlikely(scene.bvh.nodes->leaf_count))
-            return hitGeometries(indices, scene.counts.geometries, scene, left_far_distance, ray, hit, any_hit);
+        if (unlikely(node->leaf_count))
+            return hitGeometries(indices + node->first_index, node->leaf_count, scene, left_far_distance, ray, hit, any_hit);
 
-        BVHNode *left_node = scene.bvh.nodes + scene.bvh.nodes->first_index;
+        BVHNode *left_node = scene.bvh.nodes + node->first_index;
         BVHNode *right_node, *tmp_node;
         Geometry *hit_geo, *closest_hit_geo = nullptr;
         u32 top = 0;
@@ -147,6 +147,7 @@ struct Selection {
 
                         if (mouse::left_button.is_pressed) {
                             *world_position = hit.position - world_offset;
+                            if (geometry) geometry->flags |= GEOMETRY_IS_DIRTY;
                         } else if (mouse::middle_button.is_pressed) {
                             vec3 abs_pos{absolute(xform.internPos(hit.position))};
                             vec3 abs_org{absolute(xform.internPos(transformation_plane_origin))};
@@ -163,6 +164,7 @@ struct Selection {
                                 geometry->transform.scale.x = abs(geometry->transform.scale.x);
                                 geometry->transform.scale.y = abs(geometry->transform.scale.y);
                                 geometry->transform.scale.z = abs(geometry->transform.scale.z);
+                                geometry->flags |= GEOMETRY_IS_DIRTY;
                             } else if (light) {
                                 light->intensity = abs(
                                     LIGHT_RADIUS_INTENSITY_FACTOR * 2.0f * (
@@ -178,6 +180,7 @@ struct Selection {
                             vec3 v2{ transformation_plane_origin - transformation_plane_center };
                             quat rotation = quat{v2.cross(v1), (v1.dot(v2)) + sqrtf(v1.squaredLength() * v2.squaredLength())};
                             geometry->transform.orientation = (rotation.normalized() * object_rotation).normalized();
+                            geometry->flags |= GEOMETRY_IS_DIRTY;
                         }
                     }
                 }
@@ -196,6 +199,7 @@ struct Selection {
 
                     // View -> World (BoxSide_Back-track by the world offset from the hit position back to the selected-object's center):
                     *world_position = camera.orientation * vec3{X, -Y, object_distance} + camera.position - world_offset;
+                    if (geometry) geometry->flags |= GEOMETRY_IS_DIRTY;
                 }
             }
         }
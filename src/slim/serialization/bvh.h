@@ -4,13 +4,14 @@
 #include "../scene/bvh.h"
 
 u32 getSizeInBytes(const BVH &bvh) {
-    return sizeof(BVHNode) * bvh.node_count;
+    return sizeof(BVHNode) * (bvh.node_count + 1) + CACHE_LINE_SIZE;
 }
 
 bool allocateMemory(BVH &bvh, memory::MonotonicAllocator *memory_allocator) {
     if (getSizeInBytes(bvh) > (memory_allocator->capacity - memory_allocator->occupied)) return false;
 
-    bvh.nodes = (BVHNode*)memory_allocator->allocate(sizeof(BVHNode) * bvh.node_count);
+    // Sibling pairs start at odd indices, so the nodes start one node into a cache line for each pair to share one:
+    bvh.nodes = (BVHNode*)memory_allocator->allocate(sizeof(BVHNode) * (bvh.node_count + 1), CACHE_LINE_SIZE) + 1;
 
     return true;
 }
@@ -13,6 +13,9 @@ u32 getSizeInBytes(const Mesh &mesh, u32 *bvh_nodes_size = nullptr) {
     }
 
     memory_size += sizeof(Triangle) * mesh.triangle_count;
+    memory_size += sizeof(TriangleBlock) * getMaxTriangleBlockCount(mesh.triangle_count, mesh.bvh.node_count) + CACHE_LINE_SIZE;
+    memory_size += sizeof(u32) * mesh.triangle_count;
+    memory_size += sizeof(WideBVHNode) * getWideBVHNodeCount(mesh.bvh.node_count) + CACHE_LINE_SIZE;
     memory_size += sizeof(vec3) * mesh.vertex_count;
     memory_size += sizeof(TriangleVertexIndices) * mesh.triangle_count;
     memory_size += sizeof(EdgeVertexIndices) * mesh.edge_count;
@@ -30,6 +33,7 @@ u32 getSizeInBytes(const Mesh &mesh, u32 *bvh_nodes_size = nullptr) {
 }
 
 bool allocateMemory(Mesh &mesh, memory::MonotonicAllocator *memory_allocator, memory::MonotonicAllocator *memory_allocator_for_bvh_nodes = nullptr) {
+    if (!memory_allocator->address) return false; // The allocator's memory could not be reserved (as for a corrupt header)
     if (memory_allocator_for_bvh_nodes) {
         u32 bvh_nodes_size;
         if (getSizeInBytes(mesh, &bvh_nodes_size) > (memory_allocator->capacity - memory_allocator->occupied)) return false;
@@ -39,6 +43,11 @@ bool allocateMemory(Mesh &mesh, memory::MonotonicAllocator *memory_allocator, me
         allocateMemory(mesh.bvh, memory_allocator);
     }
     mesh.triangles               = (Triangle*             )memory_allocator->allocate(sizeof(Triangle)              * mesh.triangle_count);
+    mesh.triangle_blocks         = (TriangleBlock*        )memory_allocator->allocate(sizeof(TriangleBlock)         * getMaxTriangleBlockCount(mesh.triangle_count, mesh.bvh.node_count), CACHE_LINE_SIZE);
+    mesh.triangle_block_ids      = (u32*                  )memory_allocator->allocate(sizeof(u32)                   * mesh.triangle_count);
+    u32 wide_bvh_node_count = getWideBVHNodeCount(mesh.bvh.node_count);
+    if (wide_bvh_node_count)
+        mesh.wide_bvh.nodes      = (WideBVHNode*          )memory_allocator->allocate(sizeof(WideBVHNode)           * wide_bvh_node_count, CACHE_LINE_SIZE);
     mesh.vertex_positions        = (vec3*                 )memory_allocator->allocate(sizeof(vec3)                  * mesh.vertex_count);
     mesh.vertex_position_indices = (TriangleVertexIndices*)memory_allocator->allocate(sizeof(TriangleVertexIndices) * mesh.triangle_count);
     mesh.edge_vertex_indices     = (EdgeVertexIndices*    )memory_allocator->allocate(sizeof(EdgeVertexIndices)     * mesh.edge_count);
@@ -102,6 +111,10 @@ void readContent(Mesh &mesh, void *file) {
         os::readFromFile(mesh.vertex_normal_indices,         sizeof(TriangleVertexIndices) * mesh.triangle_count, file);
     }
     readContent(mesh.bvh, file);
+
+    // Triangle blocks and the wide BVH are not stored, as they are derived from the triangles and the binary BVH:
+    updateTriangleBlocks(mesh);
+    collapseBVH(mesh.bvh, mesh.wide_bvh);
 }
 void writeContent(const Mesh &mesh, void *file) {
     os::writeToFile((void*)&mesh.aabb.min,       sizeof(vec3), file);
@@ -155,8 +168,14 @@ bool load(Mesh &mesh, char *file_path,
     if (memory_allocator) {
         mesh = Mesh{};
         readHeader(mesh, file);
-        if (!allocateMemory(mesh, memory_allocator, memory_allocator_for_bvh_nodes)) return false;
-    } else if (!mesh.vertex_positions) return false;
+        if (!allocateMemory(mesh, memory_allocator, memory_allocator_for_bvh_nodes)) {
+            os::closeFile(file);
+            return false;
+        }
+    } else if (!mesh.vertex_positions) {
+        os::closeFile(file);
+        return false;
+    }
     readContent(mesh, file);
     os::closeFile(file);
     return true;
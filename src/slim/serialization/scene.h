@@ -29,8 +29,10 @@ void load(Scene &scene, SceneIO &scene_io) {
     }
 
     if (scene.counts.geometries)
-        for (u32 i = 0; i < scene.counts.geometries; i++)
+        for (u32 i = 0; i < scene.counts.geometries; i++) {
             os::readFromFile(scene.geometries + i, sizeof(Geometry), file_handle);
+            scene.geometries[i].flags |= GEOMETRY_IS_DIRTY;
+        }
 
     if (scene.counts.grids)
         for (u32 i = 0; i < scene.counts.grids; i++)
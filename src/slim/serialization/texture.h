@@ -79,6 +79,25 @@ u32 getTotalMemoryForTextures(String *texture_files, u32 texture_count) {
     return memory_size;
 }
 
+// Loads an irradiance cube map just to project it onto spherical harmonics (see IrradianceSH), so that the cube map
+// need not be among the scene's textures (nor uploaded to the GPU). Its texels are read into the given allocator,
+// which gets rewound to where it was afterwards (so the memory is reused by whatever gets allocated next).
+// Its capacity can be had from getTotalMemoryForTextures():
+bool loadIrradianceSH(IrradianceSH &irradiance_sh, char *file_path, memory::MonotonicAllocator *memory_allocator) {
+    Texture cube_map;
+    if (!loadHeader(cube_map, file_path)) return false;
+
+    u8 *address = memory_allocator->address;
+    u64 occupied = memory_allocator->occupied;
+
+    bool loaded = load(cube_map, file_path, memory_allocator);
+    if (loaded) irradiance_sh.project(cube_map);
+
+    memory_allocator->address = address;
+    memory_allocator->occupied = occupied;
+    return loaded;
+}
+
 struct TexturePack {
     TexturePack(u8 count, Texture *textures, String *texture_files, char **files, char* adjacent_file, u64 memory_base = Terabytes(3)) {
         u32 memory_size{0};